@@ -0,0 +1,134 @@
+// Counts heap allocations made per event on the publish and dequeue paths.
+//
+// Global operator new is replaced with a counting version. After a warm-up period (which lets
+// vectors, the index ring, and the file number index reach their steady-state capacity) each
+// event is published and sent, and the number of allocations is checked against the expected
+// value for each storage backend.
+//
+// Only C++ allocations (operator new) are counted. The stub CloudEvent holds its name and data
+// with malloc() (StubAllocator), as Device OS allocates that storage itself, so it is not counted.
+// The event name and data are longer than the std::string small-string size, so a copy of either
+// made by the library is counted.
+//
+// Limits: the RAM and memory mapped backends allocate once per event, because the default
+// saveEventData() copies the data with CloudEvent::dataBuffer(). Structured events and batching
+// are not tested; they allocate while converting the Variant.
+
+#include "PublishQueueExtRK.h"
+
+#include <new>
+
+// The replacements below pair operator new with free(), which gcc reports when it inlines them
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+static size_t allocCount = 0;
+
+void *operator new(size_t size) {
+    allocCount++;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+void operator delete[](void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+struct PacingNone {
+    static constexpr unsigned long kWaitAfterConnect = 0;
+    static constexpr unsigned long kWaitBetweenPublish = 0;
+    static constexpr unsigned long kWaitAfterFailure = 1000;
+};
+
+typedef PublishQueueExtT<PublishQueueExtStoragePosix, PacingNone> PosixQueue;
+typedef PublishQueueExtT<PublishQueueExtStorageRam, PacingNone> RamQueue;
+typedef PublishQueueExtT<PublishQueueExtStorageMmap, PacingNone> MmapQueue;
+
+static const int kWarmUpEvents = 200;
+static const int kTestEvents = 1000;
+
+static const char *kEventName = "allocation-test-event";
+static const size_t kDataSize = 200;
+
+static void publishAndSend(PublishQueueExtBase &queue, int ii) {
+    char data[kDataSize + 1];
+    int len = snprintf(data, sizeof(data), "%d ", ii % 10000);
+    memset(&data[len], 'x', kDataSize - len);
+    data[kDataSize] = 0;
+    queue.publish(kEventName, data);
+
+    for(int loops = 0; loops < 10 && queue.getNumEvents() != 0; loops++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+}
+
+/**
+ * @brief Publishes events and checks the number of allocations per event
+ *
+ * @param queue Queue to test. setup() must already have been called.
+ *
+ * @param name Name of the backend for the output
+ *
+ * @param expectedPerEvent Expected allocations per event
+ */
+static bool runTest(PublishQueueExtBase &queue, const char *name, size_t expectedPerEvent) {
+    for(int ii = 0; ii < kWarmUpEvents; ii++) {
+        publishAndSend(queue, ii);
+    }
+
+    int startCount = stubPublishCount;
+    size_t startAlloc = allocCount;
+    for(int ii = 0; ii < kTestEvents; ii++) {
+        publishAndSend(queue, ii);
+    }
+    size_t numAlloc = allocCount - startAlloc;
+    int numSent = stubPublishCount - startCount;
+
+    bool ok = (numSent == kTestEvents) && (numAlloc == expectedPerEvent * kTestEvents);
+    printf("%-6s events=%d allocations=%zu (%.2f per event, expected %zu) %s\n",
+        name, numSent, numAlloc, (double)numAlloc / kTestEvents, expectedPerEvent, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        stubLogLevel = 1;
+    }
+    stubRecordPublished = false;
+
+    bool ok = true;
+
+    system("rm -rf /tmp/pqalloc-posix /tmp/pqalloc-mmap");
+
+    PosixQueue &posixQueue = PosixQueue::instance();
+    posixQueue.withDirPath("/tmp/pqalloc-posix");
+    posixQueue.setup();
+    ok = runTest(posixQueue, "posix", 0) && ok;
+
+    // The default saveEventData() copies the event data using CloudEvent::dataBuffer()
+    RamQueue &ramQueue = RamQueue::instance();
+    ramQueue.setup();
+    ok = runTest(ramQueue, "ram", 1) && ok;
+
+    MmapQueue &mmapQueue = MmapQueue::instance();
+    mmapQueue.withDirPath("/tmp/pqalloc-mmap");
+    mmapQueue.setup();
+    ok = runTest(mmapQueue, "mmap", 1) && ok;
+
+    printf(ok ? "AllocTest passed\n" : "AllocTest FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+// Benchmark of the PublishQueueExtBatch block format.
+//
+// Blocks of 10 and 20 events with 4 keys (a float temperature, two slowly changing integers, and a
+// short string) are built one row at a time with encode() and append(), as withBatching() does, then
+// decoded. The block size is compared to the total size of the same events as separate JSON objects,
+// and the encode and decode times per row are printed.
+//
+// The JSON is formatted here, compactly and with numbers formatted by %g, as the stub Variant does
+// not produce JSON. Times are for the host, not a device.
+//
+// Usage: BatchBench [iterations] (default: 10000)
+
+#include "PublishQueueExtRK.h"
+
+#include <chrono>
+
+static const size_t kBufSize = 1024;
+
+/**
+ * @brief Row ii of the test data
+ */
+static Variant makeRow(int ii) {
+    Variant row;
+    row.set("temp", Variant(21.5 + (ii % 4) * 0.25));
+    row.set("count", Variant(1000 + ii));
+    row.set("rssi", Variant(-60 - (ii % 3)));
+    row.set("state", Variant((ii % 5) ? "ok" : "warn"));
+    return row;
+}
+
+/**
+ * @brief Formats a row as a compact JSON object
+ */
+static std::string toJson(const Variant &row) {
+    std::string result = "{";
+    for(const auto &kv : row.toMap()) {
+        char value[32];
+        if (kv.second.isString()) {
+            snprintf(value, sizeof(value), "\"%s\"", kv.second.toString().c_str());
+        }
+        else
+        if (kv.second.isDouble()) {
+            snprintf(value, sizeof(value), "%g", kv.second.toDouble());
+        }
+        else {
+            snprintf(value, sizeof(value), "%lld", (long long)kv.second.toInt64());
+        }
+        if (result.size() > 1) {
+            result += ",";
+        }
+        result += "\"" + std::string(kv.first.c_str()) + "\":" + value;
+    }
+    return result + "}";
+}
+
+/**
+ * @brief Builds a block of numRows rows. Returns the size, or 0 on error.
+ */
+static size_t buildBlock(const std::vector<Variant> &rows, size_t numRows, uint8_t *buf, uint8_t *tempBuf) {
+    size_t len = PublishQueueExtBatch::encode(rows[0], 1700000000, buf, kBufSize);
+    for(size_t ii = 1; len && ii < numRows; ii++) {
+        len = PublishQueueExtBatch::append(buf, len, rows[ii], 1700000000 + ii * 60, tempBuf, kBufSize);
+        memcpy(buf, tempBuf, len);
+    }
+    return len;
+}
+
+static bool runBench(size_t numRows, int iterations) {
+    std::vector<Variant> rows;
+    size_t jsonSize = 0;
+    for(size_t ii = 0; ii < numRows; ii++) {
+        rows.push_back(makeRow((int)ii));
+        jsonSize += toJson(rows.back()).size();
+    }
+
+    uint8_t buf[kBufSize];
+    uint8_t tempBuf[kBufSize];
+    size_t len = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for(int ii = 0; ii < iterations; ii++) {
+        len = buildBlock(rows, numRows, buf, tempBuf);
+    }
+    double encodeUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    size_t numDecoded = 0;
+    start = std::chrono::steady_clock::now();
+    for(int ii = 0; ii < iterations; ii++) {
+        PublishQueueExtBatch::decode(buf, len, [&numDecoded](uint32_t timestamp, const Variant &row) {
+            numDecoded++;
+        });
+    }
+    double decodeUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    bool ok = (len != 0) && (numDecoded == numRows * iterations);
+    printf("rows=%-3u block %4u bytes, JSON %4u bytes (%.0f%%)  encode %.2f us/row  decode %.2f us/row %s\n",
+        (unsigned)numRows, (unsigned)len, (unsigned)jsonSize, 100.0 * len / jsonSize,
+        encodeUs / iterations / numRows, decodeUs / iterations / numRows, ok ? "" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 10000;
+
+    bool ok = true;
+    ok = runBench(10, iterations) && ok;
+    ok = runBench(20, iterations) && ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,288 @@
+// Tests for the PublishQueueExtBatch block format.
+//
+// Rows are encoded and appended one at a time, then the block is decoded and compared to the rows,
+// including negative and large integer deltas (zigzag encoding) and timestamps that go backwards.
+// append() must refuse rows with missing, extra, or reordered keys, values that don't fit the column
+// type, and blocks that don't fit in the buffer. Finally, structured events are published through a
+// queue with withBatching() and the blocks that are sent are decoded.
+//
+// The stub Variant stores booleans as integers, so BOOL columns are not tested here.
+
+#include "PublishQueueExtRK.h"
+
+#include <limits.h>
+
+struct PacingNone {
+    static constexpr unsigned long kWaitAfterConnect = 0;
+    static constexpr unsigned long kWaitBetweenPublish = 0;
+    static constexpr unsigned long kWaitAfterFailure = 1000;
+};
+
+typedef PublishQueueExtT<PublishQueueExtStorageRam, PacingNone> RamQueue;
+
+static bool check(bool condition, const char *test, const char *what) {
+    if (!condition) {
+        printf("%-10s FAIL %s\n", test, what);
+    }
+    return condition;
+}
+
+static void report(bool ok, const char *test, const char *description) {
+    printf("%-10s %s %s\n", test, description, ok ? "ok" : "FAIL");
+}
+
+/**
+ * @brief Returns true if two Variant values have the same type and value
+ */
+static bool sameValue(const Variant &a, const Variant &b) {
+    if (a.isInt() && b.isInt()) {
+        return a.toInt64() == b.toInt64();
+    }
+    if (a.isDouble() && b.isDouble()) {
+        return a.toDouble() == b.toDouble();
+    }
+    if (a.isString() && b.isString()) {
+        return a.toString() == b.toString();
+    }
+    return false;
+}
+
+/**
+ * @brief Returns true if two maps have the same keys in the same order with the same values
+ */
+static bool sameRow(const Variant &a, const Variant &b) {
+    VariantMap mapA = a.toMap();
+    VariantMap mapB = b.toMap();
+    if (mapA.size() != mapB.size()) {
+        return false;
+    }
+    for(size_t ii = 0; ii < mapA.size(); ii++) {
+        if (mapA[ii].first != mapB[ii].first || !sameValue(mapA[ii].second, mapB[ii].second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Encodes the rows into one block, one row at a time, as withBatching() does
+ *
+ * @return The block, or an empty vector if encode() or append() failed
+ */
+static std::vector<uint8_t> encodeRows(const std::vector<Variant> &rows, const std::vector<uint32_t> &timestamps) {
+    std::vector<uint8_t> block(4096);
+    size_t len = PublishQueueExtBatch::encode(rows[0], timestamps[0], block.data(), block.size());
+
+    for(size_t ii = 1; len && ii < rows.size(); ii++) {
+        std::vector<uint8_t> newBlock(4096);
+        len = PublishQueueExtBatch::append(block.data(), len, rows[ii], timestamps[ii], newBlock.data(), newBlock.size());
+        block.swap(newBlock);
+    }
+    block.resize(len);
+    return block;
+}
+
+/**
+ * @brief Decodes a block and compares it to the rows and timestamps
+ */
+static bool checkDecode(const std::vector<uint8_t> &block, const std::vector<Variant> &rows, const std::vector<uint32_t> &timestamps, const char *test) {
+    bool ok = true;
+    size_t rowNum = 0;
+
+    bool decoded = PublishQueueExtBatch::decode(block.data(), block.size(), [&](uint32_t timestamp, const Variant &row) {
+        if (rowNum < rows.size()) {
+            ok = check(timestamp == timestamps[rowNum], test, "timestamp changed") && ok;
+            ok = check(sameRow(row, rows[rowNum]), test, "row changed") && ok;
+        }
+        rowNum++;
+    });
+    ok = check(decoded, test, "decode() failed") && ok;
+    ok = check(rowNum == rows.size() && PublishQueueExtBatch::getNumRows(block.data(), block.size()) == rows.size(), test, "wrong number of rows") && ok;
+    return ok;
+}
+
+static Variant makeRow(long long count, double temp, double precise, const char *state) {
+    Variant row;
+    row.set("count", Variant(count));
+    row.set("temp", Variant(temp));
+    row.set("precise", Variant(precise));
+    row.set("state", Variant(state));
+    return row;
+}
+
+/**
+ * @brief Round trip of integer, float, double, and string columns with negative and large deltas
+ */
+static bool testRoundTrip() {
+    bool ok = true;
+
+    std::vector<Variant> rows = {
+        makeRow(5, 21.5, 0.1, "idle"),
+        makeRow(-3, -4.25, -123456.789, ""),
+        makeRow(-1000000, 0.0, 1e300, "running"),
+        makeRow(LLONG_MAX / 2, 100.125, -0.3, "idle"),
+        makeRow(-(LLONG_MAX / 2), 21.5, 0.1, std::string(PublishQueueExtBatch::kMaxStringLen, 's').c_str()),
+        makeRow(0, 21.5, 0.1, "idle"),
+    };
+    // Timestamps can go backwards (the time was set) and are 0 when the time is not valid
+    std::vector<uint32_t> timestamps = { 1700000000, 1700000060, 1600000000, 0, 0xffffffff, 1700000120 };
+
+    std::vector<uint8_t> block = encodeRows(rows, timestamps);
+    ok = check(!block.empty() && PublishQueueExtBatch::isBlock(block.data(), block.size()), "roundtrip", "encode or append failed") && ok;
+    ok = checkDecode(block, rows, timestamps, "roundtrip") && ok;
+
+    report(ok, "roundtrip", "6 rows with negative deltas, doubles, and strings");
+    return ok;
+}
+
+/**
+ * @brief append() refuses rows that don't match the block
+ */
+static bool testSchema() {
+    bool ok = true;
+
+    std::vector<Variant> rows = { makeRow(1, 21.5, 0.1, "a") };
+    std::vector<uint32_t> timestamps = { 1700000000 };
+    std::vector<uint8_t> block = encodeRows(rows, timestamps);
+    uint8_t buf[1024];
+
+    // A float value can be added to a double column
+    size_t len = PublishQueueExtBatch::append(block.data(), block.size(), makeRow(2, 22.0, 0.5, "b"), 0, buf, sizeof(buf));
+    ok = check(len != 0, "schema", "float in a double column refused") && ok;
+
+    // A double that is not exactly a float can't be added to a float column
+    len = PublishQueueExtBatch::append(block.data(), block.size(), makeRow(2, 22.1, 0.5, "b"), 0, buf, sizeof(buf));
+    ok = check(len == 0, "schema", "double in a float column accepted") && ok;
+
+    // Missing, extra, and reordered keys
+    Variant missing;
+    missing.set("count", Variant(2));
+    missing.set("temp", Variant(22.0));
+    missing.set("precise", Variant(0.5));
+    ok = check(PublishQueueExtBatch::append(block.data(), block.size(), missing, 0, buf, sizeof(buf)) == 0, "schema", "missing column accepted") && ok;
+
+    Variant extra = makeRow(2, 22.0, 0.5, "b");
+    extra.set("extra", Variant(1));
+    ok = check(PublishQueueExtBatch::append(block.data(), block.size(), extra, 0, buf, sizeof(buf)) == 0, "schema", "extra column accepted") && ok;
+
+    Variant reordered;
+    reordered.set("temp", Variant(22.0));
+    reordered.set("count", Variant(2));
+    reordered.set("precise", Variant(0.5));
+    reordered.set("state", Variant("b"));
+    ok = check(PublishQueueExtBatch::append(block.data(), block.size(), reordered, 0, buf, sizeof(buf)) == 0, "schema", "reordered columns accepted") && ok;
+
+    // A string in an integer column, and a string that is too long
+    Variant wrongType = makeRow(2, 22.0, 0.5, "b");
+    wrongType.set("count", Variant("2"));
+    ok = check(PublishQueueExtBatch::append(block.data(), block.size(), wrongType, 0, buf, sizeof(buf)) == 0, "schema", "string in an int column accepted") && ok;
+
+    std::string longString(PublishQueueExtBatch::kMaxStringLen + 1, 's');
+    ok = check(PublishQueueExtBatch::append(block.data(), block.size(), makeRow(2, 22.0, 0.5, longString.c_str()), 0, buf, sizeof(buf)) == 0, "schema", "string too long accepted") && ok;
+
+    // A corrupted block
+    std::vector<uint8_t> truncated(block.begin(), block.end() - 1);
+    ok = check(PublishQueueExtBatch::append(truncated.data(), truncated.size(), makeRow(2, 22.0, 0.5, "b"), 0, buf, sizeof(buf)) == 0, "schema", "truncated block accepted") && ok;
+    ok = check(!PublishQueueExtBatch::decode(truncated.data(), truncated.size(), [](uint32_t, const Variant &) {}), "schema", "truncated block decoded") && ok;
+
+    report(ok, "schema", "missing, extra, reordered, and mismatched columns refused");
+    return ok;
+}
+
+/**
+ * @brief encode() and append() return 0 instead of writing past the end of the buffer
+ */
+static bool testBufferFull() {
+    bool ok = true;
+
+    std::vector<Variant> rows = { makeRow(1, 21.5, 0.1, "a") };
+    std::vector<uint32_t> timestamps = { 1700000000 };
+    std::vector<uint8_t> block = encodeRows(rows, timestamps);
+
+    Variant row = makeRow(2, 22.0, 0.5, "b");
+    uint8_t buf[1024];
+    size_t len = PublishQueueExtBatch::append(block.data(), block.size(), row, 1700000060, buf, sizeof(buf));
+    ok = check(len > block.size(), "bufferfull", "append() failed") && ok;
+
+    // Exactly the right size fits. One byte less does not, and nothing is written past the end.
+    std::vector<uint8_t> exact(len + 16, 0xa5);
+    ok = check(PublishQueueExtBatch::append(block.data(), block.size(), row, 1700000060, exact.data(), len) == len, "bufferfull", "exact size refused") && ok;
+    std::vector<uint8_t> small(len + 16, 0xa5);
+    ok = check(PublishQueueExtBatch::append(block.data(), block.size(), row, 1700000060, small.data(), len - 1) == 0, "bufferfull", "append() past the end") && ok;
+    bool untouched = true;
+    for(size_t ii = len - 1; ii < small.size(); ii++) {
+        untouched = untouched && small[ii] == 0xa5;
+    }
+    ok = check(untouched, "bufferfull", "wrote past the end of the buffer") && ok;
+
+    ok = check(PublishQueueExtBatch::encode(rows[0], timestamps[0], buf, block.size() - 1) == 0, "bufferfull", "encode() past the end") && ok;
+
+    report(ok, "bufferfull", "encode() and append() with a buffer that is too small");
+    return ok;
+}
+
+/**
+ * @brief Structured events published with withBatching() are sent as blocks that decode to the events
+ */
+static bool testQueue(RamQueue &queue) {
+    bool ok = true;
+
+    stubPublished.clear();
+    Particle.conn = false;
+    queue.withBatching(4, 1024);
+
+    std::vector<Variant> rows;
+    std::vector<uint32_t> timestamps;
+    for(int ii = 0; ii < 6; ii++) {
+        // precise is never exactly a float, so it stays a DOUBLE column and every row can be appended
+        rows.push_back(makeRow(100 - ii * 7, 20.0 + ii * 0.5, 0.01 + ii * 0.1, (ii % 2) ? "on" : "off"));
+        timestamps.push_back(Time.t);
+        queue.publish(CloudEvent().name("batch").data(rows.back()));
+        Time.t += 60;
+    }
+    ok = check(queue.getNumEvents() == 2, "queue", "events not combined into 2 blocks") && ok;
+
+    Particle.conn = true;
+    for(int ii = 0; ii < 100 && queue.getNumEvents() != 0; ii++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+    ok = check(stubPublished.size() == 2, "queue", "wrong number of blocks sent") && ok;
+
+    size_t rowNum = 0;
+    for(const auto &sent : stubPublished) {
+        size_t colon = sent.find(':');
+        ok = check(sent.substr(0, colon) == "batch", "queue", "wrong event name") && ok;
+        std::vector<uint8_t> block(sent.begin() + colon + 1, sent.end());
+        size_t numRows = PublishQueueExtBatch::getNumRows(block.data(), block.size());
+        if (rowNum + numRows <= rows.size()) {
+            ok = checkDecode(block, std::vector<Variant>(rows.begin() + rowNum, rows.begin() + rowNum + numRows),
+                std::vector<uint32_t>(timestamps.begin() + rowNum, timestamps.begin() + rowNum + numRows), "queue") && ok;
+        }
+        rowNum += numRows;
+    }
+    ok = check(rowNum == rows.size(), "queue", "rows lost") && ok;
+
+    queue.withBatching(0);
+    Time.t = 1700000000;
+    report(ok, "queue", "6 events published with withBatching(4) sent as 2 blocks");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        stubLogLevel = 1;
+    }
+    bool ok = true;
+
+    ok = testRoundTrip() && ok;
+    ok = testSchema() && ok;
+    ok = testBufferFull() && ok;
+
+    RamQueue &ramQueue = RamQueue::instance();
+    ramQueue.setup();
+    ok = testQueue(ramQueue) && ok;
+
+    printf(ok ? "BatchTest passed\n" : "BatchTest FAILED\n");
+    return ok ? 0 : 1;
+}
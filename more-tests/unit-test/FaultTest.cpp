@@ -0,0 +1,284 @@
+// Fault injection test for the queue record CRC and the recovery scan in setup().
+//
+// For the POSIX and mmap backends, the newest record is truncated at every length and has one byte
+// changed at every offset, as a reset during a write or a flash error would. After each fault, setup()
+// must discard that record and keep the older ones. An older corrupted record must be found by
+// withFullRecoveryScan() and removeCorrupted(). Finally, the time setup() takes to recover a large
+// queue is measured with and without the full scan.
+
+#include "PublishQueueExtRK.h"
+
+#include <chrono>
+
+struct PacingNone {
+    static constexpr unsigned long kWaitAfterConnect = 0;
+    static constexpr unsigned long kWaitBetweenPublish = 0;
+    static constexpr unsigned long kWaitAfterFailure = 1000;
+};
+
+/**
+ * @brief Mmap backend with access to the slots, to modify records in place
+ */
+class FaultStorageMmap : public PublishQueueExtStorageMmap {
+public:
+    /**
+     * @brief Gets the slot index for a file number, or -1 if not found
+     */
+    int getSlotIndex(int fileNum) const {
+        SlotHeader *slot = findSlot(fileNum);
+        if (!slot) {
+            return -1;
+        }
+        return (int)(((uint8_t *)slot - mapAddr - sizeof(FileHeader)) / slotSize);
+    }
+
+    /**
+     * @brief Writes the record data for fileNum to a slot, reclaiming the slot if setup() freed it
+     */
+    void writeSlot(int slotIndex, int fileNum, const std::vector<uint8_t> &data) {
+        SlotHeader *slot = getSlot(slotIndex);
+        slot->fileNum = (uint32_t)fileNum;
+        slot->size = (uint32_t)data.size();
+        if (!data.empty()) {
+            memcpy((uint8_t *)slot + sizeof(SlotHeader), data.data(), data.size());
+        }
+    }
+};
+
+typedef PublishQueueExtT<PublishQueueExtStoragePosix, PacingNone> PosixQueue;
+typedef PublishQueueExtT<FaultStorageMmap, PacingNone> MmapQueue;
+
+/**
+ * @brief Reads and writes the stored bytes of one record, bypassing the queue
+ */
+class RecordAccess {
+public:
+    virtual ~RecordAccess() {}
+    virtual void select(int fileNum) = 0;
+    virtual std::vector<uint8_t> read() = 0;
+    virtual void write(const std::vector<uint8_t> &data) = 0;
+};
+
+class PosixRecordAccess : public RecordAccess {
+public:
+    PosixRecordAccess(PublishQueueExtStoragePosix &storage) : storage(storage) {}
+
+    virtual void select(int fileNum) override {
+        path = storage.getPathForFileNum(fileNum);
+    }
+    virtual std::vector<uint8_t> read() override {
+        std::vector<uint8_t> data(64 * 1024);
+        FILE *fp = fopen(path.c_str(), "rb");
+        data.resize(fp ? fread(data.data(), 1, data.size(), fp) : 0);
+        if (fp) {
+            fclose(fp);
+        }
+        return data;
+    }
+    virtual void write(const std::vector<uint8_t> &data) override {
+        FILE *fp = fopen(path.c_str(), "wb");
+        if (fp) {
+            if (!data.empty()) {
+                fwrite(data.data(), 1, data.size(), fp);
+            }
+            fclose(fp);
+        }
+    }
+
+    PublishQueueExtStoragePosix &storage;
+    std::string path;
+};
+
+class MmapRecordAccess : public RecordAccess {
+public:
+    MmapRecordAccess(FaultStorageMmap &storage) : storage(storage) {}
+
+    virtual void select(int fileNum) override {
+        this->fileNum = fileNum;
+        slotIndex = storage.getSlotIndex(fileNum);
+    }
+    virtual std::vector<uint8_t> read() override {
+        size_t size = 0;
+        storage.getSize(fileNum, size);
+        std::vector<uint8_t> data(size);
+        storage.readRange(fileNum, 0, data.data(), size);
+        return data;
+    }
+    virtual void write(const std::vector<uint8_t> &data) override {
+        storage.writeSlot(slotIndex, fileNum, data);
+    }
+
+    FaultStorageMmap &storage;
+    int fileNum = 0;
+    int slotIndex = -1;
+};
+
+static bool check(bool condition, const char *name, const char *what, size_t offset) {
+    if (!condition) {
+        printf("%-6s FAIL %s at offset %u\n", name, what, (unsigned)offset);
+    }
+    return condition;
+}
+
+/**
+ * @brief Remove all events. clearQueues() can remove the queue directory, so set up the storage again.
+ */
+static void resetQueue(PublishQueueExtBase &queue) {
+    queue.setPausePublishing(true);
+    queue.clearQueues();
+    queue.setup();
+}
+
+static int getLastFileNum(PublishQueueExtBase &queue) {
+    int fileNum = 0;
+    for(const auto &info : queue.events()) {
+        fileNum = info.getFileNum();
+    }
+    return fileNum;
+}
+
+static int getFirstFileNum(PublishQueueExtBase &queue) {
+    for(const auto &info : queue.events()) {
+        return info.getFileNum();
+    }
+    return 0;
+}
+
+/**
+ * @brief Queue three events, then a fourth that is truncated and corrupted
+ */
+static bool testNewestRecord(PublishQueueExtBase &queue, RecordAccess &access, const char *name) {
+    bool ok = true;
+
+    resetQueue(queue);
+    queue.publish("a", "first event");
+    queue.publish("b", "second event");
+    queue.publish("c", "third event");
+    queue.publish("newest", "the event that is corrupted");
+
+    access.select(getLastFileNum(queue));
+    std::vector<uint8_t> orig = access.read();
+
+    for(size_t len = 0; len < orig.size(); len++) {
+        access.write(std::vector<uint8_t>(orig.begin(), orig.begin() + len));
+        queue.setup();
+        ok = check(queue.getNumEvents() == 3, name, "truncation not handled", len) && ok;
+    }
+
+    for(size_t offset = 0; offset < orig.size(); offset++) {
+        std::vector<uint8_t> data = orig;
+        data[offset] ^= (offset & 1) ? 0x10 : 0x01;
+        access.write(data);
+        queue.setup();
+        ok = check(queue.getNumEvents() == 3, name, "changed byte not detected", offset) && ok;
+    }
+
+    // The original record is still valid, and all four are sent in order
+    access.write(orig);
+    queue.setup();
+    ok = check(queue.getNumEvents() == 4, name, "original record discarded", 0) && ok;
+
+    stubPublished.clear();
+    queue.setPausePublishing(false);
+    for(int ii = 0; ii < 100 && queue.getNumEvents() != 0; ii++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+    ok = check(stubPublished.size() == 4 && stubPublished[3] == "newest:the event that is corrupted", name, "events not sent", 0) && ok;
+
+    printf("%-6s newest record: %u bytes truncated at every length and changed at every offset %s\n",
+        name, (unsigned)orig.size(), ok ? "ok" : "FAIL");
+    return ok;
+}
+
+/**
+ * @brief Corrupt the oldest of three records, which setup() only finds with the full scan
+ */
+static bool testOlderRecord(PublishQueueExtBase &queue, RecordAccess &access, const char *name) {
+    bool ok = true;
+
+    resetQueue(queue);
+    queue.publish("a", "first event");
+    queue.publish("b", "second event");
+    queue.publish("c", "third event");
+
+    access.select(getFirstFileNum(queue));
+    std::vector<uint8_t> data = access.read();
+    data[2] ^= 0x01;
+    access.write(data);
+
+    queue.setup();
+    ok = check(queue.getNumEvents() == 3, name, "older record checked without full scan", 2) && ok;
+    ok = check(queue.removeCorrupted() == 1 && queue.getNumEvents() == 2, name, "removeCorrupted", 2) && ok;
+
+    access.write(data);
+    queue.withFullRecoveryScan(true);
+    queue.setup();
+    queue.withFullRecoveryScan(false);
+    ok = check(queue.getNumEvents() == 2, name, "full recovery scan", 2) && ok;
+
+    printf("%-6s older record: found by removeCorrupted() and withFullRecoveryScan() %s\n", name, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+static double setupMs(PublishQueueExtBase &queue) {
+    auto start = std::chrono::steady_clock::now();
+    queue.setup();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Measure setup() with a full queue, with and without the full recovery scan
+ */
+static bool benchmarkRecovery(PublishQueueExtBase &queue, const char *name, size_t numEvents) {
+    resetQueue(queue);
+    queue.withFileQueueSize(numEvents);
+    for(size_t ii = 0; ii < numEvents; ii++) {
+        char data[32];
+        snprintf(data, sizeof(data), "event %u", (unsigned)ii);
+        queue.publish("bench", data);
+    }
+
+    double newestMs = setupMs(queue);
+    queue.withFullRecoveryScan(true);
+    double fullMs = setupMs(queue);
+    queue.withFullRecoveryScan(false);
+
+    bool ok = (queue.getNumEvents() == numEvents);
+    printf("%-6s recovery with %u events: newest only %.1f ms, full scan %.1f ms (%.1f us per event) %s\n",
+        name, (unsigned)numEvents, newestMs, fullMs, fullMs * 1000 / numEvents, ok ? "ok" : "FAIL");
+
+    resetQueue(queue);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        stubLogLevel = 1;
+    }
+    bool ok = true;
+
+    ok = check(PublishQueueExtBase::crc32("123456789", 9) == 0xcbf43926, "crc32", "check value", 0) && ok;
+
+    system("rm -rf /tmp/pqfault-posix /tmp/pqfault-mmap");
+
+    PosixQueue &posixQueue = PosixQueue::instance();
+    posixQueue.withDirPath("/tmp/pqfault-posix");
+    posixQueue.setup();
+    PosixRecordAccess posixAccess(posixQueue.getStoragePolicy());
+    ok = testNewestRecord(posixQueue, posixAccess, "posix") && ok;
+    ok = testOlderRecord(posixQueue, posixAccess, "posix") && ok;
+    ok = benchmarkRecovery(posixQueue, "posix", 2000) && ok;
+
+    MmapQueue &mmapQueue = MmapQueue::instance();
+    mmapQueue.getStoragePolicy().withSlots(2000, 512);
+    mmapQueue.withDirPath("/tmp/pqfault-mmap");
+    mmapQueue.setup();
+    MmapRecordAccess mmapAccess(mmapQueue.getStoragePolicy());
+    ok = testNewestRecord(mmapQueue, mmapAccess, "mmap") && ok;
+    ok = testOlderRecord(mmapQueue, mmapAccess, "mmap") && ok;
+    ok = benchmarkRecovery(mmapQueue, "mmap", 2000) && ok;
+
+    printf(ok ? "FaultTest passed\n" : "FaultTest FAILED\n");
+    return ok ? 0 : 1;
+}
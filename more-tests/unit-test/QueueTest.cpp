@@ -0,0 +1,504 @@
+// Behavior tests for the queue features, using the simulated cloud in the stub.
+//
+// Each test starts with an empty queue, publishes events while the simulated cloud is
+// disconnected or connected, and checks the queue and the events that were sent.
+
+#include "PublishQueueExtRK.h"
+
+struct PacingNone {
+    static constexpr unsigned long kWaitAfterConnect = 0;
+    static constexpr unsigned long kWaitBetweenPublish = 0;
+    static constexpr unsigned long kWaitAfterFailure = 1000;
+};
+
+typedef PublishQueueExtT<PublishQueueExtStorageMmap, PacingNone> MmapQueue;
+
+/**
+ * @brief POSIX backend where saving an auxiliary blob (the sequence number block) can be made to fail
+ */
+class FailAuxStorage : public PublishQueueExtStoragePosix {
+public:
+    virtual bool saveAux(const char *name, const void *buf, size_t len) override {
+        if (failSaveAux) {
+            return false;
+        }
+        return PublishQueueExtStoragePosix::saveAux(name, buf, len);
+    }
+
+    bool failSaveAux = false; //!< Set to true to make saveAux() fail
+};
+
+typedef PublishQueueExtT<FailAuxStorage, PacingNone> SeqQueue;
+
+static bool check(bool condition, const char *test, const char *what) {
+    if (!condition) {
+        printf("%-10s FAIL %s\n", test, what);
+    }
+    return condition;
+}
+
+static void report(bool ok, const char *test, const char *description) {
+    printf("%-10s %s %s\n", test, description, ok ? "ok" : "FAIL");
+}
+
+/**
+ * @brief Remove all events. clearQueues() can remove the queue directory, so set up the storage again.
+ */
+static void resetQueue(PublishQueueExtBase &queue) {
+    queue.setPausePublishing(true);
+    queue.clearQueues();
+    queue.setup();
+    queue.setPausePublishing(false);
+    stubPublished.clear();
+    stubPublishMode = 0;
+    Particle.conn = true;
+}
+
+/**
+ * @brief Call loop() until the queue is empty, advancing the simulated time 10 ms each time
+ */
+static void drain(PublishQueueExtBase &queue, int maxLoops = 1000) {
+    for(int ii = 0; ii < maxLoops && queue.getNumEvents() != 0; ii++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+}
+
+/**
+ * @brief Publish events named name with data "0", "1", ... and return the number accepted
+ */
+static int publishNumbered(PublishQueueExtBase &queue, const char *name, int count) {
+    int numAccepted = 0;
+    for(int ii = 0; ii < count; ii++) {
+        char data[16];
+        snprintf(data, sizeof(data), "%d", ii);
+        if (queue.publish(name, data)) {
+            numAccepted++;
+        }
+    }
+    return numAccepted;
+}
+
+/**
+ * @brief Overflow the mmap slots while disconnected. Queued events are discarded, not the new ones.
+ */
+static bool testMmapFull(MmapQueue &queue) {
+    bool ok = true;
+
+    resetQueue(queue);
+    Particle.conn = false;
+
+    // More events than slots, with the file queue size larger than the number of slots
+    queue.withFileQueueSize(200);
+    int numAccepted = publishNumbered(queue, "m", 15);
+    ok = check(numAccepted == 15, "mmap", "publish() failed with all slots in use") && ok;
+    ok = check(queue.getNumEvents() == 10, "mmap", "queue not limited to the number of slots") && ok;
+
+    CloudEvent event;
+    event.name("m").data("refused");
+    ok = check(queue.tryPublish(event) == PublishQueueExtBase::PublishStatus::QUEUE_FULL, "mmap", "tryPublish() with all slots in use") && ok;
+    event.data("15");
+    ok = check(queue.publishWithStatus(event) == PublishQueueExtBase::PublishStatus::QUEUED_DISCARDED, "mmap", "publishWithStatus() with all slots in use") && ok;
+
+    // The second oldest events are discarded (the oldest may be being sent) and the newest are kept
+    Particle.conn = true;
+    drain(queue);
+    std::vector<std::string> expected = { "m:0" };
+    for(int ii = 7; ii <= 15; ii++) {
+        expected.push_back("m:" + std::to_string(ii));
+    }
+    ok = check(stubPublished == expected, "mmap", "wrong events discarded") && ok;
+
+    queue.withFileQueueSize(100);
+    report(ok, "mmap", "16 events with 10 slots: oldest discarded, newest kept");
+    return ok;
+}
+
+/**
+ * @brief Iterate the queued events with events() and remove some with removeIf(), including while one is in flight
+ */
+static bool testRemoveIf(MmapQueue &queue) {
+    bool ok = true;
+
+    resetQueue(queue);
+    Particle.conn = false;
+
+    // a:0, b:1, a:2, b:3, ...
+    for(int ii = 0; ii < 8; ii++) {
+        char data[16];
+        snprintf(data, sizeof(data), "%d", ii);
+        queue.publish((ii % 2) ? "b" : "a", data);
+    }
+
+    int count = 0;
+    int lastFileNum = 0;
+    for(const auto &info : queue.events()) {
+        char name[PublishQueueExtBase::kMaxEventNameLen + 1];
+        ok = check(info.getName(name, sizeof(name)) && strcmp(name, (count % 2) ? "b" : "a") == 0, "removeIf", "events() name") && ok;
+        ok = check(info.getSize() == 1 && info.isValid() && !info.isInFlight(), "removeIf", "events() info") && ok;
+        ok = check(info.getFileNum() > lastFileNum, "removeIf", "events() not oldest first") && ok;
+        lastFileNum = info.getFileNum();
+        count++;
+    }
+    ok = check(count == 8, "removeIf", "events() count") && ok;
+
+    size_t numRemoved = queue.removeIf([](const PublishQueueExtBase::EventInfo &info) {
+        char name[PublishQueueExtBase::kMaxEventNameLen + 1];
+        return info.getName(name, sizeof(name)) && strcmp(name, "b") == 0;
+    });
+    ok = check(numRemoved == 4 && queue.getNumEvents() == 4, "removeIf", "removeIf() by name") && ok;
+
+    // Start sending a:0, then remove everything. The event being sent is kept.
+    // The simulated publish completes on the loop() after it's sent.
+    Particle.conn = true;
+    bool sawInFlight = false;
+    for(int ii = 0; ii < 10 && !sawInFlight; ii++) {
+        stubMillis += 10;
+        queue.loop();
+        for(const auto &info : queue.events()) {
+            sawInFlight = sawInFlight || info.isInFlight();
+        }
+    }
+    ok = check(sawInFlight, "removeIf", "in-flight event not reported") && ok;
+
+    numRemoved = queue.removeIf([](const PublishQueueExtBase::EventInfo &info) {
+        return true;
+    });
+    ok = check(numRemoved == 3 && queue.getNumEvents() == 1, "removeIf", "in-flight event removed") && ok;
+
+    drain(queue);
+    ok = check(stubPublished == std::vector<std::string>{ "a:0" }, "removeIf", "wrong events sent") && ok;
+
+    report(ok, "removeIf", "iterate 8 events, remove by name, keep the in-flight event");
+    return ok;
+}
+
+/**
+ * @brief Events with a TTL that expire while the queue is being sent are discarded, not sent
+ */
+static bool testTtl(MmapQueue &queue) {
+    bool ok = true;
+
+    resetQueue(queue);
+    Particle.conn = false;
+    uint32_t startTime = Time.t;
+
+    // Even numbered events expire after 30 seconds, odd numbered events do not expire
+    for(int ii = 0; ii < 6; ii++) {
+        CloudEvent event;
+        event.name("t").data(std::to_string(ii).c_str());
+        queue.publish(event, PublishQueueExtBase::EventOptions().withTtl((ii % 2) ? 0 : 30));
+    }
+
+    // Send the first two, then let the rest of the even numbered events expire
+    Particle.conn = true;
+    for(int ii = 0; ii < 100 && stubPublished.size() < 2; ii++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+    Time.t += 60;
+
+    int numExpired = 0;
+    for(const auto &info : queue.events()) {
+        if (info.isExpired()) {
+            numExpired++;
+        }
+    }
+    ok = check(numExpired == 2, "ttl", "isExpired() count") && ok;
+
+    drain(queue);
+    std::vector<std::string> expected = { "t:0", "t:1", "t:3", "t:5" };
+    ok = check(stubPublished == expected, "ttl", "expired events sent") && ok;
+
+    // removeExpired() discards them without sending
+    Particle.conn = false;
+    queue.publish(CloudEvent().name("t").data("6"), PublishQueueExtBase::EventOptions().withTtl(30));
+    queue.publish(CloudEvent().name("t").data("7"));
+    Time.t += 60;
+    ok = check(queue.removeExpired() == 1 && queue.getNumEvents() == 1, "ttl", "removeExpired()") && ok;
+
+    Time.t = startTime;
+    report(ok, "ttl", "events expiring while draining are discarded");
+    return ok;
+}
+
+/**
+ * @brief Direct publish sends right away when idle, queues behind an event being sent, and saves
+ * events that fail to the queue ahead of later events
+ */
+static bool testDirectPublish(MmapQueue &queue) {
+    typedef PublishQueueExtBase::PublishStatus PublishStatus;
+    bool ok = true;
+
+    resetQueue(queue);
+    queue.withDirectPublish();
+
+    // Let the state machine reach the idle state
+    for(int ii = 0; ii < 10; ii++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+
+    // Sent without being queued; the next one waits for it
+    ok = check(queue.publishWithStatus(CloudEvent().name("d").data("0")) == PublishStatus::SENT, "direct", "not sent when idle") && ok;
+    ok = check(stubPublished.size() == 1, "direct", "not passed to the cloud") && ok;
+    ok = check(queue.publishWithStatus(CloudEvent().name("d").data("1")) == PublishStatus::QUEUED, "direct", "sent while busy") && ok;
+    drain(queue);
+    ok = check(stubPublished == std::vector<std::string>{ "d:0", "d:1" }, "direct", "wrong order") && ok;
+
+    // Failing immediately saves the event to the queue, ahead of the next event
+    stubPublished.clear();
+    stubPublishMode = 2;
+    ok = check(queue.publishWithStatus(CloudEvent().name("d").data("2")) == PublishStatus::QUEUED, "direct", "immediate failure not queued") && ok;
+    stubPublishMode = 0;
+    ok = check(queue.publishWithStatus(CloudEvent().name("d").data("3")) == PublishStatus::QUEUED, "direct", "sent ahead of the queue") && ok;
+    drain(queue);
+    ok = check(stubPublished == std::vector<std::string>{ "d:2", "d:3" }, "direct", "wrong order after immediate failure") && ok;
+
+    // Failing asynchronously saves the event to the queue, ahead of the event published after it
+    for(int ii = 0; ii < 10; ii++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+    stubPublished.clear();
+    stubPublishMode = 1;
+    ok = check(queue.publishWithStatus(CloudEvent().name("d").data("4")) == PublishStatus::SENT, "direct", "not sent when idle") && ok;
+    stubMillis += 10;
+    queue.loop();
+    stubPublishMode = 0;
+    queue.publish("d", "5");
+    drain(queue);
+    // The simulated cloud records the failed attempt too, so d:4 appears twice
+    ok = check(stubPublished == std::vector<std::string>{ "d:4", "d:4", "d:5" }, "direct", "wrong order after async failure") && ok;
+
+    queue.withDirectPublish(false);
+    report(ok, "direct", "direct publish order and fallback to the queue");
+    return ok;
+}
+
+/**
+ * @brief tryPublish() refuses events when the queue is full, and the watermark callback is called
+ * once when crossing the high watermark and once when dropping to the low watermark
+ */
+static bool testWatermarks(MmapQueue &queue) {
+    typedef PublishQueueExtBase::PublishStatus PublishStatus;
+    bool ok = true;
+
+    resetQueue(queue);
+    Particle.conn = false;
+
+    std::vector<std::string> calls;
+    queue.withFileQueueSize(8).withHighWatermark(5).withLowWatermark(2);
+    queue.withWatermarkCallback([&queue, &calls](bool aboveHigh) {
+        calls.push_back(std::string(aboveHigh ? "high:" : "low:") + std::to_string(queue.getNumEvents()));
+    });
+
+    publishNumbered(queue, "w", 4);
+    ok = check(calls.empty() && !queue.isAboveHighWatermark(), "watermark", "called below the high watermark") && ok;
+    queue.publish("w", "4");
+    ok = check(calls == std::vector<std::string>{ "high:5" } && queue.isAboveHighWatermark(), "watermark", "high watermark not reported") && ok;
+
+    // Fill the queue, then tryPublish() refuses the event and publish() discards one
+    ok = check(queue.tryPublish(CloudEvent().name("w").data("5")) == PublishStatus::QUEUED, "watermark", "tryPublish() with room") && ok;
+    queue.publish("w", "6");
+    queue.publish("w", "7");
+    ok = check(queue.tryPublish(CloudEvent().name("w").data("refused")) == PublishStatus::QUEUE_FULL, "watermark", "tryPublish() when full") && ok;
+    ok = check(queue.getNumEvents() == 8, "watermark", "tryPublish() changed the queue") && ok;
+    ok = check(queue.publishWithStatus(CloudEvent().name("w").data("8")) == PublishStatus::QUEUED_DISCARDED, "watermark", "publish() when full") && ok;
+
+    Particle.conn = true;
+    drain(queue);
+    ok = check(calls == std::vector<std::string>{ "high:5", "low:2" } && !queue.isAboveHighWatermark(), "watermark", "low watermark not reported once") && ok;
+    ok = check(stubPublished.size() == 8 && stubPublished.back() == "w:8", "watermark", "wrong events sent") && ok;
+
+    queue.withFileQueueSize(100).withHighWatermark(0).withLowWatermark(0).withWatermarkCallback(nullptr);
+    report(ok, "watermark", "tryPublish() when full and watermark callbacks");
+    return ok;
+}
+
+/**
+ * @brief Registered event names are reloaded by setup(), as after a reset, and queued events are
+ * sent with the right names. Names of up to kMaxEventNameLen characters are accepted.
+ */
+static bool testEventNames(MmapQueue &queue) {
+    typedef PublishQueueExtBase::PublishStatus PublishStatus;
+    bool ok = true;
+
+    resetQueue(queue);
+    Particle.conn = false;
+
+    PublishQueueExtBase::EventNameHandle handleA = queue.registerEventName("reg/a");
+    PublishQueueExtBase::EventNameHandle handleB = queue.registerEventName("reg/b");
+    ok = check(handleA.isValid() && handleB.isValid() && handleA.id != handleB.id, "names", "registerEventName()") && ok;
+
+    queue.publish(handleA, "0");
+    queue.publish("reg/b", "1"); // Uses the ID for reg/b
+    queue.publish("plain", "2");
+    queue.publish(handleB, "3");
+
+    // Names of exactly kMaxEventNameLen characters are accepted, longer names are not
+    std::string longName(PublishQueueExtBase::kMaxEventNameLen, 'n');
+    ok = check(queue.publishWithStatus(CloudEvent().name(longName.c_str()).data("4")) == PublishStatus::QUEUED, "names", "maximum length name refused") && ok;
+    std::string tooLong = longName + "n";
+    ok = check(queue.publishWithStatus(CloudEvent().name(tooLong.c_str()).data("5")) == PublishStatus::INVALID_EVENT, "names", "name too long accepted") && ok;
+
+    // setup() reloads the names from the queue directory
+    queue.setup();
+    ok = check(queue.findEventName("reg/a").id == handleA.id && queue.findEventName("reg/b").id == handleB.id, "names", "handles changed after reload") && ok;
+    ok = check(queue.getEventName(handleB) && strcmp(queue.getEventName(handleB), "reg/b") == 0, "names", "getEventName() after reload") && ok;
+    ok = check(queue.registerEventName("reg/a").id == handleA.id, "names", "registered again after reload") && ok;
+
+    Particle.conn = true;
+    drain(queue);
+    std::vector<std::string> expected = { "reg/a:0", "reg/b:1", "plain:2", "reg/b:3", longName + ":4" };
+    ok = check(stubPublished == expected, "names", "wrong names sent after reload") && ok;
+
+    report(ok, "names", "registered event names survive a reload");
+    return ok;
+}
+
+/**
+ * @brief Call loop() count times, advancing the simulated time stepMs each time
+ */
+static void runLoop(PublishQueueExtBase &queue, int count, unsigned long stepMs = 10) {
+    for(int ii = 0; ii < count; ii++) {
+        stubMillis += stepMs;
+        queue.loop();
+    }
+}
+
+/**
+ * @brief Held events are released by the count, by the maximum hold time, and by an urgent event
+ */
+static bool testHold(MmapQueue &queue) {
+    bool ok = true;
+
+    resetQueue(queue);
+    queue.withHold(60000, 3);
+    runLoop(queue, 5);
+
+    // Released when the count is reached
+    queue.publish("h", "0");
+    runLoop(queue, 10);
+    ok = check(queue.isHolding() && queue.getCanSleep() && stubPublished.empty(), "hold", "first event not held") && ok;
+    unsigned long remaining = queue.getHoldTimeRemaining();
+    ok = check(remaining > 59000 && remaining <= 60000, "hold", "getHoldTimeRemaining() wrong") && ok;
+    queue.publish("h", "1");
+    runLoop(queue, 10);
+    ok = check(stubPublished.empty(), "hold", "released before the count") && ok;
+    queue.publish("h", "2");
+    drain(queue);
+    ok = check(stubPublished == std::vector<std::string>{ "h:0", "h:1", "h:2" } && !queue.isHolding(), "hold", "not released by the count") && ok;
+
+    // Released when the maximum hold time passes
+    stubPublished.clear();
+    queue.publish("h", "3");
+    runLoop(queue, 59, 1000);
+    ok = check(stubPublished.empty() && queue.getHoldTimeRemaining() <= 1000, "hold", "released before the hold time") && ok;
+    runLoop(queue, 5, 1000);
+    ok = check(stubPublished == std::vector<std::string>{ "h:3" } && queue.getNumEvents() == 0, "hold", "not released by the hold time") && ok;
+    ok = check(queue.getHoldTimeRemaining() == 0, "hold", "getHoldTimeRemaining() after release") && ok;
+
+    // An urgent event releases the held events, which are sent first
+    stubPublished.clear();
+    queue.publish("h", "4");
+    runLoop(queue, 10);
+    queue.publish(CloudEvent().name("h").data("5"), PublishQueueExtBase::EventOptions().withUrgent());
+    drain(queue);
+    ok = check(stubPublished == std::vector<std::string>{ "h:4", "h:5" }, "hold", "not released by an urgent event") && ok;
+
+    queue.withHold(0);
+    report(ok, "hold", "held events released by count, time, and urgent event");
+    return ok;
+}
+
+/**
+ * @brief Gets the sequence numbers of the queued events, oldest first
+ */
+static std::vector<uint32_t> getSequences(PublishQueueExtBase &queue) {
+    std::vector<uint32_t> result;
+    for(const auto &info : queue.events()) {
+        result.push_back(info.getSequence());
+    }
+    return result;
+}
+
+/**
+ * @brief Sequence numbers continue after a reset (setup() again), are never assigned twice when the
+ * block can't be saved, and are only added to event names with withSequenceNameSuffix()
+ */
+static bool testSequence(SeqQueue &queue) {
+    typedef PublishQueueExtBase::PublishStatus PublishStatus;
+    bool ok = true;
+
+    resetQueue(queue);
+    Particle.conn = false;
+
+    publishNumbered(queue, "s", 3);
+
+    // Each reset continues after the reserved block. The second one can't save a new block.
+    queue.setup();
+    queue.publish("s", "3");
+    queue.setup();
+    queue.getStoragePolicy().failSaveAux = true;
+    ok = check(queue.publishWithStatus(CloudEvent().name("s").data("refused")) == PublishStatus::STORAGE_ERROR, "sequence", "published without saving the block") && ok;
+    queue.setup();
+    ok = check(queue.publishWithStatus(CloudEvent().name("s").data("refused")) == PublishStatus::STORAGE_ERROR, "sequence", "published after reset without saving the block") && ok;
+    queue.getStoragePolicy().failSaveAux = false;
+    queue.publish("s", "4");
+    queue.setup();
+    queue.publish("s", "5");
+
+    std::vector<uint32_t> sequences = getSequences(queue);
+    const uint32_t blockSize = PublishQueueExtBase::kSequenceBlockSize;
+    std::vector<uint32_t> expected = { 1, 2, 3, 1 + blockSize, 1 + 2 * blockSize, 1 + 3 * blockSize };
+    ok = check(sequences == expected, "sequence", "numbers not unique and increasing across resets") && ok;
+
+    // Text events keep their names unless the suffix is enabled
+    Particle.conn = true;
+    drain(queue);
+    ok = check(stubPublished.size() == 6 && stubPublished[0] == "s:0", "sequence", "name changed without withSequenceNameSuffix()") && ok;
+
+    stubPublished.clear();
+    queue.withSequenceNameSuffix();
+    queue.publish("s", "6");
+    std::string longName(PublishQueueExtBase::kMaxEventNameLen - PublishQueueExtBase::kMaxSequenceSuffixLen + 1, 'n');
+    ok = check(queue.publishWithStatus(CloudEvent().name(longName.c_str()).data("7")) == PublishStatus::INVALID_EVENT, "sequence", "name too long for the suffix accepted") && ok;
+    drain(queue);
+    ok = check(stubPublished == std::vector<std::string>{ "s/" + std::to_string(2 + 3 * blockSize) + ":6" }, "sequence", "suffix not added") && ok;
+
+    queue.withSequenceNameSuffix(false);
+    report(ok, "sequence", "sequence numbers across resets and storage errors");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        stubLogLevel = 1;
+    }
+    bool ok = true;
+
+    system("rm -rf /tmp/pqqueue-mmap");
+
+    MmapQueue &mmapQueue = MmapQueue::instance();
+    mmapQueue.getStoragePolicy().withSlots(10, 1024);
+    mmapQueue.withDirPath("/tmp/pqqueue-mmap");
+    mmapQueue.setup();
+    ok = testMmapFull(mmapQueue) && ok;
+    ok = testRemoveIf(mmapQueue) && ok;
+    ok = testTtl(mmapQueue) && ok;
+    ok = testDirectPublish(mmapQueue) && ok;
+    ok = testWatermarks(mmapQueue) && ok;
+    ok = testEventNames(mmapQueue) && ok;
+    ok = testHold(mmapQueue) && ok;
+
+    system("rm -rf /tmp/pqqueue-seq");
+
+    SeqQueue &seqQueue = SeqQueue::instance();
+    seqQueue.withDirPath("/tmp/pqqueue-seq").withSequenceNumbers();
+    seqQueue.setup();
+    ok = testSequence(seqQueue) && ok;
+
+    printf(ok ? "QueueTest passed\n" : "QueueTest FAILED\n");
+    return ok ? 0 : 1;
+}
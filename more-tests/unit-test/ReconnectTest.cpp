@@ -0,0 +1,112 @@
+// Simulation of the reconnect policy (withFreshEventShare(), withReconnectRampUp(), withReconnectDelay()).
+//
+// 300 events are queued while disconnected, then the device connects and publishes a new event every
+// second until the backlog is sent. Each loop advances the simulated clock by 50 ms, and the stub
+// publish completes on the next loop. The time to send the backlog and the latency of the new events
+// (from publish to publish complete) are printed for each policy. With a 25% fresh event share the
+// average latency of the new events must be lower than with none, and every event must be sent.
+//
+// The times are simulated, so the results are the same on every run.
+
+#include "PublishQueueExtRK.h"
+
+typedef PublishQueueExtT<PublishQueueExtStorageRam> RamQueue;
+
+static const int kNumBacklog = 300;
+
+struct SimResult {
+    unsigned long backlogMs = 0; //!< Time from connecting until the last backlog event was sent
+    unsigned long freshAvgMs = 0; //!< Average latency of the new events
+    unsigned long freshMaxMs = 0; //!< Maximum latency of the new events
+    int freshCount = 0; //!< Number of new events sent
+    bool ok = false; //!< Every event was sent
+};
+
+/**
+ * @brief Runs one simulation with the given reconnect policy and prints the result
+ */
+static SimResult simulate(RamQueue &queue, unsigned int share, unsigned long rampMs, unsigned long delayMs) {
+    SimResult result;
+
+    queue.clearQueues();
+    queue.withFreshEventShare(share).withReconnectRampUp(rampMs, 1000).withReconnectDelay(delayMs);
+
+    Particle.conn = false;
+    for(int ii = 0; ii < 2; ii++) {
+        stubMillis += 50;
+        queue.loop();
+    }
+    for(int ii = 0; ii < kNumBacklog; ii++) {
+        queue.publish("b", "x");
+    }
+
+    unsigned long start = stubMillis;
+    int backlogSent = 0;
+    unsigned long freshTotalMs = 0;
+    queue.withPublishCompleteUserCallback([&](const CloudEvent &event) {
+        if (strcmp(event.name(), "b") == 0) {
+            if (++backlogSent == kNumBacklog) {
+                result.backlogMs = stubMillis - start;
+            }
+        }
+        else {
+            // The data of a new event is the time it was published
+            unsigned long latencyMs = stubMillis - strtoul(event.dataString().c_str(), NULL, 10);
+            freshTotalMs += latencyMs;
+            if (latencyMs > result.freshMaxMs) {
+                result.freshMaxMs = latencyMs;
+            }
+            result.freshCount++;
+        }
+    });
+
+    Particle.conn = true;
+    for(int ii = 0; ii < 4000 && (backlogSent < kNumBacklog || queue.getNumEvents() != 0); ii++) {
+        if ((ii % 20) == 0 && ii < 1200) {
+            char data[16];
+            snprintf(data, sizeof(data), "%lu", stubMillis);
+            queue.publish("f", data);
+        }
+        stubMillis += 50;
+        queue.loop();
+    }
+    queue.withPublishCompleteUserCallback(nullptr);
+
+    if (result.freshCount) {
+        result.freshAvgMs = freshTotalMs / result.freshCount;
+    }
+    result.ok = (backlogSent == kNumBacklog && queue.getNumEvents() == 0);
+
+    printf("share=%-3u ramp=%-5lu delay=%-5lu backlog sent in %6lu ms, %2d new events, latency avg %6lu ms max %6lu ms %s\n",
+        share, rampMs, delayMs, result.backlogMs, result.freshCount, result.freshAvgMs, result.freshMaxMs,
+        result.ok ? "" : "FAIL");
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        stubLogLevel = 1;
+    }
+    stubRecordPublished = false;
+
+    RamQueue &queue = RamQueue::instance();
+    queue.withFileQueueSize(1000);
+    queue.setup();
+
+    bool ok = true;
+
+    SimResult base = simulate(queue, 0, 0, 0);
+    SimResult shared = simulate(queue, 25, 0, 0);
+    SimResult rampUp = simulate(queue, 25, 30000, 5000);
+    ok = base.ok && shared.ok && rampUp.ok;
+
+    if (shared.freshAvgMs >= base.freshAvgMs) {
+        printf("share      FAIL new event latency not reduced\n");
+        ok = false;
+    }
+
+    queue.withFreshEventShare(0).withReconnectRampUp(0, 0).withReconnectDelay(0);
+
+    printf(ok ? "ReconnectTest passed\n" : "ReconnectTest FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+// Benchmark of the POSIX backend with the flat layout and with sharded queue directories.
+//
+// For each queue size, events are created (published while disconnected), the queue directory is
+// scanned as at boot (setup() again), and the events are deleted (sent to the simulated cloud).
+// The time for each step is printed for the flat layout and withShardSize(256).
+//
+// The host file system is much faster than the flash file system on a device, and is less affected by
+// the number of files in a directory, so compare the layouts with each other rather than to a device.
+//
+// Usage: ShardBench [numEvents...] (default: 1000 10000 50000)
+
+#include "PublishQueueExtRK.h"
+
+#include <chrono>
+
+struct PacingNone {
+    static constexpr unsigned long kWaitAfterConnect = 0;
+    static constexpr unsigned long kWaitBetweenPublish = 0;
+    static constexpr unsigned long kWaitAfterFailure = 1000;
+};
+
+typedef PublishQueueExtT<PublishQueueExtStoragePosix, PacingNone> PosixQueue;
+
+static const char *kDirPath = "/tmp/pqshard";
+
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Creates, scans, and deletes numEvents events and prints the times
+ *
+ * @return false if the events were not all created or sent
+ */
+static bool runBench(PosixQueue &queue, int shardSize, int numEvents) {
+    system((std::string("rm -rf ") + kDirPath).c_str());
+
+    queue.getStoragePolicy().withShardSize(shardSize);
+    queue.withFileQueueSize(numEvents);
+    queue.setup();
+
+    Particle.conn = false;
+    auto start = std::chrono::steady_clock::now();
+    for(int ii = 0; ii < numEvents; ii++) {
+        char data[16];
+        snprintf(data, sizeof(data), "%d", ii);
+        queue.publish("bench", data);
+    }
+    double createMs = elapsedMs(start);
+    bool ok = (queue.getNumEvents() == (size_t)numEvents);
+
+    start = std::chrono::steady_clock::now();
+    queue.setup();
+    double scanMs = elapsedMs(start);
+    ok = ok && (queue.getNumEvents() == (size_t)numEvents);
+
+    Particle.conn = true;
+    int startCount = stubPublishCount;
+    start = std::chrono::steady_clock::now();
+    for(int ii = 0; ii < numEvents * 4 && queue.getNumEvents() != 0; ii++) {
+        stubMillis += 10;
+        queue.loop();
+    }
+    double deleteMs = elapsedMs(start);
+    ok = ok && (stubPublishCount - startCount == numEvents);
+
+    printf("%-5s events=%-6d create %8.1f ms (%5.1f us/event)  boot scan %7.1f ms  delete %8.1f ms (%5.1f us/event) %s\n",
+        shardSize ? "shard" : "flat", numEvents,
+        createMs, createMs * 1000 / numEvents, scanMs, deleteMs, deleteMs * 1000 / numEvents,
+        ok ? "" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    std::vector<int> sizes;
+    for(int ii = 1; ii < argc; ii++) {
+        sizes.push_back(atoi(argv[ii]));
+    }
+    if (sizes.empty()) {
+        sizes = { 1000, 10000, 50000 };
+    }
+    stubRecordPublished = false;
+
+    PosixQueue &queue = PosixQueue::instance();
+    queue.withDirPath(kDirPath);
+
+    bool ok = true;
+    for(int numEvents : sizes) {
+        ok = runBench(queue, 0, numEvents) && ok;
+        ok = runBench(queue, 256, numEvents) && ok;
+    }
+
+    // Leave the queue empty with the flat layout
+    queue.clearQueues();
+    system((std::string("rm -rf ") + kDirPath).c_str());
+
+    return ok ? 0 : 1;
+}
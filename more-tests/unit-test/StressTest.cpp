@@ -0,0 +1,158 @@
+// Multiple thread stress test for the queue lock.
+//
+// For 1, 2, 4, ... up to the maximum number of threads, each thread publishes events through all
+// three publish() overloads while the main thread runs loop() until the queue is empty. Every event
+// must be sent once, and the events from each thread must be sent in the order that thread
+// published them. The publish rate, and the lock wait and hold times from getLockStats(), are
+// printed for each thread count.
+//
+// This is built with STUB_REALTIME, so millis() and micros() are the real time, and with
+// PUBLISHQUEUEEXT_LOCK_STATS=1. "make stress-tsan" builds it with ThreadSanitizer instead of
+// AddressSanitizer.
+//
+// Usage: StressTest [maxThreads [eventsPerThread]]
+
+#include "PublishQueueExtRK.h"
+
+#include <atomic>
+#include <map>
+#include <thread>
+
+struct PacingNone {
+    static constexpr unsigned long kWaitAfterConnect = 0;
+    static constexpr unsigned long kWaitBetweenPublish = 0;
+    static constexpr unsigned long kWaitAfterFailure = 1000;
+};
+
+typedef PublishQueueExtT<PublishQueueExtStoragePosix, PacingNone> PosixQueue;
+
+/**
+ * @brief Publishes events named p<thread> with data 0, 1, 2, ... using each publish() overload in turn
+ */
+static void producer(PublishQueueExtBase &queue, int threadNum, int numEvents) {
+    char name[16];
+    snprintf(name, sizeof(name), "p%d", threadNum);
+
+    for(int ii = 0; ii < numEvents; ii++) {
+        char data[16];
+        snprintf(data, sizeof(data), "%d", ii);
+
+        switch(ii % 3) {
+            case 0:
+                queue.publish(name, data);
+                break;
+
+            case 1: {
+                CloudEvent event;
+                event.name(name).data(data);
+                queue.publish(event);
+                break;
+            }
+
+            default: {
+                CloudEvent event;
+                event.name(name).data(data);
+                queue.publish(event, PublishQueueExtBase::EventOptions());
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Checks that each thread's events were sent once each, in order
+ */
+static bool checkSent(int numThreads, int numEvents) {
+    bool ok = true;
+
+    std::map<std::string, int> lastData;
+    for(const auto &sent : stubPublished) {
+        size_t colon = sent.find(':');
+        std::string name = sent.substr(0, colon);
+        int data = atoi(sent.c_str() + colon + 1);
+
+        auto it = lastData.find(name);
+        int expected = (it != lastData.end()) ? it->second + 1 : 0;
+        if (data != expected) {
+            printf("FAIL %s sent %d, expected %d\n", name.c_str(), data, expected);
+            ok = false;
+        }
+        lastData[name] = data;
+    }
+
+    if (stubPublished.size() != (size_t)(numThreads * numEvents)) {
+        printf("FAIL %u events sent, expected %d\n", (unsigned)stubPublished.size(), numThreads * numEvents);
+        ok = false;
+    }
+    return ok;
+}
+
+/**
+ * @brief Runs numThreads producers and drains the queue from this thread
+ */
+static bool runTest(PublishQueueExtBase &queue, int numThreads, int numEvents) {
+    stubPublished.clear();
+    queue.clearLockStats();
+
+    std::atomic<int> running(numThreads);
+    uint32_t startUs = micros();
+    uint32_t publishUs = 0;
+
+    std::vector<std::thread> threads;
+    for(int threadNum = 0; threadNum < numThreads; threadNum++) {
+        threads.emplace_back([&queue, &running, threadNum, numEvents]() {
+            producer(queue, threadNum, numEvents);
+            running--;
+        });
+    }
+
+    while(true) {
+        queue.loop();
+        if (running == 0) {
+            if (!publishUs) {
+                publishUs = micros() - startUs;
+            }
+            if (queue.getNumEvents() == 0 && queue.getCanSleep()) {
+                break;
+            }
+        }
+    }
+    uint32_t totalUs = micros() - startUs;
+
+    for(auto &thread : threads) {
+        thread.join();
+    }
+
+    bool ok = checkSent(numThreads, numEvents);
+
+    PublishQueueExtBase::LockStats lockStats = queue.getLockStats();
+    printf("threads=%d events=%d publish %.0f events/s, total %.0f events/s, locks=%u contended=%u "
+        "wait avg %.1f max %u us, hold avg %.1f max %u us %s\n",
+        numThreads, numThreads * numEvents,
+        numThreads * numEvents * 1e6 / (publishUs ? publishUs : 1),
+        numThreads * numEvents * 1e6 / (totalUs ? totalUs : 1),
+        (unsigned)lockStats.numLocks, (unsigned)lockStats.numContended,
+        lockStats.numContended ? (double)lockStats.totalWaitUs / lockStats.numContended : 0.0, (unsigned)lockStats.maxWaitUs,
+        lockStats.numLocks ? (double)lockStats.totalHoldUs / lockStats.numLocks : 0.0, (unsigned)lockStats.maxHoldUs,
+        ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : 8;
+    int numEvents = (argc > 2) ? atoi(argv[2]) : 300;
+
+    system("rm -rf /tmp/pqstress");
+
+    PosixQueue &queue = PosixQueue::instance();
+    queue.withDirPath("/tmp/pqstress").withFileQueueSize(100000);
+    queue.setup();
+
+    bool ok = true;
+    for(int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+        ok = runTest(queue, numThreads, numEvents) && ok;
+    }
+
+    printf(ok ? "StressTest passed\n" : "StressTest FAILED\n");
+    return ok ? 0 : 1;
+}
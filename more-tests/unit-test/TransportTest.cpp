@@ -0,0 +1,168 @@
+// Drain test for the framed transport.
+//
+// For the POSIX and mmap backends, a backlog of events of up to 1500 bytes (larger than the
+// transport's copy buffer) is queued, then drained through PublishQueueExtTransportFramed into
+// memory. The frames are parsed back and must contain every event in order, with the same name,
+// content type, and data. The queued events are streamed from storage without loading the data
+// into RAM, so they're sent even though the RAM budget is lowered below their size before draining,
+// and getStats().peakEventRam does not change. The drain rate is printed for each backend.
+
+#include "PublishQueueExtRK.h"
+
+#include <chrono>
+
+struct PacingNone {
+    static constexpr unsigned long kWaitAfterConnect = 0;
+    static constexpr unsigned long kWaitBetweenPublish = 0;
+    static constexpr unsigned long kWaitAfterFailure = 1000;
+};
+
+typedef PublishQueueExtT<PublishQueueExtStoragePosix, PacingNone> PosixQueue;
+typedef PublishQueueExtT<PublishQueueExtStorageMmap, PacingNone> MmapQueue;
+
+static const int kNumEvents = 1000;
+
+/**
+ * @brief Print object that appends to a buffer in memory
+ */
+class MemoryPrint : public Print {
+public:
+    virtual size_t write(uint8_t c) override {
+        buf.push_back(c);
+        return 1;
+    }
+    virtual size_t write(const uint8_t *data, size_t len) override {
+        buf.insert(buf.end(), data, data + len);
+        return len;
+    }
+
+    std::vector<uint8_t> buf;
+};
+
+/**
+ * @brief Event name for event number ii. "framed/1" is registered, so it's stored as a name ID.
+ */
+static std::string eventName(int ii) {
+    return "framed/" + std::to_string(ii % 3);
+}
+
+/**
+ * @brief Event data for event number ii, 1 to 1500 bytes
+ */
+static std::string eventData(int ii) {
+    std::string data = std::to_string(ii) + " ";
+    size_t size = (size_t)(ii * 37) % 1500 + 1;
+    while(data.size() < size) {
+        data += (char)('a' + (ii + data.size()) % 26);
+    }
+    data.resize(size);
+    return data;
+}
+
+/**
+ * @brief Parses the frames and compares them to the published events
+ */
+static bool checkFrames(const std::vector<uint8_t> &buf, const char *name) {
+    size_t offset = 0;
+    int ii = 0;
+
+    for(; offset < buf.size(); ii++) {
+        PublishQueueExtTransportFramed::FrameHeader header;
+        if (buf.size() - offset < sizeof(header)) {
+            printf("%-6s FAIL partial frame header\n", name);
+            return false;
+        }
+        memcpy(&header, &buf[offset], sizeof(header));
+        offset += sizeof(header);
+
+        if (header.magic != PublishQueueExtTransportFramed::kFrameMagic || buf.size() - offset < header.nameLen + header.dataSize) {
+            printf("%-6s FAIL bad frame %d\n", name, ii);
+            return false;
+        }
+
+        std::string frameName((const char *)&buf[offset], header.nameLen);
+        offset += header.nameLen;
+        std::string frameData((const char *)&buf[offset], header.dataSize);
+        offset += header.dataSize;
+
+        if (frameName != eventName(ii) || frameData != eventData(ii) || header.contentType != (uint16_t)ContentType::TEXT) {
+            printf("%-6s FAIL frame %d does not match the event\n", name, ii);
+            return false;
+        }
+    }
+
+    if (ii != kNumEvents) {
+        printf("%-6s FAIL %d frames, expected %d\n", name, ii, kNumEvents);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Queues the events, drains them through the framed transport, and checks the frames
+ *
+ * @param queue Queue to test. setup() must already have been called.
+ *
+ * @param name Name of the backend for the output
+ */
+static bool runTest(PublishQueueExtBase &queue, const char *name) {
+    MemoryPrint memoryPrint;
+    PublishQueueExtTransportFramed framedTransport;
+    framedTransport.withPrint(memoryPrint);
+
+    queue.registerEventName("framed/1");
+    for(int ii = 0; ii < kNumEvents; ii++) {
+        queue.publish(eventName(ii).c_str(), eventData(ii).c_str());
+    }
+
+    // Events that had to be loaded to send them would now be discarded as over the RAM budget
+    queue.withRamBudget(256);
+    size_t publishPeakEventRam = queue.getStats().peakEventRam;
+
+    queue.withTransport(framedTransport);
+    auto start = std::chrono::steady_clock::now();
+    for(int ii = 0; ii < kNumEvents * 2 && queue.getNumEvents() != 0; ii++) {
+        stubMillis++;
+        queue.loop();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    queue.withCloudTransport().withRamBudget(0);
+
+    bool ok = checkFrames(memoryPrint.buf, name);
+
+    PublishQueueExtBase::Stats stats = queue.getStats();
+    if (stats.peakEventRam != publishPeakEventRam) {
+        printf("%-6s FAIL event data loaded to send, peakEventRam=%u\n", name, (unsigned)stats.peakEventRam);
+        ok = false;
+    }
+
+    printf("%-6s events=%d bytes=%u %.0f events/s %.1f MB/s %s\n", name, (int)framedTransport.getFrameCount(), (unsigned)memoryPrint.buf.size(),
+        kNumEvents / elapsed, memoryPrint.buf.size() / elapsed / 1e6, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        stubLogLevel = 1;
+    }
+    stubRecordPublished = false;
+    Particle.conn = false;
+
+    bool ok = true;
+
+    system("rm -rf /tmp/pqframed-posix /tmp/pqframed-mmap");
+
+    PosixQueue &posixQueue = PosixQueue::instance();
+    posixQueue.withDirPath("/tmp/pqframed-posix").withFileQueueSize(kNumEvents);
+    posixQueue.setup();
+    ok = runTest(posixQueue, "posix") && ok;
+
+    MmapQueue &mmapQueue = MmapQueue::instance();
+    mmapQueue.getStoragePolicy().withSlots(kNumEvents, 2048);
+    mmapQueue.withDirPath("/tmp/pqframed-mmap").withFileQueueSize(kNumEvents);
+    mmapQueue.setup();
+    ok = runTest(mmapQueue, "mmap") && ok;
+
+    printf(ok ? "TransportTest passed\n" : "TransportTest FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,449 @@
+#ifndef __PARTICLE_H
+#define __PARTICLE_H
+
+// Minimal host (gcc/Linux) replacement for the parts of the Device OS API used by PublishQueueExtRK.
+// This is only for the tests in more-tests/unit-test; it is not a general-purpose emulation.
+// The cloud is simulated by Particle.publish(), controlled by stubPublishMode.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define SYSTEM_VERSION_630
+#define PLATFORM_ID 3
+
+enum {
+    SYSTEM_ERROR_NONE = 0,
+    SYSTEM_ERROR_UNKNOWN = -100,
+    SYSTEM_ERROR_BUSY = -110,
+    SYSTEM_ERROR_NO_MEMORY = -260,
+    SYSTEM_ERROR_INVALID_ARGUMENT = -270,
+    SYSTEM_ERROR_LIMIT_EXCEEDED = -280,
+    SYSTEM_ERROR_TOO_LARGE = -290,
+    SYSTEM_ERROR_FILE = -1000,
+    SYSTEM_ERROR_NOT_FOUND = -1100
+};
+
+//
+// Test controls, defined in stub.cpp
+//
+extern int stubLogLevel;                        //!< 0 = no log output, 1 = print all log messages
+extern unsigned long stubMillis;                //!< Value returned by millis(), unless STUB_REALTIME is defined
+extern int stubPublishMode;                     //!< 0 = success, 1 = fail asynchronously, 2 = fail immediately
+extern int stubPublishCount;                    //!< Number of events passed to Particle.publish()
+extern bool stubRecordPublished;                //!< Append "name:data" for each event to stubPublished
+extern std::vector<std::string> stubPublished;  //!< Events sent to the simulated cloud
+
+class String : public std::string {
+public:
+    String() {}
+    String(const char *s) : std::string(s ? s : "") {}
+    String(const char *s, unsigned int n) : std::string(s, n) {}
+    String(const std::string &s) : std::string(s) {}
+    String(int v) : std::string(std::to_string(v)) {}
+
+    const char *c_str() const { return std::string::c_str(); }
+    size_t length() const { return size(); }
+    operator const char*() const { return c_str(); }
+
+    bool endsWith(const char *s) const {
+        size_t n = strlen(s);
+        return size() >= n && compare(size() - n, n, s) == 0;
+    }
+    String substring(size_t from, size_t to) const { return String(std::string::substr(from, to - from)); }
+    String operator+(const String &other) const { return String(std::string(*this) + std::string(other)); }
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t len) {
+        for(size_t ii = 0; ii < len; ii++) {
+            write(buf[ii]);
+        }
+        return len;
+    }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+};
+
+class Logger {
+public:
+    Logger(const char *) {}
+
+    void trace(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("trace", fmt, ap); va_end(ap); }
+    void info(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("info", fmt, ap); va_end(ap); }
+    void warn(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("warn", fmt, ap); va_end(ap); }
+    void error(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("error", fmt, ap); va_end(ap); }
+
+protected:
+    void log(const char *level, const char *fmt, va_list ap) const {
+        if (stubLogLevel > 0) {
+            printf("%s: ", level);
+            vprintf(fmt, ap);
+            printf("\n");
+        }
+    }
+};
+extern Logger Log;
+
+enum class ContentType {
+    TEXT = 0,
+    JPEG = 22,
+    PNG = 23,
+    BINARY = 42,
+    STRUCTURED = 65001
+};
+
+class Variant;
+typedef std::vector<std::pair<String, Variant>> VariantMap;
+
+/**
+ * @brief Variant subset: null, integer, double, string, and map (insertion ordered)
+ */
+class Variant {
+public:
+    enum Type { NUL, INT, DBL, STR, MAP };
+
+    Variant() {}
+    Variant(int v) : type(INT), i(v) {}
+    Variant(unsigned v) : type(INT), i(v) {}
+    Variant(long v) : type(INT), i(v) {}
+    Variant(long long v) : type(INT), i(v) {}
+    Variant(unsigned long long v) : type(INT), i((int64_t)v) {}
+    Variant(bool v) : type(INT), i(v) {}
+    Variant(double v) : type(DBL), d(v) {}
+    Variant(const char *v) : type(STR), s(v) {}
+    Variant(const char *v, size_t n) : type(STR), s(std::string(v, n)) {}
+    Variant(const String &v) : type(STR), s(v) {}
+    Variant(const VariantMap &vm) : type(MAP), m(std::make_shared<VariantMap>(vm)) {}
+
+    void set(const char *key, const Variant &v) {
+        VariantMap &map = asMap();
+        for(auto &pair : map) {
+            if (pair.first == key) {
+                pair.second = v;
+                return;
+            }
+        }
+        map.push_back({String(key), v});
+    }
+    Variant get(const char *key) const {
+        if (type == MAP) {
+            for(auto &pair : *m) {
+                if (pair.first == key) {
+                    return pair.second;
+                }
+            }
+        }
+        return Variant();
+    }
+    bool has(const char *key) const {
+        if (type == MAP) {
+            for(auto &pair : *m) {
+                if (pair.first == key) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool isMap() const { return type == MAP; }
+    bool isInt() const { return type == INT; }
+    bool isUInt() const { return false; }
+    bool isInt64() const { return false; }
+    bool isUInt64() const { return false; }
+    bool isDouble() const { return type == DBL; }
+    bool isBool() const { return false; }
+    bool isNumber() const { return type == INT || type == DBL; }
+    bool isString() const { return type == STR; }
+
+    String asString() const { return s; }
+    int asInt() const { return (int)i; }
+    int64_t toInt64() const { return (type == DBL) ? (int64_t)d : i; }
+    double toDouble() const { return (type == DBL) ? d : (double)i; }
+    bool toBool() const { return i != 0; }
+    String toString() const { return s; }
+    String toJSON() const { return String(); }
+    static Variant fromJSON(const char *) { return Variant(); }
+
+    const VariantMap &asMap() const { return *m; }
+    VariantMap &asMap() {
+        if (type != MAP) {
+            type = MAP;
+            m = std::make_shared<VariantMap>();
+        }
+        return *m;
+    }
+    VariantMap toMap() const { return (type == MAP) ? *m : VariantMap(); }
+    int size() const { return (type == MAP) ? (int)m->size() : 0; }
+
+    Type type = NUL;
+    int64_t i = 0;
+    double d = 0;
+    String s;
+    std::shared_ptr<VariantMap> m;
+};
+
+namespace particle {
+    using ::Variant;
+}
+
+class Buffer {
+public:
+    Buffer() {}
+    Buffer(size_t size) : v(size) {}
+
+    const char *data() const { return (const char *)v.data(); }
+    char *data() { return (char *)v.data(); }
+    size_t size() const { return v.size(); }
+
+    std::vector<uint8_t> v;
+};
+
+/**
+ * @brief Allocator using malloc() instead of operator new
+ *
+ * Used for the name and data in CloudEvent, which Device OS allocates itself, so AllocTest only
+ * counts allocations made by the library.
+ */
+template<class T>
+struct StubAllocator {
+    typedef T value_type;
+
+    StubAllocator() {}
+    template<class U> StubAllocator(const StubAllocator<U> &) {}
+
+    T *allocate(size_t n) { return (T *)malloc(n * sizeof(T)); }
+    void deallocate(T *p, size_t) { free(p); }
+
+    bool operator==(const StubAllocator &) const { return true; }
+    bool operator!=(const StubAllocator &) const { return false; }
+};
+
+typedef std::basic_string<char, std::char_traits<char>, StubAllocator<char>> StubString;
+
+/**
+ * @brief CloudEvent subset. Structured data is kept as a Variant and sent as "<map>".
+ */
+class CloudEvent {
+public:
+    CloudEvent() {}
+
+    CloudEvent &name(const char *value) { n = value; return *this; }
+    const char *name() const { return n.c_str(); }
+
+    CloudEvent &data(const char *value) { d = value; return *this; }
+    CloudEvent &data(const char *value, size_t size) { d.assign(value, size); return *this; }
+    CloudEvent &data(const Buffer &buf) { d.assign(buf.data(), buf.size()); return *this; }
+    CloudEvent &data(const Variant &value) {
+        if (value.isMap()) {
+            structured = value;
+            ct = ContentType::STRUCTURED;
+            d = "<map>";
+        }
+        else {
+            d.assign(value.s.data(), value.s.size());
+        }
+        return *this;
+    }
+
+    CloudEvent &contentType(ContentType value) { ct = value; return *this; }
+    ContentType contentType() const { return ct; }
+    size_t size() const { return d.size(); }
+
+    int saveData(const char *path) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            return SYSTEM_ERROR_FILE;
+        }
+        int count = (int)write(fd, d.data(), d.size());
+        close(fd);
+        return (count == (int)d.size()) ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_FILE;
+    }
+    int loadData(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return SYSTEM_ERROR_FILE;
+        }
+        d.clear();
+        char buf[512];
+        ssize_t count;
+        while((count = ::read(fd, buf, sizeof(buf))) > 0) {
+            d.append(buf, count);
+        }
+        close(fd);
+        return SYSTEM_ERROR_NONE;
+    }
+
+    Buffer dataBuffer() const {
+        Buffer buf(d.size());
+        memcpy(buf.data(), d.data(), d.size());
+        return buf;
+    }
+    Variant dataStructured() const { return structured; }
+    String dataString() const { return String(d.data(), d.size()); }
+
+    bool isValid() const { return !n.empty(); }
+    bool isSending() const { return status == 1; }
+    bool isSent() const { return status == 2; }
+    void clear() {
+        n.clear();
+        d.clear();
+        ct = ContentType::TEXT;
+        status = 0;
+    }
+
+    static bool canPublish(size_t) { return true; }
+
+    StubString n;
+    StubString d;
+    ContentType ct = ContentType::TEXT;
+    int status = 0; //!< 0 = new, 1 = sending, 2 = sent, 3 = failed
+    Variant structured;
+};
+
+class ParticleClass {
+public:
+    bool connected() { return conn; }
+
+    bool publish(CloudEvent &event) {
+        if (stubPublishMode == 2) {
+            return false;
+        }
+        event.status = (stubPublishMode == 1) ? 3 : 2;
+        stubPublishCount++;
+        if (stubRecordPublished) {
+            stubPublished.push_back(std::string(event.n.c_str()) + ":" + std::string(event.d.data(), event.d.size()));
+        }
+        return true;
+    }
+
+    bool conn = true;
+};
+extern ParticleClass Particle;
+
+class TimeClass {
+public:
+    bool isValid() { return valid; }
+    uint32_t now() { return t; }
+
+    bool valid = true;
+    uint32_t t = 1700000000;
+};
+extern TimeClass Time;
+
+class SystemClass {
+public:
+    uint32_t freeMemory() { return 0; }
+    void reset() {}
+};
+extern SystemClass System;
+
+#ifdef STUB_REALTIME
+inline uint32_t micros() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+inline unsigned long millis() { return micros() / 1000; }
+#else
+inline unsigned long millis() { return stubMillis; }
+inline uint32_t micros() { return stubMillis * 1000; }
+#endif
+
+inline void delay(unsigned long) {}
+inline int random(int max) { return max ? rand() % max : 0; }
+inline int random(int min, int max) { return (max > min) ? min + rand() % (max - min) : min; }
+inline uint32_t HAL_RNG_GetRandomNumber() { return (uint32_t)rand(); }
+
+typedef std::recursive_mutex *os_mutex_recursive_t;
+typedef void *os_thread_t;
+
+inline int os_mutex_recursive_create(os_mutex_recursive_t *mutex) { *mutex = new std::recursive_mutex(); return 0; }
+inline void os_mutex_recursive_lock(os_mutex_recursive_t mutex) { mutex->lock(); }
+inline int os_mutex_recursive_trylock(os_mutex_recursive_t mutex) { return mutex->try_lock() ? 0 : 1; }
+inline void os_mutex_recursive_unlock(os_mutex_recursive_t mutex) { mutex->unlock(); }
+
+namespace spark {
+    namespace feature {
+        enum State { DISABLED, ENABLED };
+    }
+}
+inline spark::feature::State system_thread_get_state(void *) { return spark::feature::ENABLED; }
+
+#define WITH_LOCK(x) for(bool __todo = ((x).lock(), true); __todo; __todo = ((x).unlock(), false))
+
+/**
+ * @brief JSONBufferWriter subset: objects, string and int values
+ */
+class JSONBufferWriter {
+public:
+    JSONBufferWriter(char *buf, size_t size) : buf(buf), size(size) {}
+
+    JSONBufferWriter &beginObject() { separator(); put("{"); first = true; return *this; }
+    JSONBufferWriter &endObject() { put("}"); first = false; return *this; }
+    JSONBufferWriter &name(const char *name) { separator(); quoted(name); put(":"); first = true; return *this; }
+    JSONBufferWriter &value(const char *value) { separator(); quoted(value); return *this; }
+    JSONBufferWriter &value(int value) {
+        char tmp[16];
+        snprintf(tmp, sizeof(tmp), "%d", value);
+        separator();
+        put(tmp);
+        return *this;
+    }
+
+    size_t dataSize() const { return offset; }
+    size_t bufferSize() const { return size; }
+
+protected:
+    void separator() {
+        if (!first) {
+            put(",");
+        }
+        first = false;
+    }
+    void quoted(const char *s) {
+        put("\"");
+        for(; *s; s++) {
+            char tmp[3] = { *s, 0, 0 };
+            if (*s == '"' || *s == '\\') {
+                tmp[0] = '\\';
+                tmp[1] = *s;
+            }
+            put(tmp);
+        }
+        put("\"");
+    }
+    void put(const char *s) {
+        for(; *s; s++) {
+            if (offset < size) {
+                buf[offset] = *s;
+            }
+            offset++;
+        }
+    }
+
+    char *buf;
+    size_t size;
+    size_t offset = 0;
+    bool first = true;
+};
+
+#endif /* __PARTICLE_H */
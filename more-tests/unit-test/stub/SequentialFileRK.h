@@ -0,0 +1,111 @@
+#ifndef __SEQUENTIALFILERK_H
+#define __SEQUENTIALFILERK_H
+
+// Host replacement for the parts of SequentialFileRK used by PublishQueueExtStoragePosix.
+// Files are named %08d.<ext> in a single directory, like the real library.
+
+#include "Particle.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <deque>
+
+class SequentialFile {
+public:
+    SequentialFile &withDirPath(const char *value) {
+        dirPath = value;
+        if (dirPath.size() > 1 && dirPath.back() == '/') {
+            dirPath.pop_back();
+        }
+        return *this;
+    }
+    const char *getDirPath() const { return dirPath.c_str(); }
+
+    SequentialFile &withFilenameExtension(const char *value) { ext = value; return *this; }
+
+    bool scanDir() {
+        createDirIfNecessary(dirPath.c_str());
+        queue.clear();
+
+        DIR *dir = opendir(dirPath.c_str());
+        if (!dir) {
+            return false;
+        }
+        std::vector<int> fileNums;
+        struct dirent *ent;
+        while((ent = readdir(dir)) != nullptr) {
+            int fileNum;
+            char fileExt[16];
+            if (sscanf(ent->d_name, "%d.%15s", &fileNum, fileExt) == 2 && ext == fileExt) {
+                fileNums.push_back(fileNum);
+                if (fileNum > lastFileNum) {
+                    lastFileNum = fileNum;
+                }
+            }
+        }
+        closedir(dir);
+
+        std::sort(fileNums.begin(), fileNums.end());
+        for(int fileNum : fileNums) {
+            queue.push_back(fileNum);
+        }
+        return true;
+    }
+
+    int reserveFile() { return ++lastFileNum; }
+    void addFileToQueue(int fileNum) { queue.push_back(fileNum); }
+    int getFileFromQueue(bool remove = true) {
+        if (queue.empty()) {
+            return 0;
+        }
+        int fileNum = queue.front();
+        if (remove) {
+            queue.pop_front();
+        }
+        return fileNum;
+    }
+    int removeSecondFileInQueue() { return 0; }
+    int getQueueLen() const { return (int)queue.size(); }
+
+    String getNameForFileNum(int fileNum, const char *overrideExt = nullptr) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%08d.%s", fileNum, overrideExt ? overrideExt : ext.c_str());
+        return String(buf);
+    }
+    String getPathForFileNum(int fileNum, const char *overrideExt = nullptr) {
+        return String(dirPath) + String("/") + getNameForFileNum(fileNum, overrideExt);
+    }
+
+    void removeFileNum(int fileNum, bool) { unlink(getPathForFileNum(fileNum).c_str()); }
+    void removeAll(bool removeDir, const char * = nullptr) {
+        DIR *dir = opendir(dirPath.c_str());
+        if (dir) {
+            struct dirent *ent;
+            while((ent = readdir(dir)) != nullptr) {
+                if (ent->d_name[0] != '.') {
+                    unlink((dirPath + "/" + ent->d_name).c_str());
+                }
+            }
+            closedir(dir);
+        }
+        if (removeDir) {
+            rmdir(dirPath.c_str());
+        }
+        queue.clear();
+    }
+
+    static bool createDirIfNecessary(const char *path) {
+        mkdir(path, 0777);
+        return true;
+    }
+
+protected:
+    std::string dirPath = "/usr/pubqueue";
+    std::string ext = "pq";
+    std::deque<int> queue;
+    int lastFileNum = 0;
+};
+
+#endif /* __SEQUENTIALFILERK_H */
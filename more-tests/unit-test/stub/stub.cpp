@@ -0,0 +1,13 @@
+#include "Particle.h"
+
+int stubLogLevel = 0;
+unsigned long stubMillis = 0;
+int stubPublishMode = 0;
+int stubPublishCount = 0;
+bool stubRecordPublished = true;
+std::vector<std::string> stubPublished;
+
+Logger Log("app");
+ParticleClass Particle;
+TimeClass Time;
+SystemClass System;
@@ -0,0 +1,373 @@
+#include "PublishQueueExtBatch.h"
+
+static const uint8_t kMagic[3] = { 'P', 'Q', 'B' };
+
+// Bounded writer for encoding a block. Sets ok to false instead of writing past the end.
+struct BatchWriter {
+    BatchWriter(uint8_t *buf, size_t size) : buf(buf), size(size) {};
+
+    void put(const void *data, size_t n) {
+        if (len + n > size) {
+            ok = false;
+            return;
+        }
+        memcpy(&buf[len], data, n);
+        len += n;
+    }
+    void putByte(uint8_t value) {
+        put(&value, 1);
+    }
+    void putVarint(uint64_t value) {
+        do {
+            uint8_t b = value & 0x7f;
+            value >>= 7;
+            if (value) {
+                b |= 0x80;
+            }
+            putByte(b);
+        } while(value);
+    }
+    void putZigzag(int64_t value) {
+        putVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+    }
+
+    uint8_t *buf;
+    size_t size;
+    size_t len = 0;
+    bool ok = true;
+};
+
+// Bounded reader for parsing a block. Sets ok to false instead of reading past the end.
+struct BatchReader {
+    BatchReader() : buf(nullptr), size(0) {};
+    BatchReader(const uint8_t *buf, size_t size) : buf(buf), size(size) {};
+
+    const uint8_t *get(size_t n) {
+        if (!ok || pos + n > size) {
+            ok = false;
+            return nullptr;
+        }
+        const uint8_t *result = &buf[pos];
+        pos += n;
+        return result;
+    }
+    uint8_t getByte() {
+        const uint8_t *p = get(1);
+        return p ? *p : 0;
+    }
+    uint64_t getVarint() {
+        uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = getByte();
+            value |= (uint64_t)(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return value;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+    int64_t getZigzag() {
+        uint64_t value = getVarint();
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+
+    const uint8_t *buf;
+    size_t size;
+    size_t pos = 0;
+    bool ok = true;
+};
+
+// Column type for the first value in a column
+static bool getColumnType(const Variant &value, PublishQueueExtBatch::ColumnType &type) {
+    if (value.isBool()) {
+        type = PublishQueueExtBatch::ColumnType::BOOL;
+    }
+    else
+    if (value.isInt() || value.isUInt() || value.isInt64()) {
+        type = PublishQueueExtBatch::ColumnType::INT;
+    }
+    else
+    if (value.isDouble()) {
+        double d = value.toDouble();
+        type = ((double)(float)d == d) ? PublishQueueExtBatch::ColumnType::FLOAT : PublishQueueExtBatch::ColumnType::DOUBLE;
+    }
+    else
+    if (value.isString() && value.toString().length() <= PublishQueueExtBatch::kMaxStringLen) {
+        type = PublishQueueExtBatch::ColumnType::STRING;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Returns true if a value can be stored in an existing column
+static bool isColumnValue(const Variant &value, PublishQueueExtBatch::ColumnType type) {
+    PublishQueueExtBatch::ColumnType valueType;
+    if (!getColumnType(value, valueType)) {
+        return false;
+    }
+    // Floats can be stored in a double column, but not the other way around
+    return valueType == type || (valueType == PublishQueueExtBatch::ColumnType::FLOAT && type == PublishQueueExtBatch::ColumnType::DOUBLE);
+}
+
+// The float and double bytes are stored in the native byte order, which is little endian on all supported platforms
+static void writeValue(BatchWriter &writer, PublishQueueExtBatch::ColumnType type, const Variant &value, int64_t &prev) {
+    switch(type) {
+        case PublishQueueExtBatch::ColumnType::INT: {
+            int64_t i = value.toInt64();
+            writer.putZigzag(i - prev);
+            prev = i;
+            break;
+        }
+        case PublishQueueExtBatch::ColumnType::FLOAT: {
+            float f = (float) value.toDouble();
+            writer.put(&f, sizeof(f));
+            break;
+        }
+        case PublishQueueExtBatch::ColumnType::DOUBLE: {
+            double d = value.toDouble();
+            writer.put(&d, sizeof(d));
+            break;
+        }
+        case PublishQueueExtBatch::ColumnType::BOOL:
+            writer.putByte(value.toBool() ? 1 : 0);
+            break;
+
+        case PublishQueueExtBatch::ColumnType::STRING: {
+            String s = value.toString();
+            writer.putVarint(s.length());
+            writer.put(s.c_str(), s.length());
+            break;
+        }
+    }
+}
+
+// Read one value. If result is nullptr the value is skipped; prev is updated for INT either way.
+static void readValue(BatchReader &reader, PublishQueueExtBatch::ColumnType type, int64_t &prev, Variant *result) {
+    switch(type) {
+        case PublishQueueExtBatch::ColumnType::INT:
+            prev += reader.getZigzag();
+            if (result) {
+                *result = Variant((long long)prev);
+            }
+            break;
+
+        case PublishQueueExtBatch::ColumnType::FLOAT: {
+            const uint8_t *p = reader.get(sizeof(float));
+            if (p && result) {
+                float f;
+                memcpy(&f, p, sizeof(f));
+                *result = Variant((double)f);
+            }
+            break;
+        }
+        case PublishQueueExtBatch::ColumnType::DOUBLE: {
+            const uint8_t *p = reader.get(sizeof(double));
+            if (p && result) {
+                double d;
+                memcpy(&d, p, sizeof(d));
+                *result = Variant(d);
+            }
+            break;
+        }
+        case PublishQueueExtBatch::ColumnType::BOOL: {
+            uint8_t b = reader.getByte();
+            if (result) {
+                *result = Variant(b != 0);
+            }
+            break;
+        }
+        case PublishQueueExtBatch::ColumnType::STRING: {
+            size_t len = (size_t) reader.getVarint();
+            const uint8_t *p = reader.get(len);
+            if (p && result) {
+                *result = Variant(String((const char *)p, len));
+            }
+            break;
+        }
+        default:
+            reader.ok = false;
+            break;
+    }
+}
+
+// Parsed header of a block. keys point into the block and are not null terminated.
+struct BatchHeader {
+    size_t numRows = 0;
+    size_t numColumns = 0;
+    PublishQueueExtBatch::ColumnType types[PublishQueueExtBatch::kMaxColumns];
+    const uint8_t *keys[PublishQueueExtBatch::kMaxColumns];
+    size_t keyLens[PublishQueueExtBatch::kMaxColumns];
+};
+
+static bool readHeader(BatchReader &reader, BatchHeader &header) {
+    const uint8_t *magic = reader.get(sizeof(kMagic));
+    if (!magic || memcmp(magic, kMagic, sizeof(kMagic)) != 0 || reader.getByte() != PublishQueueExtBatch::kVersion) {
+        return false;
+    }
+    header.numRows = (size_t) reader.getVarint();
+    header.numColumns = (size_t) reader.getVarint();
+    if (!reader.ok || header.numRows == 0 || header.numColumns == 0 || header.numColumns > PublishQueueExtBatch::kMaxColumns) {
+        return false;
+    }
+    for(size_t col = 0; col < header.numColumns; col++) {
+        header.types[col] = (PublishQueueExtBatch::ColumnType) reader.getByte();
+        header.keyLens[col] = (size_t) reader.getVarint();
+        header.keys[col] = reader.get(header.keyLens[col]);
+    }
+    return reader.ok;
+}
+
+bool PublishQueueExtBatch::isBatchable(const Variant &data) {
+    if (!data.isMap() || data.size() == 0 || data.size() > (int)kMaxColumns) {
+        return false;
+    }
+
+    for(const auto &kv : data.toMap()) {
+        ColumnType type;
+        if (kv.first.length() > kMaxKeyLen || !getColumnType(kv.second, type)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PublishQueueExtBatch::isBlock(const uint8_t *buf, size_t len) {
+    return len > sizeof(kMagic) && memcmp(buf, kMagic, sizeof(kMagic)) == 0 && buf[sizeof(kMagic)] == kVersion;
+}
+
+size_t PublishQueueExtBatch::encode(const Variant &row, uint32_t timestamp, uint8_t *buf, size_t bufSize) {
+    if (!isBatchable(row)) {
+        return 0;
+    }
+    VariantMap map = row.toMap();
+
+    BatchWriter writer(buf, bufSize);
+    writer.put(kMagic, sizeof(kMagic));
+    writer.putByte(kVersion);
+    writer.putVarint(1);
+    writer.putVarint(map.size());
+
+    for(const auto &kv : map) {
+        ColumnType type;
+        getColumnType(kv.second, type);
+        writer.putByte((uint8_t)type);
+        writer.putVarint(kv.first.length());
+        writer.put(kv.first.c_str(), kv.first.length());
+    }
+
+    writer.putZigzag((int64_t)timestamp);
+
+    for(const auto &kv : map) {
+        ColumnType type;
+        getColumnType(kv.second, type);
+        int64_t prev = 0;
+        writeValue(writer, type, kv.second, prev);
+    }
+
+    return writer.ok ? writer.len : 0;
+}
+
+size_t PublishQueueExtBatch::append(const uint8_t *block, size_t blockLen, const Variant &row, uint32_t timestamp, uint8_t *buf, size_t bufSize) {
+    BatchReader reader(block, blockLen);
+    BatchHeader header;
+    if (!readHeader(reader, header) || !row.isMap() || row.size() != (int)header.numColumns) {
+        return 0;
+    }
+    VariantMap map = row.toMap();
+
+    // The keys must be the same and in the same order, and the values compatible with the column types
+    for(size_t col = 0; col < header.numColumns; col++) {
+        const String &key = map[col].first;
+        if (key.length() != header.keyLens[col] || memcmp(key.c_str(), header.keys[col], header.keyLens[col]) != 0 ||
+            !isColumnValue(map[col].second, header.types[col])) {
+            return 0;
+        }
+    }
+
+    BatchWriter writer(buf, bufSize);
+    writer.put(kMagic, sizeof(kMagic));
+    writer.putByte(kVersion);
+    writer.putVarint(header.numRows + 1);
+    writer.putVarint(header.numColumns);
+    for(size_t col = 0; col < header.numColumns; col++) {
+        writer.putByte((uint8_t)header.types[col]);
+        writer.putVarint(header.keyLens[col]);
+        writer.put(header.keys[col], header.keyLens[col]);
+    }
+
+    // Copy each column from the existing block, then add the value for the new row. The previous
+    // value is needed for the delta, so the integer columns are decoded while skipping them.
+    int64_t prev = 0;
+    size_t start = reader.pos;
+    for(size_t ii = 0; ii < header.numRows; ii++) {
+        readValue(reader, ColumnType::INT, prev, nullptr);
+    }
+    writer.put(&block[start], reader.pos - start);
+    writer.putZigzag((int64_t)timestamp - prev);
+
+    for(size_t col = 0; col < header.numColumns; col++) {
+        prev = 0;
+        start = reader.pos;
+        for(size_t ii = 0; ii < header.numRows; ii++) {
+            readValue(reader, header.types[col], prev, nullptr);
+        }
+        writer.put(&block[start], reader.pos - start);
+        writeValue(writer, header.types[col], map[col].second, prev);
+    }
+
+    if (!reader.ok || reader.pos != blockLen) {
+        return 0;
+    }
+    return writer.ok ? writer.len : 0;
+}
+
+size_t PublishQueueExtBatch::getNumRows(const uint8_t *block, size_t blockLen) {
+    BatchReader reader(block, blockLen);
+    BatchHeader header;
+    return readHeader(reader, header) ? header.numRows : 0;
+}
+
+bool PublishQueueExtBatch::decode(const uint8_t *block, size_t blockLen, std::function<void(uint32_t timestamp, const Variant &row)> cb) {
+    BatchReader reader(block, blockLen);
+    BatchHeader header;
+    if (!readHeader(reader, header)) {
+        return false;
+    }
+
+    // Find the start of each column, then read one value from each column for each row
+    BatchReader columns[kMaxColumns + 1];
+    for(size_t col = 0; col <= header.numColumns; col++) {
+        columns[col] = reader;
+        ColumnType type = (col == 0) ? ColumnType::INT : header.types[col - 1];
+        int64_t prev = 0;
+        for(size_t ii = 0; ii < header.numRows; ii++) {
+            readValue(reader, type, prev, nullptr);
+        }
+    }
+    if (!reader.ok || reader.pos != blockLen) {
+        return false;
+    }
+
+    int64_t prevs[kMaxColumns + 1] = {0};
+    char key[kMaxKeyLen + 1];
+
+    for(size_t ii = 0; ii < header.numRows; ii++) {
+        readValue(columns[0], ColumnType::INT, prevs[0], nullptr);
+
+        Variant row;
+        for(size_t col = 1; col <= header.numColumns; col++) {
+            Variant value;
+            readValue(columns[col], header.types[col - 1], prevs[col], &value);
+
+            size_t keyLen = (header.keyLens[col - 1] < kMaxKeyLen) ? header.keyLens[col - 1] : kMaxKeyLen;
+            memcpy(key, header.keys[col - 1], keyLen);
+            key[keyLen] = 0;
+            row.set(key, value);
+        }
+        cb((uint32_t)prevs[0], row);
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+#ifndef __PUBLISHQUEUEEXTBATCH_H
+#define __PUBLISHQUEUEEXTBATCH_H
+
+// Github: https://github.com/rickkas7/PublishQueueExtRK
+// License: MIT
+
+#include "Particle.h"
+
+/**
+ * @brief Encoder for batches of structured events that share a schema
+ *
+ * A batch is a columnar block of rows, each row being the top-level map of one structured
+ * event. Integer columns are delta encoded as zigzag varints, so slowly changing values take
+ * one byte per row, and each key is stored once per block instead of once per event.
+ * The format is documented in the README.
+ *
+ * PublishQueueExtBase uses this when withBatching() is enabled. The methods are static and
+ * write blocks to a buffer supplied by the caller. isBatchable(), encode(), and append() still
+ * allocate temporarily, as they copy the map with Variant::toMap() and string values with
+ * Variant::toString(). decode() builds a Variant for each row.
+ */
+class PublishQueueExtBatch {
+public:
+    /**
+     * @brief Column types stored in a block
+     */
+    enum class ColumnType : uint8_t {
+        INT = 1, //!< Zigzag varint, delta from the previous row
+        FLOAT = 2, //!< 4-byte IEEE 754 float, used for doubles that are exactly representable as a float
+        DOUBLE = 3, //!< 8-byte IEEE 754 double
+        BOOL = 4, //!< 1 byte, 0 or 1
+        STRING = 5 //!< Varint length followed by UTF-8 bytes
+    };
+
+    static const uint8_t kVersion = 1; //!< Version byte following the magic bytes
+    static const size_t kMaxColumns = 32; //!< Maximum number of keys in the map
+    static const size_t kMaxKeyLen = 63; //!< Maximum length of a key
+    static const size_t kMaxStringLen = 255; //!< Maximum length of a string value
+
+    /**
+     * @brief Returns true if the data can be stored in a block
+     *
+     * @param data The structured event data
+     *
+     * The data must be a map of 1 to kMaxColumns keys whose values are integers, doubles,
+     * booleans, or strings. Nested maps and arrays are not supported.
+     */
+    static bool isBatchable(const Variant &data);
+
+    /**
+     * @brief Returns true if buf starts with the magic bytes and version of a block
+     */
+    static bool isBlock(const uint8_t *buf, size_t len);
+
+    /**
+     * @brief Encode a block containing one row
+     *
+     * @param row Event data, which must be batchable
+     * @param timestamp Time.now() value when the event was published, or 0
+     * @param buf Buffer to write the block to
+     * @param bufSize Size of buf in bytes
+     * @return Size of the block in bytes, or 0 if it does not fit
+     */
+    static size_t encode(const Variant &row, uint32_t timestamp, uint8_t *buf, size_t bufSize);
+
+    /**
+     * @brief Encode a block with one more row than an existing block
+     *
+     * @param block Existing block
+     * @param blockLen Size of the existing block in bytes
+     * @param row Event data to add, which must have the same keys in the same order, with compatible types
+     * @param timestamp Time.now() value when the event was published, or 0
+     * @param buf Buffer to write the new block to, which must not overlap block
+     * @param bufSize Size of buf in bytes
+     * @return Size of the new block in bytes, or 0 if the schema does not match or it does not fit
+     */
+    static size_t append(const uint8_t *block, size_t blockLen, const Variant &row, uint32_t timestamp, uint8_t *buf, size_t bufSize);
+
+    /**
+     * @brief Gets the number of rows in a block
+     *
+     * @return Number of rows, or 0 if the block is not valid
+     */
+    static size_t getNumRows(const uint8_t *block, size_t blockLen);
+
+    /**
+     * @brief Decode a block
+     *
+     * @param block The block
+     * @param blockLen Size of the block in bytes
+     * @param cb Function called for each row, oldest first, with the timestamp and the map of values
+     * @return true if the block was decoded, false if it's not valid
+     */
+    static bool decode(const uint8_t *block, size_t blockLen, std::function<void(uint32_t timestamp, const Variant &row)> cb);
+};
+
+#endif /* __PUBLISHQUEUEEXTBATCH_H */
@@ -1,22 +1,9 @@
 #include "PublishQueueExtRK.h"
 
-#include <dirent.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-
-PublishQueueExt *PublishQueueExt::_instance;
-
 static Logger _log("app.pubq");
 
 
-PublishQueueExt &PublishQueueExt::instance() {
-    if (!_instance) {
-        _instance = new PublishQueueExt();
-    }
-    return *_instance;
-}
-
-PublishQueueExt &PublishQueueExt::withFileQueueSize(size_t size) {
+PublishQueueExtBase &PublishQueueExtBase::withFileQueueSize(size_t size) {
     fileQueueSize = size; 
 
     if (stateHandler) {
@@ -26,209 +13,1206 @@ PublishQueueExt &PublishQueueExt::withFileQueueSize(size_t size) {
     return *this; 
 }
 
-void PublishQueueExt::setup() {
+void PublishQueueExtBase::setup() {
     if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
         _log.error("SYSTEM_THREAD(ENABLED) is required");
         return;
     }
 
-    os_mutex_recursive_create(&mutex);
+    if (!storage->setup()) {
+        _log.error("storage setup failed");
+        return;
+    }
+
+    loadEventNames();
+    if (sequenceNumbers && !storage->isPersistent()) {
+        // The reserved block would be lost on reset and numbering would restart at 1
+        _log.error("sequence numbers require persistent storage, disabled");
+        sequenceNumbers = false;
+    }
+    loadSequence();
+
+    if (fullRecoveryScan) {
+        removeCorrupted();
+    }
+    else
+    if (storage->getQueueLen() > 0) {
+        // A reset during publish() can only leave the newest record partially written
+        PublishQueueExtIndexEntry &entry = storage->getQueueEntry(storage->getQueueLen() - 1);
+        if (!verifyIndexEntry(entry)) {
+            int fileNum = storage->removeLastFromQueue();
+            storage->removeData(fileNum);
+            _log.info("discarded corrupted event %d", fileNum);
+        }
+    }
+
+    checkQueueLimits();
+
+    // Events saved before a reset are held starting now
+    checkHold();
+
+    stateHandler = &PublishQueueExtBase::stateConnectWait;
+    waitingForEvent = false;
+}
+
+void PublishQueueExtBase::loop() {
+    if (stateHandler) {
+        // The lock prevents publish() from another thread from starting a direct publish
+        // while the state machine is selecting the next event
+        WITH_LOCK(*this) {
+            stateHandler(*this);
+
+            if (getNumEvents() != lastWatermarkNumEvents) {
+                checkWatermarks();
+            }
+        }
+    }
+}
+
+bool PublishQueueExtBase::publish(const CloudEvent &event) {
+    return isSuccess(publishInternal(event, EventOptions()));
+}
+
+bool PublishQueueExtBase::publish(const CloudEvent &event, const EventOptions &options) {
+    return isSuccess(publishInternal(event, options));
+}
+
+PublishQueueExtBase::PublishStatus PublishQueueExtBase::publishWithStatus(const CloudEvent &event, const EventOptions &options) {
+    return publishInternal(event, options);
+}
+
+PublishQueueExtBase::PublishStatus PublishQueueExtBase::tryPublish(const CloudEvent &event, const EventOptions &options) {
+    return publishInternal(event, options, false);
+}
+
+PublishQueueExtBase::PublishStatus PublishQueueExtBase::publishInternal(const CloudEvent &event, const EventOptions &options, bool canDiscard) {
+    PublishStatus status = PublishStatus::STORAGE_ERROR;
+
+    size_t nameLen = strlen(event.name());
+    if (nameLen == 0 || nameLen > kMaxEventNameLen) {
+        _log.error("invalid event name length %u", nameLen);
+        return PublishStatus::INVALID_EVENT;
+    }
+    if (sequenceNumbers && isSequenceInName(event) && nameLen + kMaxSequenceSuffixLen > kMaxEventNameLen) {
+        _log.error("event name length %u is too long to add the sequence number", nameLen);
+        return PublishStatus::INVALID_EVENT;
+    }
+
+    WITH_LOCK(*this) {
+        if (ramBudget != 0 && event.size() > ramBudget) {
+            _log.error("event size %u is over the RAM budget %u", event.size(), ramBudget);
+            stats.numTooLarge++;
+            return PublishStatus::TOO_LARGE;
+        }
+
+        // Use the registered name ID if there is one, so the name is not stored in each event
+        EventOptions eventOptions = options;
+        if (eventOptions.nameId == 0) {
+            eventOptions.nameId = findEventName(event.name()).id;
+        }
+        if (sequenceNumbers) {
+            eventOptions.sequence = nextSequence();
+            if (eventOptions.sequence == 0) {
+                return PublishStatus::STORAGE_ERROR;
+            }
+        }
+
+        // The caller's event is not modified; a batch block is saved from batchEvent instead
+        const CloudEvent *saveEvent = &event;
+        uint32_t timestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
+        int mergedFileNum = 0;
+        if (batchMaxRows != 0 && event.contentType() == ContentType::STRUCTURED && eventOptions.getTtl() == 0 &&
+            (eventOptions.sequence == 0 || sequenceKey.length() != 0)) {
+            if (encodeBatch(event, eventOptions, mergedFileNum, timestamp)) {
+                // Each row has its own sequence number in the block, so the block does not have one
+                eventOptions.sequence = 0;
+                saveEvent = &batchEvent;
+            }
+        }
+
+        // While holding, events are queued so they're sent together, unless urgent
+        if ((holdMaxMs == 0 || eventOptions.urgent) && canPublishDirect(*saveEvent)) {
+            status = publishDirect(*saveEvent, eventOptions);
+        }
+        else {
+            if (fileQueueSize <= 1 && storage->getQueueLen() > 0) {
+                // If queue length is 1 and there is an item in the queue, can't add another 
+                // because the first file can't be deleted because it might be in the process
+                // of being sent.
+                return PublishStatus::QUEUE_FULL;
+            }
+            if (!canDiscard && (storage->getQueueLen() >= (int)fileQueueSize || storage->isFull())) {
+                // tryPublish() refuses the event instead of discarding a queued event
+                return PublishStatus::QUEUE_FULL;
+            }
+
+            bool discardedForRoom = false;
+            if (storage->isFull()) {
+                // The backend has no room for another record (all mmap slots are in use), so
+                // discard a queued event now instead of after saving, as checkQueueLimits() does
+                int evictFileNum = selectEvictFromQueue();
+                if (evictFileNum) {
+                    storage->removeData(evictFileNum);
+                    _log.info("discarded event %d", evictFileNum);
+                    discardedForRoom = true;
+                }
+            }
+
+            int fileNum = storage->reserve();
+            if (fileNum) {
+                if (saveRecord(fileNum, *saveEvent, eventOptions, timestamp)) {
+                    status = discardedForRoom ? PublishStatus::QUEUED_DISCARDED : PublishStatus::QUEUED;
+
+                    if (mergedFileNum) {
+                        // The new block contains the events from the old one. It's removed after the new
+                        // block is saved so a reset in between sends events twice instead of losing them.
+                        storage->removeIf([mergedFileNum](PublishQueueExtIndexEntry &entry) {
+                            return entry.fileNum == mergedFileNum;
+                        });
+                    }
+                }
+            }
+            else {
+                _log.error("error reserving file in queue");
+            }
+        }
+        if (isSuccess(status)) {
+            if (checkQueueLimits() != 0 && status == PublishStatus::QUEUED) {
+                status = PublishStatus::QUEUED_DISCARDED;
+            }
+            checkHold(eventOptions.urgent);
+        }
+        checkWatermarks();
+        if (saveEvent == &batchEvent) {
+            batchEvent.clear();
+        }
+    }
+
+    return status;
+}
+
+bool PublishQueueExtBase::saveRecord(int fileNum, const CloudEvent &event, const EventOptions &options, uint32_t timestamp) {
+    updateEventStats(event.size(), storage->getSaveRamSize(event.size()));
+
+    bool bResult = storage->saveEventData(fileNum, event);
+    if (bResult) {
+        _log.trace("saved event to fileNum %d", fileNum);
+
+        // Save the meta data. The JSON and trailer are built in metaBuf so they
+        // can be written with a single append, without allocating memory.
+        size_t dataSize = 0;
+        storage->getSize(fileNum, dataSize);
+
+        // The CRC of the data is calculated by reading it back, so the data does not need to
+        // be in RAM as a single buffer, and a write that did not complete is detected
+        uint32_t crc = 0;
+        if (!crcRecordRange(fileNum, 0, dataSize, crc)) {
+            _log.error("error reading back event data");
+            bResult = false;
+        }
+
+        JSONBufferWriter writer(metaBuf, metaBufSize - sizeof(QueueFileTrailerExt) - sizeof(QueueFileTrailer));
+        if (options.nameId == 0) {
+            writer.beginObject();
+            writer.name("name").value(event.name());
+            writer.name("content-type").value((int)event.contentType());
+            writer.endObject();
+        }
+        // else the name and content type are only stored in the trailer extension
+        size_t metaSize = writer.dataSize();
+
+        PublishQueueExtIndexEntry entry;
+        entry.fileNum = fileNum;
+        entry.dataSize = (uint32_t) dataSize;
+        entry.timestamp = timestamp;
+        if (entry.timestamp && options.getTtl()) {
+            entry.expires = entry.timestamp + options.getTtl();
+        }
+        entry.contentType = (uint16_t) event.contentType();
+        entry.nameId = options.nameId;
+        entry.sequence = options.sequence;
+        entry.flags = PublishQueueExtIndexEntry::kFlagLoaded | PublishQueueExtIndexEntry::kFlagVerified;
+
+        if (!bResult) {
+            // Error already logged
+        }
+        else
+        if (metaSize <= writer.bufferSize()) {
+            QueueFileTrailerExt ext = {0};
+            ext.timestamp = entry.timestamp;
+            ext.contentType = entry.contentType;
+            ext.expires = entry.expires;
+            ext.nameId = entry.nameId;
+            ext.sequence = entry.sequence;
+            memcpy(&metaBuf[metaSize], &ext, sizeof(ext));
+
+            // The CRC covers the meta data and all of the extension except the crc field itself
+            crc = crc32(metaBuf, metaSize + kExtCrcOffset, crc);
+            ext.crc = crc32(&metaBuf[metaSize + kExtCrcEnd], sizeof(ext) - kExtCrcEnd, crc);
+            memcpy(&metaBuf[metaSize], &ext, sizeof(ext));
+
+            QueueFileTrailer trailer = {0};
+            trailer.magic = kQueueFileTrailerMagic;
+            trailer.dataSize = (uint32_t) dataSize;
+            trailer.metaSize = (uint16_t) metaSize;
+            trailer.extSize = (uint16_t) sizeof(ext);
+            memcpy(&metaBuf[metaSize + sizeof(ext)], &trailer, sizeof(trailer));
+
+            bResult = storage->append(fileNum, metaBuf, metaSize + sizeof(ext) + sizeof(trailer));
+        }
+        else {
+            _log.error("meta data too large %u", metaSize);
+            bResult = false;
+        }
+        storage->closeRecord(fileNum);
+
+        if (bResult) {
+            _log.trace("saved meta dataSize=%u metaSize=%u", dataSize, metaSize);
+
+            // The file number can be older than events already in the queue if it was
+            // reserved for a direct publish, so insert it in file number order
+            storage->insertInQueue(entry);
+        }
+        else {
+            storage->removeData(fileNum);
+        }
+    }
+
+    if (!bResult) {
+        _log.error("error saving event to fileNum %d", fileNum);
+    }
+    return bResult;
+}
+
+bool PublishQueueExtBase::canPublishDirect(const CloudEvent &event) {
+    if (!directPublish || !stateHandler) {
+        return false;
+    }
+
+    // Only when the state machine is idle in stateWaitEvent with nothing queued, so the
+    // event cannot be sent ahead of events that were published earlier
+    return waitingForEvent &&
+        curFileNum == 0 &&
+        storage->getQueueLen() == 0 &&
+        !pausePublishing &&
+        transport->connected() &&
+        (millis() - stateTime >= durationMs) &&
+        transport->canSend(event);
+}
+
+PublishQueueExtBase::PublishStatus PublishQueueExtBase::publishDirect(const CloudEvent &event, const EventOptions &options) {
+    // Reserve a file number now so the event keeps its place in the queue if it has to be saved
+    int fileNum = storage->reserve();
+    if (!fileNum) {
+        _log.error("error reserving file in queue");
+        return PublishStatus::STORAGE_ERROR;
+    }
+
+    curEvent = event;
+    curEventStreamed = false;
+    attachSequence(curEvent, options.sequence);
+    updateEventStats(curEvent.size(), 0);
+    curFileNum = fileNum;
+    curEventDirect = true;
+    curEventOptions = options;
+    curEventTimestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
+
+    // This message is monitored by the automated test tool. If you edit this, change that too.
+    _log.trace("publishing fileNum=%d event=%s", curFileNum, curEvent.name());
+
+    stateTime = millis();
+    sendTransport = transport;
+    if (!transport->send(curEvent)) {
+        _log.info("direct publish failed immediately, saving to queue");
+        durationMs = waitBetweenPublish;
+        return saveCurEvent() ? PublishStatus::QUEUED : PublishStatus::STORAGE_ERROR;
+    }
+
+    stateHandler = &PublishQueueExtBase::statePublishWait;
+    waitingForEvent = false;
+    canSleep = false;
+    return PublishStatus::SENT;
+}
+
+bool PublishQueueExtBase::saveCurEvent() {
+    bool bResult = false;
+
+    if (curEventDirect) {
+        // The record stores the name as published; the sequence number is added again when sent
+        detachSequence(curEvent, curEventOptions.sequence);
+        bResult = saveRecord(curFileNum, curEvent, curEventOptions, curEventTimestamp);
+        curEventDirect = false;
+        curEvent.clear();
+    }
+    curFileNum = 0;
+
+    return bResult;
+}
+
+PublishQueueExtBase &PublishQueueExtBase::withBatching(size_t maxRows, size_t maxBytes) {
+    WITH_LOCK(*this) {
+        batchMaxRows = maxRows;
+        batchMaxBytes = maxBytes;
+
+        if (batchMaxRows != 0) {
+            batchBuf.resize(batchMaxBytes * 2);
+        }
+        else {
+            std::vector<uint8_t>().swap(batchBuf);
+        }
+    }
+    return *this;
+}
+
+bool PublishQueueExtBase::encodeBatch(const CloudEvent &event, const EventOptions &options, int &mergedFileNum, uint32_t &timestamp) {
+    Variant data = event.dataStructured();
+    if (options.sequence != 0) {
+        // Stored as a column so each row in a merged block keeps its own number
+        data.set(sequenceKey.c_str(), Variant(options.sequence));
+    }
+    if (!PublishQueueExtBatch::isBatchable(data) || batchBuf.size() < batchMaxBytes * 2) {
+        return false;
+    }
+
+    // The first half holds the queued block and the second half the new block
+    uint8_t *buf = batchBuf.data();
+    uint8_t *newBlock = &buf[batchMaxBytes];
+    uint32_t now = Time.isValid() ? (uint32_t) Time.now() : 0;
+    size_t len = 0;
+
+    int queueLen = storage->getQueueLen();
+    if (queueLen > 0) {
+        PublishQueueExtIndexEntry &entry = storage->getQueueEntry(queueLen - 1);
+        loadIndexEntry(entry);
+
+        if (entry.fileNum != curFileNum &&
+            (entry.flags & PublishQueueExtIndexEntry::kFlagInvalid) == 0 &&
+            entry.contentType == (uint16_t) ContentType::BINARY &&
+            entry.expires == 0 &&
+            entry.dataSize <= batchMaxBytes) {
+
+            bool sameName;
+            if (entry.nameId != 0 || options.nameId != 0) {
+                sameName = (entry.nameId == options.nameId);
+            }
+            else {
+                char name[kMaxEventNameLen + 1];
+                sameName = readEventName(entry.fileNum, name, sizeof(name)) && strcmp(name, event.name()) == 0;
+            }
+
+            if (sameName && storage->readRange(entry.fileNum, 0, buf, entry.dataSize) == (int)entry.dataSize &&
+                PublishQueueExtBatch::isBlock(buf, entry.dataSize) &&
+                PublishQueueExtBatch::getNumRows(buf, entry.dataSize) < batchMaxRows) {
+                len = PublishQueueExtBatch::append(buf, entry.dataSize, data, now, newBlock, batchMaxBytes);
+                if (len) {
+                    mergedFileNum = entry.fileNum;
+                    timestamp = entry.timestamp;
+                }
+            }
+            storage->closeRecord(entry.fileNum);
+        }
+    }
+
+    if (!len) {
+        // Start a new block
+        len = PublishQueueExtBatch::encode(data, now, newBlock, batchMaxBytes);
+    }
+    if (len) {
+        batchEvent.name(event.name());
+        batchEvent.data((const char *)newBlock, len);
+        batchEvent.contentType(ContentType::BINARY);
+        _log.trace("batch block size=%u merged=%d", len, mergedFileNum);
+    }
+
+    return len != 0;
+}
+
+bool PublishQueueExtBase::publish(const char *eventName) {
+    CloudEvent event;
+
+    event.name(eventName);
+
+    return isSuccess(publishInternal(event, EventOptions()));
+}
+
+
+bool PublishQueueExtBase::publish(const char *eventName, const char *data) {
+    CloudEvent event;
+
+    event.name(eventName);
+    event.data(data);
+
+    return isSuccess(publishInternal(event, EventOptions()));
+}
+
+
+bool PublishQueueExtBase::publish(const char *eventName, const Variant &data) {
+    CloudEvent event;
+
+    event.name(eventName);
+    event.data(data);
+
+    return isSuccess(publishInternal(event, EventOptions()));
+
+}
+
+bool PublishQueueExtBase::publish(const char *eventName, const Variant &data, ContentType type) {
+
+    // Possibly add safety checks in future version
+    /*
+    if (data.isArray() || data.isMap()) {
+        if (type != ContentType::STRUCTURED) {
+            _log.error("cannot encode array or map as content type %d", (int)type);
+            return false;
+        }
+    }
+    else
+    if (type == ContentType::TEXT) {
+        _log.error("cannot use content type TEXT with Variant");
+        return false;
+    } 
+    */   
+
+    CloudEvent event;
+
+    event.name(eventName);
+    event.data(data);
+    event.contentType(type);
+
+    return isSuccess(publishInternal(event, EventOptions()));
+}
+
+bool PublishQueueExtBase::publish(EventNameHandle name, const char *data) {
+    return publish(name, Variant(data), ContentType::TEXT, EventOptions());
+}
+
+bool PublishQueueExtBase::publish(EventNameHandle name, const Variant &data, ContentType type, const EventOptions &options) {
+    const char *eventName = getEventName(name);
+    if (!eventName) {
+        _log.error("invalid event name handle %u", name.id);
+        return false;
+    }
+
+    CloudEvent event;
+
+    event.name(eventName);
+    event.data(data);
+    event.contentType(type);
+
+    EventOptions eventOptions = options;
+    eventOptions.nameId = name.id;
+
+    return isSuccess(publishInternal(event, eventOptions));
+}
+
+PublishQueueExtBase::EventNameHandle PublishQueueExtBase::registerEventName(const char *name) {
+    EventNameHandle handle;
+
+    size_t nameLen = strlen(name);
+    if (nameLen == 0 || nameLen > kMaxEventNameLen) {
+        _log.error("invalid event name length %u", nameLen);
+        return handle;
+    }
+
+    WITH_LOCK(*this) {
+        handle = findEventName(name);
+        if (!handle.isValid()) {
+            if (!stateHandler) {
+                _log.error("registerEventName must be called after setup");
+            }
+            else
+            if (eventNames.size() >= kMaxEventNames) {
+                _log.error("too many event names");
+            }
+            else {
+                // IDs are never reused or reassigned, as queued events refer to them
+                eventNames.push_back(name);
+                if (saveEventNames()) {
+                    handle.id = (uint16_t) eventNames.size();
+                }
+                else {
+                    _log.error("failed to save event names");
+                    eventNames.pop_back();
+                }
+            }
+        }
+    }
+    return handle;
+}
+
+PublishQueueExtBase::EventNameHandle PublishQueueExtBase::findEventName(const char *name) const {
+    EventNameHandle handle;
+
+    for(size_t ii = 0; ii < eventNames.size(); ii++) {
+        if (strcmp(eventNames[ii].c_str(), name) == 0) {
+            handle.id = (uint16_t) (ii + 1);
+            break;
+        }
+    }
+    return handle;
+}
+
+const char *PublishQueueExtBase::getEventName(EventNameHandle handle) const {
+    if (handle.id == 0 || handle.id > eventNames.size()) {
+        return nullptr;
+    }
+    return eventNames[handle.id - 1].c_str();
+}
+
+bool PublishQueueExtBase::saveEventNames() {
+    // The dictionary is stored as null-terminated names in ID order
+    size_t size = 0;
+    for(const String &name : eventNames) {
+        size += name.length() + 1;
+    }
+
+    char *buf = new char[size];
+    if (!buf) {
+        return false;
+    }
+    char *cp = buf;
+    for(const String &name : eventNames) {
+        strcpy(cp, name.c_str());
+        cp += name.length() + 1;
+    }
+
+    bool bResult = storage->saveAux(kEventNamesAuxName, buf, size);
+    delete[] buf;
+
+    return bResult;
+}
+
+void PublishQueueExtBase::loadEventNames() {
+    eventNames.clear();
+
+    char *buf = new char[kMaxEventNames * (kMaxEventNameLen + 1)];
+    if (!buf) {
+        return;
+    }
+
+    int size = storage->loadAux(kEventNamesAuxName, buf, kMaxEventNames * (kMaxEventNameLen + 1));
+    for(int offset = 0; offset < size; ) {
+        const char *name = &buf[offset];
+        size_t len = strnlen(name, size - offset);
+        if (len == (size_t)(size - offset)) {
+            // Not null terminated, truncated file
+            break;
+        }
+        eventNames.push_back(name);
+        offset += len + 1;
+    }
+    delete[] buf;
+
+    _log.trace("loaded %u event names", eventNames.size());
+}
+
+bool PublishQueueExtBase::publish(const char *eventName, const Variant &data, ContentType type, const EventOptions &options) {
+    CloudEvent event;
+
+    event.name(eventName);
+    event.data(data);
+    event.contentType(type);
+
+    return isSuccess(publishInternal(event, options));
+}
+
+
+
+uint32_t PublishQueueExtBase::nextSequence() {
+    if (sequenceNext >= sequenceLimit) {
+        // Reserve a block so storage is only written once every kSequenceBlockSize events
+        uint32_t savedLimit = sequenceLimit;
+        sequenceLimit = sequenceNext + kSequenceBlockSize;
+        if (!saveSequence()) {
+            // Numbers past the saved limit would be assigned again after a reset
+            _log.error("error saving sequence block");
+            sequenceLimit = savedLimit;
+            return 0;
+        }
+    }
+    return sequenceNext++;
+}
+
+bool PublishQueueExtBase::saveSequence() {
+    return storage->saveAux(kSequenceAuxName, &sequenceLimit, sizeof(sequenceLimit));
+}
+
+void PublishQueueExtBase::loadSequence() {
+    uint32_t limit = 0;
+
+    if (storage->loadAux(kSequenceAuxName, &limit, sizeof(limit)) == (int)sizeof(limit) && limit != 0) {
+        // Numbers from the last block may have been used before the reset, so start after it
+        sequenceNext = sequenceLimit = limit;
+        _log.trace("sequence continues from %lu", limit);
+    }
+}
+
+void PublishQueueExtBase::attachSequence(CloudEvent &event, uint32_t sequence) {
+    if (sequence == 0 || sequenceKey.length() == 0) {
+        return;
+    }
+
+    if (event.contentType() == ContentType::STRUCTURED) {
+        Variant data = event.dataStructured();
+        data.set(sequenceKey.c_str(), Variant(sequence));
+        event.data(data);
+    }
+    else
+    if (isSequenceInName(event)) {
+        char name[kMaxEventNameLen + 1];
+        if (snprintf(name, sizeof(name), "%s/%lu", event.name(), (unsigned long)sequence) < (int)sizeof(name)) {
+            event.name(name);
+        }
+        else {
+            // Queued before withSequenceNameSuffix() was enabled; publishInternal() refuses these names now
+            _log.error("event name too long to add the sequence number %lu", (unsigned long)sequence);
+        }
+    }
+}
+
+void PublishQueueExtBase::detachSequence(CloudEvent &event, uint32_t sequence) {
+    if (sequence == 0 || !isSequenceInName(event)) {
+        return;
+    }
+
+    char name[kMaxEventNameLen + 1];
+    char suffix[kMaxSequenceSuffixLen + 1];
+    snprintf(suffix, sizeof(suffix), "/%lu", (unsigned long)sequence);
+
+    size_t nameLen = strlen(event.name());
+    size_t suffixLen = strlen(suffix);
+    if (nameLen > suffixLen && nameLen < sizeof(name) && strcmp(event.name() + nameLen - suffixLen, suffix) == 0) {
+        memcpy(name, event.name(), nameLen - suffixLen);
+        name[nameLen - suffixLen] = 0;
+        event.name(name);
+    }
+}
+
+void PublishQueueExtBase::clearQueues() {
+    WITH_LOCK(*this) {
+        storage->removeAll();
+
+        // The storage directory may have been removed, so save the name dictionary and
+        // sequence number block again
+        if (!eventNames.empty()) {
+            saveEventNames();
+        }
+        if (sequenceLimit != 0) {
+            saveSequence();
+        }
+    }
+
+    _log.trace("clearQueues");
+}
+
+void PublishQueueExtBase::setPausePublishing(bool value) { 
+    pausePublishing = value; 
+
+    if (!value) {
+        // When resuming publishing, update the canSleep flag
+        if (getNumEvents() != 0) {
+            canSleep = false;
+        }
+    }
+}
+
+
+
+size_t PublishQueueExtBase::removeIf(std::function<bool(const EventInfo &info)> pred) {
+    size_t numRemoved = 0;
+
+    WITH_LOCK(*this) {
+        numRemoved = storage->removeIf([&](PublishQueueExtIndexEntry &entry) {
+            if (entry.fileNum == curFileNum) {
+                // Never remove the event being sent
+                return false;
+            }
+            loadIndexEntry(entry);
+            return pred(EventInfo(*this, entry));
+        });
+    }
+    if (numRemoved) {
+        _log.trace("removeIf removed %u events", numRemoved);
+    }
+
+    return numRemoved;
+}
+
+PublishQueueExtBase::EventInfo PublishQueueExtBase::getEventInfo(size_t index) {
+    PublishQueueExtIndexEntry &entry = storage->getQueueEntry(index);
+    loadIndexEntry(entry);
+
+    return EventInfo(*this, entry);
+}
+
+bool PublishQueueExtBase::EventInfo::isInFlight() const {
+    return entry.fileNum == queue->curFileNum;
+}
+
+long PublishQueueExtBase::EventInfo::getAge() const {
+    if (entry.timestamp == 0 || !Time.isValid()) {
+        return -1;
+    }
+    long age = (long) (Time.now() - (time_t) entry.timestamp);
+    return (age >= 0) ? age : 0;
+}
+
+bool PublishQueueExtBase::EventInfo::getName(char *buf, size_t bufSize) const {
+    return queue->readEventName(entry.fileNum, buf, bufSize);
+}
+
+// Table for crc32(), generated at compile time so it's stored in flash
+struct Crc32Table {
+    uint32_t entries[256];
+
+    constexpr Crc32Table() : entries() {
+        for(uint32_t ii = 0; ii < 256; ii++) {
+            uint32_t value = ii;
+            for(int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? (0xedb88320 ^ (value >> 1)) : (value >> 1);
+            }
+            entries[ii] = value;
+        }
+    }
+};
+static constexpr Crc32Table crc32Table;
+
+uint32_t PublishQueueExtBase::crc32(const void *buf, size_t len, uint32_t crc) {
+    const uint8_t *p = (const uint8_t *)buf;
+
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc = crc32Table.entries[(crc ^ p[ii]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+bool PublishQueueExtBase::readTrailer(int fileNum, QueueFileTrailer &trailer, QueueFileTrailerExt &ext) {
+    memset(&trailer, 0, sizeof(trailer));
+    memset(&ext, 0, sizeof(ext));
+
+    size_t fileSize = 0;
+    if (!storage->getSize(fileNum, fileSize)) {
+        return false;
+    }
+    _log.trace("reading fileNum=%d fileSize=%u", fileNum, fileSize);
+
+    if (fileSize < sizeof(QueueFileTrailer)) {
+        _log.info("queue files size %d is too small %d", fileSize, fileNum);
+        return false;
+    }
+
+    storage->readRange(fileNum, fileSize - sizeof(QueueFileTrailer), &trailer, sizeof(trailer));
+
+    if (trailer.magic != kQueueFileTrailerMagic) {
+        _log.info("queue files invalid magic 0x%08lx %d", trailer.magic, fileNum);
+        return false;
+    }
+    // The sizes must add up to the record size exactly, otherwise a corrupted extSize could make a
+    // record look like it's from a version without a CRC
+    if ((trailer.dataSize > fileSize) || ((trailer.dataSize + trailer.metaSize + trailer.extSize + sizeof(QueueFileTrailer)) != fileSize)) {
+        _log.info("invalid sizes dataSize=%lu metaSize=%u extSize=%u %d", trailer.dataSize, trailer.metaSize, trailer.extSize, fileNum);
+        return false;
+    }
+
+    if (trailer.extSize) {
+        // Files written by a newer version may have a larger extension; only read the fields we know about
+        size_t extSize = (trailer.extSize < sizeof(ext)) ? trailer.extSize : sizeof(ext);
+        storage->readRange(fileNum, trailer.dataSize + trailer.metaSize, &ext, extSize);
+    }
+
+    return true;
+}
+
+bool PublishQueueExtBase::crcRecordRange(int fileNum, size_t offset, size_t size, uint32_t &crc) {
+    for(size_t ii = 0; ii < size; ii += metaBufSize) {
+        size_t count = size - ii;
+        if (count > metaBufSize) {
+            count = metaBufSize;
+        }
+        if (storage->readRange(fileNum, offset + ii, metaBuf, count) != (int)count) {
+            return false;
+        }
+        crc = crc32(metaBuf, count, crc);
+    }
+    return true;
+}
+
+bool PublishQueueExtBase::verifyRecord(int fileNum, const QueueFileTrailer &trailer, const QueueFileTrailerExt &ext) {
+    if (trailer.extSize < kExtCrcEnd) {
+        // Written by a version without a CRC
+        return true;
+    }
+
+    // Everything before the crc field, then the rest of the extension, which may be larger
+    // than QueueFileTrailerExt if written by a newer version
+    size_t extOffset = trailer.dataSize + trailer.metaSize;
+    uint32_t crc = 0;
+    if (!crcRecordRange(fileNum, 0, extOffset + kExtCrcOffset, crc) ||
+        !crcRecordRange(fileNum, extOffset + kExtCrcEnd, trailer.extSize - kExtCrcEnd, crc)) {
+        return false;
+    }
+
+    if (crc != ext.crc) {
+        _log.info("invalid crc 0x%08lx expected 0x%08lx %d", crc, ext.crc, fileNum);
+        return false;
+    }
+    return true;
+}
+
+bool PublishQueueExtBase::verifyIndexEntry(PublishQueueExtIndexEntry &entry) {
+    if ((entry.flags & (PublishQueueExtIndexEntry::kFlagVerified | PublishQueueExtIndexEntry::kFlagInvalid)) == 0) {
+        QueueFileTrailer trailer;
+        QueueFileTrailerExt ext;
+        if (readTrailer(entry.fileNum, trailer, ext) && verifyRecord(entry.fileNum, trailer, ext)) {
+            entry.flags |= PublishQueueExtIndexEntry::kFlagVerified;
+        }
+        else {
+            entry.flags |= PublishQueueExtIndexEntry::kFlagInvalid;
+        }
+        storage->closeRecord(entry.fileNum);
+    }
+    return (entry.flags & PublishQueueExtIndexEntry::kFlagInvalid) == 0;
+}
+
+void PublishQueueExtBase::loadIndexEntry(PublishQueueExtIndexEntry &entry) {
+    if (entry.flags & PublishQueueExtIndexEntry::kFlagLoaded) {
+        return;
+    }
+
+    QueueFileTrailer trailer;
+    QueueFileTrailerExt ext;
+    if (readTrailer(entry.fileNum, trailer, ext)) {
+        entry.dataSize = trailer.dataSize;
+        entry.timestamp = ext.timestamp;
+        entry.expires = ext.expires;
+        entry.nameId = ext.nameId;
+        entry.sequence = ext.sequence;
+        entry.contentType = ext.contentType;
+
+        if (trailer.extSize == 0 && trailer.metaSize < metaBufSize) {
+            // Files from versions before 0.1.0 only have the content type in the meta data
+            int contentType = (int)ContentType::TEXT;
+            storage->readRange(entry.fileNum, trailer.dataSize, metaBuf, trailer.metaSize);
+            metaBuf[trailer.metaSize] = 0;
+            parseMeta(metaBuf, nameBuf, sizeof(nameBuf), contentType);
+            entry.contentType = (uint16_t) contentType;
+        }
+    }
+    else {
+        entry.flags |= PublishQueueExtIndexEntry::kFlagInvalid;
+    }
+    storage->closeRecord(entry.fileNum);
+
+    entry.flags |= PublishQueueExtIndexEntry::kFlagLoaded;
+}
+
+bool PublishQueueExtBase::readEventName(int fileNum, char *buf, size_t bufSize) {
+    bool bResult = false;
+
+    QueueFileTrailer trailer;
+    QueueFileTrailerExt ext;
+    if (readTrailer(fileNum, trailer, ext)) {
+        // Uses its own buffer so this can be called while metaBuf is in use by the state machine
+        char json[kMaxEventNameLen * 2 + 64];
+        if (ext.nameId != 0) {
+            const char *name = getEventName(EventNameHandle(ext.nameId));
+            if (name && strlen(name) < bufSize) {
+                strcpy(buf, name);
+                bResult = true;
+            }
+        }
+        else
+        if (trailer.metaSize < sizeof(json)) {
+            storage->readRange(fileNum, trailer.dataSize, json, trailer.metaSize);
+            json[trailer.metaSize] = 0;
 
-    fileQueue
-        .withFilenameExtension("pq")
-        .scanDir();
+            int contentType;
+            bResult = parseMeta(json, buf, bufSize, contentType);
+        }
+    }
+    storage->closeRecord(fileNum);
 
-    checkQueueLimits();
+    return bResult;
+}
 
-    stateHandler = &PublishQueueExt::stateConnectWait;
+bool PublishQueueExtBase::isExpired(const PublishQueueExtIndexEntry &entry) const {
+    return entry.expires != 0 && Time.isValid() && (uint32_t) Time.now() >= entry.expires;
 }
 
-void PublishQueueExt::loop() {
-    if (stateHandler) {
-        stateHandler(*this);
+size_t PublishQueueExtBase::removeExpired() {
+    size_t numRemoved = 0;
+
+    if (!Time.isValid()) {
+        return 0;
     }
-}
 
-bool PublishQueueExt::publish(CloudEvent event) {
-    bool bResult = false;
-    
-    if (fileQueueSize <= 1 && fileQueue.getQueueLen() > 0) {
-        // If queue length is 1 and there is an item in the queue, can't add another 
-        // because the first file can't be deleted because it might be in the process
-        // of being sent.
-        return false;
+    WITH_LOCK(*this) {
+        numRemoved = storage->removeIf([&](PublishQueueExtIndexEntry &entry) {
+            if (entry.fileNum == curFileNum) {
+                return false;
+            }
+            loadIndexEntry(entry);
+            return isExpired(entry);
+        });
+    }
+    if (numRemoved) {
+        _log.info("discarded %u expired events", numRemoved);
     }
 
+    return numRemoved;
+}
 
-    int fileNum = fileQueue.reserveFile();
+size_t PublishQueueExtBase::removeCorrupted() {
+    size_t numRemoved = 0;
+    size_t numChecked = 0;
+    unsigned long startMs = millis();
 
+    WITH_LOCK(*this) {
+        numChecked = storage->getQueueLen();
+        numRemoved = storage->removeIf([&](PublishQueueExtIndexEntry &entry) {
+            if (entry.fileNum == curFileNum) {
+                return false;
+            }
+            return !verifyIndexEntry(entry);
+        });
+    }
+    _log.info("checked %u events in %lu ms, discarded %u corrupted", numChecked, millis() - startMs, numRemoved);
 
-    if (fileNum) {
-        // 
-        String queueFilePath = fileQueue.getPathForFileNum(fileNum); // .pq (publish queue) file
+    return numRemoved;
+}
 
-        bResult = event.saveData(queueFilePath.c_str()) == SYSTEM_ERROR_NONE;
-        if (bResult) {
-            _log.trace("saved event to fileNum %d", fileNum);
+size_t PublishQueueExtBase::checkQueueLimits() {
+    size_t numDiscarded = 0;
 
-            // Save the meta data
-            int fd = open(queueFilePath.c_str(), O_RDWR);
-            if (fd != -1) {
-                struct stat sb = {0};
-                fstat(fd, &sb);
+    if (storage->getQueueLen() > (int)fileQueueSize) {
+        // Discard expired events before discarding events that could still be sent
+        numDiscarded += removeExpired();
+    }
 
-                lseek(fd, 0, SEEK_END);
+    for(int tries = 0; tries < 3 && storage->getQueueLen() > (int)fileQueueSize; tries++) {
+        int fileNum = selectEvictFromQueue();
+        if (fileNum) {
+            storage->removeData(fileNum);
+            _log.info("discarded event %d", fileNum);
+            numDiscarded++;
+        }
+        else {
+            break;
+        }
+    }
+    return numDiscarded;
+}
 
-                particle::Variant meta;
-                meta.set("name", event.name());
-                meta.set("content-type", (int)event.contentType());
+size_t PublishQueueExtBase::getQueueBytes() {
+    size_t result = 0;
 
-                String metaJson = meta.toJSON();
-                write(fd, metaJson.c_str(), metaJson.length());
+    WITH_LOCK(*this) {
+        for(int ii = 0; ii < storage->getQueueLen(); ii++) {
+            PublishQueueExtIndexEntry &entry = storage->getQueueEntry(ii);
+            loadIndexEntry(entry);
+            result += entry.dataSize;
+        }
+        if (curEventDirect) {
+            result += curEvent.size();
+        }
+    }
+    return result;
+}
 
-                QueueFileTrailer trailer = {0};
-                trailer.magic = kQueueFileTrailerMagic;
-                trailer.dataSize = (uint32_t) sb.st_size;
-                trailer.metaSize = (uint16_t) metaJson.length();
-                
-                write(fd, &trailer, sizeof(trailer));
+void PublishQueueExtBase::checkWatermarks() {
+    if (highWatermarkCount == 0 && highWatermarkBytes == 0) {
+        return;
+    }
 
-                close(fd);
+    size_t numEvents = getNumEvents();
+    lastWatermarkNumEvents = numEvents;
 
-                _log.trace("saved meta dataSize=%lu metaSize=%u %s ", trailer.dataSize, trailer.metaSize, metaJson.c_str());
+    // The byte count requires a pass over the index, so it's only calculated when used
+    size_t numBytes = (highWatermarkBytes != 0) ? getQueueBytes() : 0;
 
-                fileQueue.addFileToQueue(fileNum);                
+    if (!aboveHighWatermark) {
+        if ((highWatermarkCount != 0 && numEvents >= highWatermarkCount) ||
+            (highWatermarkBytes != 0 && numBytes >= highWatermarkBytes)) {
+            aboveHighWatermark = true;
+            _log.info("above high watermark numEvents=%u numBytes=%u", numEvents, numBytes);
+            if (watermarkCallback) {
+                watermarkCallback(true);
             }
-            else {
-                _log.error("error opening %s", queueFilePath.c_str());
-            }
-        }
-
-        if (!bResult) {
-            _log.error("error saving event to fileNum %d", fileNum);
         }
     }
     else {
-        _log.error("error reserving file in queue");
-    }
-    if (bResult) {
-        checkQueueLimits();
+        if (numEvents <= lowWatermarkCount && numBytes <= lowWatermarkBytes) {
+            aboveHighWatermark = false;
+            _log.info("below low watermark numEvents=%u numBytes=%u", numEvents, numBytes);
+            if (watermarkCallback) {
+                watermarkCallback(false);
+            }
+        }
     }
-
-    return bResult;
 }
 
-bool PublishQueueExt::publish(const char *eventName) {
-    CloudEvent event;
-
-    event.name(eventName);
+PublishQueueExtBase::Stats PublishQueueExtBase::getStats() {
+    Stats result;
 
-    return publish(event);
+    WITH_LOCK(*this) {
+        result = stats;
+    }
+    return result;
 }
 
+void PublishQueueExtBase::clearStats() {
+    WITH_LOCK(*this) {
+        stats = Stats();
+    }
+}
 
-bool PublishQueueExt::publish(const char *eventName, const char *data) {
-    CloudEvent event;
+void PublishQueueExtBase::updateEventStats(size_t dataSize, size_t tempRamSize) {
+    if (dataSize > stats.peakEventSize) {
+        stats.peakEventSize = dataSize;
+    }
+    if (dataSize + tempRamSize > stats.peakEventRam) {
+        stats.peakEventRam = dataSize + tempRamSize;
+    }
+}
 
-    event.name(eventName);
-    event.data(data);
+PublishQueueExtBase::LockStats PublishQueueExtBase::getLockStats() {
+    LockStats result;
 
-    return publish(event);
+    WITH_LOCK(*this) {
+        result = lockStats;
+    }
+    return result;
 }
 
+void PublishQueueExtBase::clearLockStats() {
+    WITH_LOCK(*this) {
+        lockStats = LockStats();
+    }
+}
 
-bool PublishQueueExt::publish(const char *eventName, const Variant &data) {
-    CloudEvent event;
+void PublishQueueExtBase::lockWithStats() {
+    if (os_mutex_recursive_trylock(mutex) == 0) {
+        lockAcquired();
+        return;
+    }
 
-    event.name(eventName);
-    event.data(data);
+    // Another thread holds the lock
+    uint32_t startUs = micros();
+    os_mutex_recursive_lock(mutex);
+    uint32_t waitUs = micros() - startUs;
 
-    return publish(event);
+    lockStats.numContended++;
+    lockStats.totalWaitUs += waitUs;
+    if (waitUs > lockStats.maxWaitUs) {
+        lockStats.maxWaitUs = waitUs;
+    }
+    lockAcquired();
+}
 
+void PublishQueueExtBase::lockAcquired() {
+    if (lockDepth++ == 0) {
+        lockStats.numLocks++;
+        lockAcquiredUs = micros();
+    }
 }
 
-bool PublishQueueExt::publish(const char *eventName, const Variant &data, ContentType type) {
+void PublishQueueExtBase::lockReleasing() {
+    if (lockDepth == 0) {
+        // Not locked, or locked before PUBLISHQUEUEEXT_LOCK_STATS took effect
+        return;
+    }
+    if (--lockDepth == 0) {
+        uint32_t holdUs = micros() - lockAcquiredUs;
 
-    // Possibly add safety checks in future version
-    /*
-    if (data.isArray() || data.isMap()) {
-        if (type != ContentType::STRUCTURED) {
-            _log.error("cannot encode array or map as content type %d", (int)type);
-            return false;
+        lockStats.totalHoldUs += holdUs;
+        if (holdUs > lockStats.maxHoldUs) {
+            lockStats.maxHoldUs = holdUs;
         }
     }
-    else
-    if (type == ContentType::TEXT) {
-        _log.error("cannot use content type TEXT with Variant");
-        return false;
-    } 
-    */   
-
-    CloudEvent event;
-
-    event.name(eventName);
-    event.data(data);
-    event.contentType(type);
-
-    return publish(event);
 }
 
+void PublishQueueExtBase::checkHold(bool urgent) {
+    if (holdMaxMs == 0) {
+        return;
+    }
 
+    size_t numEvents = storage->getQueueLen();
+    if (numEvents == 0) {
+        // Queue is empty, the next event queued starts a new hold
+        holdStarted = false;
+        holdReleased = false;
+        return;
+    }
+    if (holdReleased) {
+        return;
+    }
 
-void PublishQueueExt::clearQueues() {
-    fileQueue.removeAll(true);
+    if (!holdStarted) {
+        holdStarted = true;
+        holdStartMs = millis();
+    }
 
-    _log.trace("clearQueues");
+    if (urgent ||
+        (holdCount != 0 && numEvents >= holdCount) ||
+        (holdBytes != 0 && getQueueBytes() >= holdBytes) ||
+        (millis() - holdStartMs >= holdMaxMs)) {
+        holdReleased = true;
+        _log.trace("hold ended numEvents=%u urgent=%d", numEvents, (int)urgent);
+    }
 }
 
-void PublishQueueExt::setPausePublishing(bool value) { 
-    pausePublishing = value; 
-
-    if (!value) {
-        // When resuming publishing, update the canSleep flag
-        if (getNumEvents() != 0) {
-            canSleep = false;
-        }
+unsigned long PublishQueueExtBase::getHoldTimeRemaining() const {
+    if (!isHolding()) {
+        return 0;
     }
+    unsigned long elapsed = millis() - holdStartMs;
+    return (elapsed < holdMaxMs) ? (holdMaxMs - elapsed) : 0;
 }
 
-
-
-void PublishQueueExt::checkQueueLimits() {
-    for(int tries = 0; tries < 3 && fileQueue.getQueueLen() > (int)fileQueueSize; tries++) {
-        int fileNum = fileQueue.removeSecondFileInQueue();
-        if (fileNum) {
-            fileQueue.removeFileNum(fileNum, false);
-            _log.info("discarded event %d", fileNum);
-        }
-        else {
-            break;
-        }
-    }
+int PublishQueueExtBase::selectEvictFromQueue() {
+    return storage->removeSecondFromQueue(curFileNum);
 }
 
-size_t PublishQueueExt::getNumEvents() {
+size_t PublishQueueExtBase::getNumEvents() {
     size_t result = 0;
 
-    result = fileQueue.getQueueLen();
+    result = storage->getQueueLen();
+    if (curEventDirect) {
+        // Event sent by direct publish that is not in the queue
+        result++;
+    }
 
     return result;
 }
 
-void PublishQueueExt::stateConnectWait() {
-    canSleep = (pausePublishing || getNumEvents() == 0);
+void PublishQueueExtBase::stateConnectWait() {
+    checkHold();
+    canSleep = (pausePublishing || getNumEvents() == 0 || isHolding());
 
-    if (Particle.connected()) {
+    if (transport->connected()) {
         stateTime = millis();
         durationMs = waitAfterConnect;
-        stateHandler = &PublishQueueExt::stateWaitEvent;
+        if (reconnectRandomMs) {
+            durationMs += HAL_RNG_GetRandomNumber() % (reconnectRandomMs + 1);
+        }
+        connectedMs = stateTime + durationMs;
+
+        // Events queued up to now are the backlog for withFreshEventShare()
+        int queueLen = storage->getQueueLen();
+        backlogEndFileNum = (queueLen > 0) ? storage->getQueueEntry(queueLen - 1).fileNum : 0;
+        freshCredit = 0;
+
+        stateHandler = &PublishQueueExtBase::stateWaitEvent;
+        waitingForEvent = true;
     }
 }
 
 
-void PublishQueueExt::stateWaitEvent() {
-    if (!Particle.connected()) {
-        stateHandler = &PublishQueueExt::stateConnectWait;
+void PublishQueueExtBase::stateWaitEvent() {
+    if (!transport->connected()) {
+        stateHandler = &PublishQueueExtBase::stateConnectWait;
+        waitingForEvent = false;
         return;
     }
 
@@ -239,162 +1223,142 @@ void PublishQueueExt::stateWaitEvent() {
     }
 
     if (millis() - stateTime < durationMs) {
-        canSleep = (getNumEvents() == 0);
+        canSleep = (getNumEvents() == 0 || isHolding());
         // Stay in stateWaitEvent
         return;
     }
     
     if (curFileNum == 0) {
-        curFileNum = fileQueue.getFileFromQueue(false);
-        if (curFileNum == 0) {
-            // No events, can sleep
+        checkHold();
+        if (isHolding()) {
+            // Events are held until a hold limit is reached, so the radio can stay idle
             canSleep = true;
 
             // Stay in stateWaitEvent
             return;
         }
 
-        curEvent.clear();
-
-        tempFilePath = String(fileQueue.getDirPath()) + String("/") + tempFileName;
-
-        String queueFilePath = fileQueue.getPathForFileNum(curFileNum);
-
-        bool isValid = true;
+        curFileNum = selectNextEvent();
+        if (curFileNum == 0) {
+            // No events, can sleep
+            canSleep = true;
 
-        int fd = open(queueFilePath.c_str(), O_RDWR);
-        if (fd == -1) {
-            isValid = false;
+            // Stay in stateWaitEvent
+            return;
         }
 
-        size_t fileSize = 0;
-
-        if (isValid) {
-            struct stat sb = {0};
-            fstat(fd, &sb);
-            fileSize = (size_t)sb.st_size;
-            _log.trace("reading fileNum=%d fileSize=%u", curFileNum, fileSize);
-            
-            if (fileSize < sizeof(QueueFileTrailer)) {
-                _log.info("queue files size %d is too small %s", fileSize, queueFilePath.c_str());
-                isValid = false;
+        // Skip expired events using only the index, without reading the meta data or event data
+        PublishQueueExtIndexEntry *entry = storage->findQueueEntry(curFileNum);
+        if (entry) {
+            loadIndexEntry(*entry);
+            if (isExpired(*entry)) {
+                _log.info("discarding expired event %d", curFileNum);
+                storage->remove(curFileNum);
+                curFileNum = 0;
+                return;
             }
         }
 
-        QueueFileTrailer trailer = {0};
-        if (isValid) {
-            lseek(fd, fileSize - sizeof(QueueFileTrailer), SEEK_SET);
-            
-            read(fd, &trailer, sizeof(trailer));
+        curEvent.clear();
+        curEventStreamed = false;
 
-            if (trailer.magic != kQueueFileTrailerMagic) {
-                _log.info("queue files invalid magic 0x%08lx %s", trailer.magic, queueFilePath.c_str());
-                isValid = false;
-            }
-            if ((trailer.dataSize > fileSize) || ((trailer.dataSize + trailer.metaSize) > fileSize)) {
-                _log.info("invalid sizes dataSize=%lu metaSize=%u %s", trailer.dataSize, trailer.metaSize, queueFilePath.c_str());
-                isValid = false;
-            }
+        QueueFileTrailer trailer;
+        QueueFileTrailerExt ext;
+        bool isValid = readTrailer(curFileNum, trailer, ext);
+        if (isValid && !(entry && (entry->flags & PublishQueueExtIndexEntry::kFlagVerified))) {
+            isValid = verifyRecord(curFileNum, trailer, ext);
         }
-        Variant meta;
-        char *metaJson = nullptr;
 
-        if (isValid) {
-            metaJson = new char[trailer.metaSize + 1];
-            if (metaJson) {
-                lseek(fd, trailer.dataSize, SEEK_SET);
+        int contentType = (int)ContentType::TEXT;
+        const char *eventName = nameBuf;
 
-                read(fd, metaJson, trailer.metaSize);
+        if (isValid) {
+            if (ext.nameId != 0) {
+                // Registered event name, there is no JSON meta data to read
+                eventName = getEventName(EventNameHandle(ext.nameId));
+                contentType = ext.contentType;
+                if (!eventName) {
+                    _log.info("unknown nameId %u %d", ext.nameId, curFileNum);
+                    isValid = false;
+                }
+            }
+            else
+            if (trailer.metaSize < metaBufSize) {
+                storage->readRange(curFileNum, trailer.dataSize, metaBuf, trailer.metaSize);
+                metaBuf[trailer.metaSize] = 0;
 
-                metaJson[trailer.metaSize] = 0;
-                meta = Variant::fromJSON(metaJson);
+                isValid = parseMeta(metaBuf, nameBuf, sizeof(nameBuf), contentType);
             }
             else {
-                _log.info("failed to allocate meta metaSize=%u %s", trailer.metaSize, queueFilePath.c_str());
+                _log.info("meta too large metaSize=%u %d", trailer.metaSize, curFileNum);
                 isValid = false;
             }
         }
 
-        if (isValid && trailer.dataSize != 0) {
-            // Copy event data to temporary file
-            int tempFd = open(tempFilePath, O_RDWR | O_CREAT | O_TRUNC);
-            if (tempFd != -1) {
-                size_t copyBufSize = 512;
-                uint8_t *copyBuf = new uint8_t[copyBufSize];
-                if (copyBuf) {
-                    lseek(fd, 0, SEEK_SET);
-
-                    for(size_t offset = 0; offset < trailer.dataSize; offset += copyBufSize) {
-                        size_t count = trailer.dataSize - offset;
-                        if (count > copyBufSize) {
-                            count = copyBufSize;
-                        }
-                        read(fd, copyBuf, count);
-                        int err = write(tempFd, copyBuf, count);
-                        if (err < 0) {
-                            _log.info("failed to write copy");
-                            isValid = false;            
-                            break;
-                        }
-                    }
+        // A transport that can read the data from storage sends it without loading it into curEvent,
+        // unless the sequence number has to be added to the structured data
+        bool streamed = transport->canSendFromStorage() &&
+            !(ext.sequence != 0 && contentType == (int)ContentType::STRUCTURED && sequenceKey.length() != 0);
 
-                    delete[] copyBuf;
-                }
-                else {
-                    _log.info("failed to allocate copy buffer");
-                    isValid = false;    
+        if (isValid) {
+            if (streamed) {
+                if (trailer.dataSize > stats.peakEventSize) {
+                    stats.peakEventSize = trailer.dataSize;
                 }
-                
-                close(tempFd);
+                curEventStreamed = true;
+                curEventStreamSize = trailer.dataSize;
             }
-            else {
-                _log.info("failed to open temp file %s", tempFilePath.c_str());
+            else
+            if (ramBudget != 0 && trailer.dataSize > ramBudget) {
+                // Saved before the budget was lowered. Loading it would put all of the data in curEvent.
+                _log.error("event size %u is over the RAM budget %u", (unsigned)trailer.dataSize, ramBudget);
+                stats.numTooLarge++;
                 isValid = false;
             }
-        }
-        
-        if (fd != -1) {
-            close(fd);
-            fd = -1;
-        }
-
-        if (isValid) {
+            else
             if (trailer.dataSize != 0) {
-                curEvent.loadData(tempFilePath.c_str());
+                updateEventStats(trailer.dataSize, storage->getLoadRamSize(trailer.dataSize));
+                isValid = storage->loadEventData(curFileNum, trailer.dataSize, curEvent);
             }
             else {
                 _log.trace("no data in event %d", curFileNum);
             }
         }
-
-        if (metaJson) {
-            delete[] metaJson;
-            metaJson = nullptr;
+        if (!streamed || !isValid) {
+            // A streamed record is closed after it's sent
+            storage->closeRecord(curFileNum);
         }
 
-
         if (isValid) {
-            curEvent.name(meta.get("name").asString().c_str());
-            if (meta.has("content-type")) {
-                curEvent.contentType((ContentType) meta.get("content-type").asInt());
-            }
+            curEvent.name(eventName);
+            curEvent.contentType((ContentType) contentType);
+            attachSequence(curEvent, ext.sequence);
         }
 
         if (!isValid || !curEvent.isValid()) {
             // Probably a corrupted file, discard
             _log.info("discarding corrupted file %d", curFileNum);
-            fileQueue.getFileFromQueue(true);
-            fileQueue.removeFileNum(curFileNum, false);
+            if (curEventStreamed) {
+                storage->closeRecord(curFileNum);
+            }
+            storage->remove(curFileNum);
             curFileNum = 0;
             return;
         }
 
-        _log.trace("read event %d from queue size=%d", curFileNum, curEvent.size());
+        _log.trace("read event %d from queue size=%d", curFileNum, curEventStreamed ? (int)curEventStreamSize : curEvent.size());
     }
 
     stateTime = millis();
 
-    if (!CloudEvent::canPublish(curEvent.size())) {
+    if (curEventStreamed && !transport->canSendFromStorage()) {
+        // The transport was changed while waiting to send, read the event again
+        storage->closeRecord(curFileNum);
+        curFileNum = 0;
+        return;
+    }
+
+    if (!transport->canSend(curEvent)) {
         // Can't publish yet (rate limited)
         // Stay in stateWaitEvent
         return;
@@ -404,31 +1368,112 @@ void PublishQueueExt::stateWaitEvent() {
     // This message is monitored by the automated test tool. If you edit this, change that too.
     _log.trace("publishing fileNum=%d event=%s", curFileNum, curEvent.name());
 
-    if (!Particle.publish(curEvent)) {
-        _log.error("published failed immediately, discarding");
-        deleteCurEvent();
-        stateHandler = &PublishQueueExt::stateWaitEvent;
-        durationMs = waitBetweenPublish;
+    sendTransport = transport;
+    bool sendResult;
+    if (curEventStreamed) {
+        sendResult = transport->sendFromStorage(curEvent, *storage, curFileNum, curEventStreamSize);
+        storage->closeRecord(curFileNum);
+    }
+    else {
+        sendResult = transport->send(curEvent);
+    }
+    if (!sendResult) {
+        if (transport->poll(curEvent) == PublishQueueExtTransport::Status::FAILED) {
+            _log.info("published failed immediately, retrying");
+            curFileNum = 0;
+            durationMs = waitAfterFailure;
+        }
+        else {
+            _log.error("published failed immediately, discarding");
+            deleteCurEvent();
+            durationMs = waitBetweenPublish;
+        }
+        stateHandler = &PublishQueueExtBase::stateWaitEvent;
+        waitingForEvent = true;
         return;
     }
 
-    stateHandler = &PublishQueueExt::statePublishWait;
+    stateHandler = &PublishQueueExtBase::statePublishWait;
+    waitingForEvent = false;
     canSleep = false;
+
+    if (!transport->isRateLimited()) {
+        // Local transports usually complete synchronously, so handle completion now instead
+        // of on the next loop to double the drain rate
+        statePublishWait();
+    }
+}
+
+int PublishQueueExtBase::selectNextEvent() {
+    int fileNum = storage->getFirstInQueue();
+
+    if (backlogEndFileNum != 0 && (fileNum == 0 || fileNum > backlogEndFileNum)) {
+        // Done sending the events queued before connecting
+        backlogEndFileNum = 0;
+    }
+
+    if (freshSharePercent != 0 && backlogEndFileNum != 0) {
+        freshCredit += freshSharePercent;
+        if (freshCredit >= 100) {
+            // Find the oldest event queued after connecting. These are at the end of the queue,
+            // so search from the end.
+            int freshFileNum = 0;
+            for(int ii = storage->getQueueLen() - 1; ii >= 0; ii--) {
+                int entryFileNum = storage->getQueueEntry(ii).fileNum;
+                if (entryFileNum <= backlogEndFileNum) {
+                    break;
+                }
+                freshFileNum = entryFileNum;
+            }
+
+            if (freshFileNum != 0) {
+                freshCredit -= 100;
+                fileNum = freshFileNum;
+            }
+            else {
+                // No new events; don't accumulate more than one
+                freshCredit = 100;
+            }
+        }
+    }
+
+    return fileNum;
+}
+
+unsigned long PublishQueueExtBase::getRampWait() const {
+    if (rampUpMs == 0) {
+        return 0;
+    }
+
+    long elapsed = (long)(millis() - connectedMs);
+    if (elapsed < 0) {
+        elapsed = 0;
+    }
+    if ((unsigned long)elapsed >= rampUpMs) {
+        return 0;
+    }
+    return rampInitialWaitMs - (unsigned long)((uint64_t)rampInitialWaitMs * (unsigned long)elapsed / rampUpMs);
 }
 
-void PublishQueueExt::deleteCurEvent() {
-    int fileNum = fileQueue.getFileFromQueue(false);
-    if (fileNum == curFileNum) {
-        fileQueue.getFileFromQueue(true);
-        fileQueue.removeFileNum(fileNum, false);
-        _log.trace("removed file %d", fileNum);
+void PublishQueueExtBase::deleteCurEvent() {
+    if (curEventDirect) {
+        // Not in the queue, but release the reserved file number (some backends allocate space in reserve())
+        storage->removeData(curFileNum);
+    }
+    else
+    if (storage->removeFromQueue(curFileNum)) {
+        // Usually the oldest event, but can be a newer event with withFreshEventShare()
+        storage->removeData(curFileNum);
+        _log.trace("removed file %d", curFileNum);
     }
     curFileNum = 0;
+    curEventDirect = false;
     curEvent.clear();
 }
 
-void PublishQueueExt::statePublishWait() {
-    if (curEvent.isSending()) {
+void PublishQueueExtBase::statePublishWait() {
+    PublishQueueExtTransport::Status status = sendTransport->poll(curEvent);
+    if (status == PublishQueueExtTransport::Status::SENDING) {
         // Stay in statePublishWait
         return;
     }
@@ -437,32 +1482,190 @@ void PublishQueueExt::statePublishWait() {
         publishCompleteUserCallback(curEvent);
     }
 
-    if (!curEvent.isValid()) {
+    // Transports that are not rate limited send the next event on the next loop
+    unsigned long waitAfterSuccess = sendTransport->isRateLimited() ? waitBetweenPublish : 0;
+
+    unsigned long rampWait = getRampWait();
+    if (rampWait > waitAfterSuccess) {
+        waitAfterSuccess = rampWait;
+    }
+
+    if (status == PublishQueueExtTransport::Status::INVALID) {
         _log.trace("publish failed invalid %d (discarding)", curFileNum);
         deleteCurEvent();
-        durationMs = waitBetweenPublish;
+        durationMs = waitAfterSuccess;
     }
     else
-    if (curEvent.isSent()) {
+    if (status == PublishQueueExtTransport::Status::SENT) {
         _log.trace("publish success %d", curFileNum);
         deleteCurEvent();
-        durationMs = waitBetweenPublish;
+        durationMs = waitAfterSuccess;
     }
     else {
         _log.trace("publish failed %d (retrying)", curFileNum);
+        if (curEventDirect) {
+            // Sent by direct publish, so it's not in the queue yet
+            saveCurEvent();
+            checkQueueLimits();
+        }
         curFileNum = 0;
         durationMs = waitAfterFailure;
     }
 
-    stateHandler = &PublishQueueExt::stateWaitEvent;
+    // If that was the last event, the hold ends now so an event published before the next
+    // loop() starts a new hold instead of being sent right away
+    checkHold();
+
+    stateHandler = &PublishQueueExtBase::stateWaitEvent;
+    waitingForEvent = true;
     stateTime = millis();
 }
 
 
-PublishQueueExt::PublishQueueExt() {
-    fileQueue.withDirPath("/usr/pubqueue2");
+// Skip JSON whitespace
+static const char *skipWhitespace(const char *cp) {
+    while(*cp == ' ' || *cp == '\t' || *cp == '\r' || *cp == '\n') {
+        cp++;
+    }
+    return cp;
+}
+
+// Parse a JSON string at cp, which must point to the opening double quote. On success, cp is
+// advanced past the closing quote. If out is nullptr the string is skipped. Returns false if the
+// string is not terminated or does not fit in out.
+static bool parseJsonString(const char *&cp, char *out, size_t outSize) {
+    if (*cp++ != '"') {
+        return false;
+    }
+    size_t len = 0;
+
+    while(*cp != '"') {
+        if (*cp == 0) {
+            return false;
+        }
+        uint32_t ch = (uint8_t) *cp++;
+        bool isUnicodeEscape = false;
+        if (ch == '\\') {
+            ch = (uint8_t) *cp++;
+            switch(ch) {
+                case 'b': ch = '\b'; break;
+                case 'f': ch = '\f'; break;
+                case 'n': ch = '\n'; break;
+                case 'r': ch = '\r'; break;
+                case 't': ch = '\t'; break;
+                case 'u': {
+                    char hex[5] = {0};
+                    for(size_t ii = 0; ii < 4; ii++) {
+                        if (*cp == 0) {
+                            return false;
+                        }
+                        hex[ii] = *cp++;
+                    }
+                    ch = (uint32_t) strtoul(hex, nullptr, 16);
+                    isUnicodeEscape = true;
+                    break;
+                }
+                case 0:
+                    return false;
+                default: // ", \, and / are used as-is
+                    break;
+            }
+        }
+        if (out) {
+            // Characters from \u escapes are stored as UTF-8; other bytes are copied as-is
+            uint8_t utf8[3];
+            size_t utf8Len = 0;
+            if (!isUnicodeEscape || ch < 0x80) {
+                utf8[utf8Len++] = (uint8_t) ch;
+            }
+            else
+            if (ch < 0x800) {
+                utf8[utf8Len++] = (uint8_t) (0xc0 | (ch >> 6));
+                utf8[utf8Len++] = (uint8_t) (0x80 | (ch & 0x3f));
+            }
+            else {
+                utf8[utf8Len++] = (uint8_t) (0xe0 | (ch >> 12));
+                utf8[utf8Len++] = (uint8_t) (0x80 | ((ch >> 6) & 0x3f));
+                utf8[utf8Len++] = (uint8_t) (0x80 | (ch & 0x3f));
+            }
+            if (len + utf8Len >= outSize) {
+                return false;
+            }
+            memcpy(&out[len], utf8, utf8Len);
+            len += utf8Len;
+        }
+    }
+    cp++;
+
+    if (out) {
+        out[len] = 0;
+    }
+    return true;
+}
+
+bool PublishQueueExtBase::parseMeta(const char *json, char *name, size_t nameSize, int &contentType) {
+    // The meta data is a flat object like {"name":"testEvent","content-type":0}. Key order
+    // and whitespace are not assumed, as older versions wrote it using Variant::toJSON().
+    bool hasName = false;
+    char key[32];
+
+    const char *cp = skipWhitespace(json);
+    if (*cp++ != '{') {
+        return false;
+    }
+
+    while(true) {
+        cp = skipWhitespace(cp);
+        if (*cp == '}') {
+            break;
+        }
+        if (*cp == ',') {
+            cp++;
+            continue;
+        }
+        if (!parseJsonString(cp, key, sizeof(key))) {
+            return false;
+        }
+        cp = skipWhitespace(cp);
+        if (*cp++ != ':') {
+            return false;
+        }
+        cp = skipWhitespace(cp);
+
+        if (strcmp(key, "name") == 0) {
+            if (!parseJsonString(cp, name, nameSize)) {
+                return false;
+            }
+            hasName = true;
+        }
+        else
+        if (*cp == '"') {
+            if (!parseJsonString(cp, nullptr, 0)) {
+                return false;
+            }
+        }
+        else {
+            // Number or literal
+            char *end;
+            long value = strtol(cp, &end, 10);
+            if (strcmp(key, "content-type") == 0 && end != cp) {
+                contentType = (int) value;
+            }
+            while(*end && *end != ',' && *end != '}') {
+                end++;
+            }
+            cp = end;
+        }
+    }
+    return hasName;
+}
+
+PublishQueueExtBase::PublishQueueExtBase(PublishQueueExtStorage &storage, char *metaBuf, size_t metaBufSize) :
+    storage(&storage), transport(&cloudTransport), sendTransport(&cloudTransport), metaBuf(metaBuf), metaBufSize(metaBufSize) {
+    // Created here instead of setup() so publish() is safe to call before setup()
+    os_mutex_recursive_create(&mutex);
 }
 
-PublishQueueExt::~PublishQueueExt() {
+PublishQueueExtBase::~PublishQueueExtBase() {
 
 }
@@ -10,17 +10,31 @@
 #error "This library requires Device OS 6.3.0 or later"
 #endif
 
+#ifndef PUBLISHQUEUEEXT_LOCK_STATS
+/**
+ * @brief Set to 1 to measure how long the queue lock is waited for and held
+ *
+ * The measurements are returned by PublishQueueExtBase::getLockStats(). This adds two calls to
+ * micros() to each lock and unlock, so it's off by default.
+ */
+#define PUBLISHQUEUEEXT_LOCK_STATS 0
+#endif
+
 
 #include "Particle.h"
-#include "SequentialFileRK.h" // https://github.com/rickkas7/SequentialFileRK
+#include "PublishQueueExtBatch.h"
+#include "PublishQueueExtStorage.h"
+#include "PublishQueueExtTransport.h"
 
 #include <deque>
 
 /**
  * @brief Class for asynchronous publishing of events
- * 
+ *
+ * This class contains the queue logic and state machine. It is not instantiated directly;
+ * use PublishQueueExt, or your own instantiation of PublishQueueExtT with different policies.
  */
-class PublishQueueExt {
+class PublishQueueExtBase {
 public:
     /**
      * @brief This structure is at the end of the publish queue file
@@ -29,18 +43,348 @@ public:
         uint32_t magic; //!< kQueueFileTrailerMagic
         uint32_t dataSize; //!< size of the event data at the beginning of the file
         uint16_t metaSize; //!< size of the JSON meta data (not null terminated)
-        uint16_t reserved; //!< not used, set to 0
+        uint16_t extSize; //!< size of the QueueFileTrailerExt before this structure, 0 in files from versions before 0.1.0
+    };
+
+    /**
+     * @brief This structure is between the JSON meta data and the QueueFileTrailer
+     * 
+     * Fields are only added to the end of this structure. When reading, extSize in the
+     * trailer determines how many bytes are present; missing fields are 0.
+     */
+    struct QueueFileTrailerExt { // 20 bytes
+        uint32_t timestamp; //!< Time.now() when the event was queued, or 0 if the time was not valid
+        uint16_t contentType; //!< ContentType of the event data
+        uint16_t nameId; //!< ID from registerEventName(), or 0 if the name is stored in the JSON meta data
+        uint32_t expires; //!< Time.now() value after which the event is discarded, or 0 if it does not expire
+        uint32_t crc; //!< crc32() of the event data, JSON meta data, and the other fields of this structure
+        uint32_t sequence; //!< Sequence number from withSequenceNumbers(), or 0 if not used
     };
 
     static const uint32_t kQueueFileTrailerMagic = 0x55fcab58; //!< Magic bytes stored in the QueueFileTrailer structure
 
+    static const size_t kExtCrcOffset = offsetof(QueueFileTrailerExt, crc); //!< Offset of the crc field in QueueFileTrailerExt
+    static const size_t kExtCrcEnd = kExtCrcOffset + sizeof(uint32_t); //!< Offset after the crc field in QueueFileTrailerExt
+
+    static const size_t kMaxEventNameLen = 64; //!< Maximum length of an event name, not including the null terminator
+
     /**
-     * @brief Gets the singleton instance of this class
+     * @brief Result of publishWithStatus() and tryPublish()
      * 
-     * You cannot construct a PublishQueueExt object as a global variable,
-     * stack variable, or with new. You can only request the singleton instance.
+     * Values >= 0 indicate success. Use isSuccess() to test.
+     */
+    enum class PublishStatus : int {
+        QUEUED = 0, //!< The event was saved to the queue
+        SENT = 1, //!< The event was passed to Particle.publish() by direct publish; it will be queued if it fails
+        QUEUED_DISCARDED = 2, //!< The event was saved, but one or more queued events were discarded to make room
+        QUEUE_FULL = -1, //!< The event was not queued because the queue is full (tryPublish(), or the file queue size is 1)
+        INVALID_EVENT = -2, //!< The event was not queued because the event name is empty or too long
+        STORAGE_ERROR = -3, //!< The event was not queued because it could not be saved to storage
+        TOO_LARGE = -4 //!< The event was not queued because its data is larger than the RAM budget
+    };
+
+    /**
+     * @brief Returns true if a PublishStatus indicates the event was accepted
+     */
+    static bool isSuccess(PublishStatus status) { return (int)status >= 0; };
+
+    /**
+     * @brief Calculate a CRC-32 (IEEE 802.3, the same as zlib)
+     * 
+     * @param buf Data to calculate the CRC of
+     * @param len Number of bytes in buf
+     * @param crc Result of the previous call to continue a calculation, or 0 to start a new one
+     * @return The CRC-32 value
+     */
+    static uint32_t crc32(const void *buf, size_t len, uint32_t crc = 0);
+
+    /**
+     * @brief Statistics returned by getStats()
+     */
+    struct Stats {
+        size_t peakEventSize = 0; //!< Largest event data size published or read from the queue, in bytes
+        size_t peakEventRam = 0; //!< Largest RAM used for one event: the data in the CloudEvent plus the storage backend's temporary buffer, in bytes
+        size_t numTooLarge = 0; //!< Number of events refused with PublishStatus::TOO_LARGE or discarded from the queue because they were over the RAM budget
+    };
+
+    /**
+     * @brief Queue lock statistics returned by getLockStats()
+     *
+     * Times are in microseconds. Only the outermost lock of a nested (recursive) lock is counted.
+     * These are only collected when PUBLISHQUEUEEXT_LOCK_STATS is defined as 1; otherwise all of
+     * the values are 0.
+     */
+    struct LockStats {
+        uint32_t numLocks = 0; //!< Number of times the lock was acquired
+        uint32_t numContended = 0; //!< Number of times lock() had to wait because another thread held the lock
+        uint64_t totalWaitUs = 0; //!< Total time spent waiting in lock()
+        uint32_t maxWaitUs = 0; //!< Longest time spent waiting in lock()
+        uint64_t totalHoldUs = 0; //!< Total time the lock was held
+        uint32_t maxHoldUs = 0; //!< Longest time the lock was held
+    };
+
+    static const size_t kMaxEventNames = 64; //!< Maximum number of event names that can be registered using registerEventName()
+
+    static constexpr const char *kEventNamesAuxName = "names"; //!< Name of the storage aux blob for the event name dictionary
+
+    static constexpr const char *kSequenceAuxName = "seq"; //!< Name of the storage aux blob for the reserved sequence number block
+
+    static const uint32_t kSequenceBlockSize = 256; //!< Number of sequence numbers reserved with each write to storage
+
+    static const size_t kMaxSequenceSuffixLen = 11; //!< Length of the "/" and up to 10 digits added to the event name for the sequence number
+
+    /**
+     * @brief Handle for an event name returned by registerEventName()
      */
-    static PublishQueueExt &instance();
+    struct EventNameHandle {
+        /**
+         * @brief Constructor
+         * 
+         * @param id The name ID, or 0 for an invalid handle
+         */
+        explicit EventNameHandle(uint16_t id = 0) : id(id) {};
+
+        /**
+         * @brief Returns true if this is a valid handle
+         */
+        bool isValid() const { return id != 0; };
+
+        /**
+         * @brief Compare handles
+         */
+        bool operator==(const EventNameHandle &other) const { return id == other.id; };
+
+        uint16_t id; //!< Name ID, 1 or larger, or 0 if not valid
+    };
+
+    /**
+     * @brief Options for an event, passed to the publish overloads that take an EventOptions
+     * 
+     * This uses the fluent style, for example:
+     * 
+     * PublishQueueExt::instance().publish(event, PublishQueueExtBase::EventOptions().withTtl(3600));
+     */
+    class EventOptions {
+    public:
+        /**
+         * @brief Default options
+         */
+        EventOptions() : ttl(0), nameId(0), urgent(false), sequence(0) {};
+
+        /**
+         * @brief Sets the time-to-live for the event in seconds (default: 0, does not expire)
+         * 
+         * @param seconds Number of seconds after queueing after which the event is discarded instead of sent
+         * 
+         * The expiration time is based on the real-time clock. If the time is not valid when the event
+         * is published, the event does not expire.
+         */
+        EventOptions &withTtl(uint32_t seconds) { ttl = seconds; return *this; };
+
+        /**
+         * @brief Gets the time-to-live in seconds, or 0 if the event does not expire
+         */
+        uint32_t getTtl() const { return ttl; };
+
+        /**
+         * @brief Marks the event as urgent (default: false)
+         * 
+         * @param value true if the event should not be held
+         * 
+         * When a hold is set using withHold(), an urgent event ends the hold so it's sent right away,
+         * along with any events queued before it.
+         */
+        EventOptions &withUrgent(bool value = true) { urgent = value; return *this; };
+
+        /**
+         * @brief Returns true if the event is urgent
+         */
+        bool isUrgent() const { return urgent; };
+
+    protected:
+        uint32_t ttl; //!< Time-to-live in seconds, 0 = does not expire
+        uint16_t nameId; //!< Registered name ID, set internally
+        bool urgent; //!< Send without waiting for the hold
+        uint32_t sequence; //!< Sequence number, set internally
+
+        friend class PublishQueueExtBase;
+    };
+
+    /**
+     * @brief Information about a queued event, used with events() and removeIf()
+     * 
+     * The size, content type, and timestamp come from the queue index and do not require
+     * reading the event data. getName() reads only the meta data for the event.
+     */
+    class EventInfo {
+    public:
+        /**
+         * @brief Gets the file number of the event in the queue
+         */
+        int getFileNum() const { return entry.fileNum; };
+
+        /**
+         * @brief Returns false if the queue file is corrupted. It will be discarded when it's sent.
+         */
+        bool isValid() const { return (entry.flags & PublishQueueExtIndexEntry::kFlagInvalid) == 0; };
+
+        /**
+         * @brief Returns true if this event is currently being sent
+         */
+        bool isInFlight() const;
+
+        /**
+         * @brief Gets the size of the event data in bytes
+         */
+        size_t getSize() const { return entry.dataSize; };
+
+        /**
+         * @brief Gets the content type of the event data
+         */
+        ContentType getContentType() const { return (ContentType) entry.contentType; };
+
+        /**
+         * @brief Gets the time the event was queued (Unix time, UTC), or 0 if not known
+         * 
+         * The time is not known if the event was queued before the time was synchronized
+         * or by a version earlier than 0.1.0.
+         */
+        time_t getTimestamp() const { return (time_t) entry.timestamp; };
+
+        /**
+         * @brief Gets how long ago the event was queued in seconds, or -1 if not known
+         */
+        long getAge() const;
+
+        /**
+         * @brief Gets the time the event expires (Unix time, UTC), or 0 if it does not expire
+         */
+        time_t getExpires() const { return (time_t) entry.expires; };
+
+        /**
+         * @brief Gets the handle of the registered event name, or an invalid handle if the name was not registered
+         * 
+         * Comparing handles is faster than comparing names with getName(), as it does not access storage.
+         */
+        EventNameHandle getNameHandle() const { return EventNameHandle(entry.nameId); };
+
+        /**
+         * @brief Gets the sequence number of the event, or 0 if it does not have one
+         */
+        uint32_t getSequence() const { return entry.sequence; };
+
+        /**
+         * @brief Returns true if the event has expired and will be discarded instead of sent
+         */
+        bool isExpired() const { return queue->isExpired(entry); };
+
+        /**
+         * @brief Gets the event name
+         * 
+         * @param buf Buffer to store the name in. kMaxEventNameLen + 1 bytes is always large enough.
+         * @param bufSize Size of buf in bytes
+         * @return true if the name was read or false on error
+         * 
+         * This reads the meta data from storage, but not the event data.
+         */
+        bool getName(char *buf, size_t bufSize) const;
+
+    protected:
+        /**
+         * @brief Constructor, used by EventRange and removeIf()
+         */
+        EventInfo(PublishQueueExtBase &queue, const PublishQueueExtIndexEntry &entry) : queue(&queue), entry(entry) {};
+
+        PublishQueueExtBase *queue; //!< Queue object this event is in
+        PublishQueueExtIndexEntry entry; //!< Copy of the queue index entry
+
+        friend class PublishQueueExtBase;
+    };
+
+    /**
+     * @brief Range of queued events, returned by events()
+     * 
+     * The queue is locked while this object exists, so keep it only for the duration of a loop.
+     */
+    class EventRange {
+    public:
+        /**
+         * @brief Read-only forward iterator over queued events, oldest first
+         */
+        class Iterator {
+        public:
+            /**
+             * @brief Gets information about the event at this position
+             */
+            EventInfo operator*() const { return queue->getEventInfo(index); };
+
+            /**
+             * @brief Advance to the next event
+             */
+            Iterator &operator++() { index++; return *this; };
+
+            /**
+             * @brief Compare iterators
+             */
+            bool operator!=(const Iterator &other) const { return index != other.index; };
+
+            /**
+             * @brief Compare iterators
+             */
+            bool operator==(const Iterator &other) const { return index == other.index; };
+
+        protected:
+            /**
+             * @brief Constructor, used by EventRange
+             */
+            Iterator(PublishQueueExtBase *queue, size_t index) : queue(queue), index(index) {};
+
+            PublishQueueExtBase *queue; //!< Queue object being iterated
+            size_t index; //!< Index into the queue, 0 = oldest
+
+            friend class EventRange;
+        };
+
+        /**
+         * @brief Move constructor. The lock is transferred to the new object.
+         */
+        EventRange(EventRange &&other) : queue(other.queue) { other.queue = nullptr; };
+
+        /**
+         * @brief Destructor. Unlocks the queue.
+         */
+        ~EventRange() { if (queue) { queue->unlock(); } };
+
+        /**
+         * @brief This class is not copyable
+         */
+        EventRange(const EventRange&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        EventRange& operator=(const EventRange&) = delete;
+
+        /**
+         * @brief Iterator at the oldest event
+         */
+        Iterator begin() const { return Iterator(queue, 0); };
+
+        /**
+         * @brief Iterator past the newest event
+         */
+        Iterator end() const { return Iterator(queue, queue ? (size_t)queue->storage->getQueueLen() : 0); };
+
+    protected:
+        /**
+         * @brief Constructor, used by events(). Locks the queue.
+         */
+        EventRange(PublishQueueExtBase &queue) : queue(&queue) { queue.lock(); };
+
+        PublishQueueExtBase *queue; //!< Queue object, or nullptr if moved from
+
+        friend class PublishQueueExtBase;
+    };
 
     /**
      * @brief Sets the file-based queue size (default is 100)
@@ -49,7 +393,7 @@ public:
      * 
      * If you exceed this number of events, the oldest event is discarded.
      */
-    PublishQueueExt &withFileQueueSize(size_t size);
+    PublishQueueExtBase &withFileQueueSize(size_t size);
 
     /**
      * @brief Gets the file queue size
@@ -70,20 +414,198 @@ public:
      * 
      * You must call this as you cannot use the root directory as a queue!
      */
-    PublishQueueExt &withDirPath(const char *dirPath) { fileQueue.withDirPath(dirPath); return *this; };
+    PublishQueueExtBase &withDirPath(const char *dirPath) { storage->withDirPath(dirPath); return *this; };
 
     /**
      * @brief Gets the directory path set using withDirPath()
      * 
      * The returned path will not end with a slash.
      */
-    const char *getDirPath() const { return fileQueue.getDirPath(); };
+    const char *getDirPath() const { return storage->getDirPath(); };
+
+    /**
+     * @brief Sets the storage backend, replacing the StoragePolicy object
+     * 
+     * @param storage The storage backend object. It must remain valid for the life of the queue,
+     * so it's typically a global variable.
+     * 
+     * This must be called before setup() and before withDirPath(). The backend object is not
+     * deleted by this class.
+     * 
+     * The StoragePolicy object of the PublishQueueExtT instantiation is not used after this, but
+     * it still takes space in the queue object. If the backend is known at compile time, use it as the
+     * StoragePolicy instead, for example PublishQueueExtT<PublishQueueExtStorageRam>.
+     * 
+     * Backends provided:
+     * - PublishQueueExtStoragePosix: POSIX flash file system, one file per event (default)
+     * - PublishQueueExtStorageRam: RAM only, events are lost on reset
+     * - PublishQueueExtStorageMmap: memory mapped file, Linux host builds only
+     */
+    PublishQueueExtBase &withStorage(PublishQueueExtStorage &storage) { this->storage = &storage; return *this; };
+
+    /**
+     * @brief Gets the storage backend
+     */
+    PublishQueueExtStorage &getStorage() { return *storage; };
+
+    /**
+     * @brief Sets the transport used to send events (default: Particle cloud)
+     * 
+     * @param transport The transport object. It must remain valid for the life of the queue,
+     * so it's typically a global variable.
+     * 
+     * This can be changed at any time, for example to drain the queue over a local link when a
+     * service tool is connected. An event that is already being sent completes using the
+     * transport it was sent with.
+     * 
+     * Transports provided:
+     * - PublishQueueExtTransportCloud: Particle.publish() (default)
+     * - PublishQueueExtTransportFramed: framed events written to a Print object or file descriptor
+     */
+    PublishQueueExtBase &withTransport(PublishQueueExtTransport &transport) { WITH_LOCK(*this) { this->transport = &transport; } return *this; };
+
+    /**
+     * @brief Use the default Particle cloud transport
+     */
+    PublishQueueExtBase &withCloudTransport() { return withTransport(cloudTransport); };
+
+    /**
+     * @brief Gets the transport used to send events
+     */
+    PublishQueueExtTransport &getTransport() { return *transport; };
+
+    /**
+     * @brief Enables sending events directly, without writing them to storage first (default: false)
+     * 
+     * @param value true to enable direct publish
+     * 
+     * When enabled, if the cloud is connected, the queue is empty, no publish is in progress,
+     * and CloudEvent::canPublish() allows it, publish() passes the event to Particle.publish()
+     * (or the send() method of the transport set using withTransport())
+     * immediately. The event is only written to the queue if the publish fails, in which
+     * case it keeps its place in the queue ahead of events published after it.
+     */
+    PublishQueueExtBase &withDirectPublish(bool value = true) { directPublish = value; return *this; };
+
+    /**
+     * @brief Gets the direct publish setting
+     */
+    bool getDirectPublish() const { return directPublish; };
+
+    /**
+     * @brief Sets the high watermark (default: 0 for both, disabled)
+     * 
+     * @param count Number of queued events at or above which the queue is above the high watermark, or 0 to not use the count
+     * @param bytes Number of bytes of queued event data at or above which the queue is above the high watermark, or 0 to not use bytes
+     * 
+     * When the queue goes above the high watermark, the watermark callback is called with true. It is
+     * not called again until the queue drops to or below the low watermark.
+     */
+    PublishQueueExtBase &withHighWatermark(size_t count, size_t bytes = 0) { highWatermarkCount = count; highWatermarkBytes = bytes; return *this; };
+
+    /**
+     * @brief Sets the low watermark (default: 0 for both)
+     * 
+     * @param count Number of queued events
+     * @param bytes Number of bytes of queued event data
+     * 
+     * After going above the high watermark, the queue is below the low watermark again when both
+     * the count and bytes are less than or equal to these values.
+     */
+    PublishQueueExtBase &withLowWatermark(size_t count, size_t bytes = 0) { lowWatermarkCount = count; lowWatermarkBytes = bytes; return *this; };
+
+    /**
+     * @brief Sets a function to call when the queue goes above the high watermark or below the low watermark
+     * 
+     * @param cb Callback function or C++ lambda with the prototype void callback(bool aboveHigh)
+     * 
+     * aboveHigh is true when crossing the high watermark and false when dropping to the low watermark.
+     * The callback is called with the queue locked, either from publish() or from loop(). Do not
+     * perform lengthy operations in the callback.
+     */
+    PublishQueueExtBase &withWatermarkCallback(std::function<void(bool aboveHigh)> cb) { watermarkCallback = cb; return *this; };
+
+    /**
+     * @brief Returns true if the queue has gone above the high watermark and not yet dropped to the low watermark
+     */
+    bool isAboveHighWatermark() const { return aboveHighWatermark; };
+
+    /**
+     * @brief Sets the maximum number of bytes of data in one event (default: 0, no limit)
+     * 
+     * @param bytes Maximum number of bytes, or 0 for no limit
+     * 
+     * The whole event data is held in a CloudEvent while an event is published and while it's sent,
+     * so this limits the RAM used for one event. Publishing an event with more data than this fails
+     * with PublishStatus::TOO_LARGE on all storage backends. Events already in the queue with more
+     * data than this, for example saved before the budget was lowered, are discarded without being
+     * loaded. The storage backend may use a temporary buffer in addition to the CloudEvent; see
+     * getStats().
+     */
+    PublishQueueExtBase &withRamBudget(size_t bytes) { ramBudget = bytes; return *this; };
+
+    /**
+     * @brief Gets the RAM budget in bytes, or 0 for no limit
+     */
+    size_t getRamBudget() const { return ramBudget; };
+
+    /**
+     * @brief Gets a copy of the statistics
+     */
+    Stats getStats();
+
+    /**
+     * @brief Resets the statistics to 0
+     */
+    void clearStats();
+
+    /**
+     * @brief Gets a copy of the queue lock statistics
+     *
+     * Requires PUBLISHQUEUEEXT_LOCK_STATS to be defined as 1, otherwise all of the values are 0.
+     */
+    LockStats getLockStats();
+
+    /**
+     * @brief Resets the queue lock statistics to 0
+     */
+    void clearLockStats();
+
+    /**
+     * @brief Holds queued events and sends them in bursts (default: 0, disabled)
+     * 
+     * @param maxHoldMs Maximum time in milliseconds to hold the first queued event, or 0 to disable holding
+     * @param count Number of queued events at which the held events are sent, or 0 to not use the count
+     * @param bytes Number of bytes of queued event data at which the held events are sent, or 0 to not use bytes
+     * 
+     * Instead of sending each event as soon as it's published, events are held in the queue until
+     * the count or bytes is reached, maxHoldMs has passed since the first event was queued, or an
+     * event with EventOptions::withUrgent() is published. Then all queued events are sent, including
+     * events published while they are being sent, until the queue is empty. This groups radio activity
+     * into bursts.
+     * 
+     * While events are held, getCanSleep() returns true. Use getHoldTimeRemaining() to determine how
+     * long to sleep for.
+     */
+    PublishQueueExtBase &withHold(unsigned long maxHoldMs, size_t count = 0, size_t bytes = 0) { holdMaxMs = maxHoldMs; holdCount = count; holdBytes = bytes; return *this; };
+
+    /**
+     * @brief Returns true if there are queued events that are being held
+     */
+    bool isHolding() const { return holdMaxMs != 0 && holdStarted && !holdReleased; };
+
+    /**
+     * @brief Gets the number of milliseconds until the held events are sent
+     * 
+     * @return Milliseconds until maxHoldMs passes, or 0 if events are not being held
+     */
+    unsigned long getHoldTimeRemaining() const;
 
     /**
      * @brief Adds a callback function to call with publish is complete
      * 
      * @param cb Callback function or C++ lambda.
-     * @return PublishQueueExt& 
+     * @return PublishQueueExtBase& 
      * 
      * The callback has this prototype and can be a function or a C++11 lambda, which allows the callback to be a class method.
      * 
@@ -94,11 +616,14 @@ public:
      * 
      * You can determine success/failure, examine the event. or the event data, by using methods of the CloudEvent class
      * 
+     * If the transport reads the data from storage (PublishQueueExtTransport::canSendFromStorage(), such as
+     * PublishQueueExtTransportFramed), events sent from the queue do not have data in the CloudEvent.
+     * 
      * Note that this callback will be called from the background thread used for publishing. You should not
      * perform any lengthy operations and you should avoid using large amounts of stack space during this
      * callback. 
      */
-    PublishQueueExt &withPublishCompleteUserCallback(std::function<void(const CloudEvent &event)> cb) { publishCompleteUserCallback = cb; return *this; };
+    PublishQueueExtBase &withPublishCompleteUserCallback(std::function<void(const CloudEvent &event)> cb) { publishCompleteUserCallback = cb; return *this; };
 
 
     /**
@@ -118,12 +643,45 @@ public:
      * @return true 
      * @return false 
      */
-    bool publish(CloudEvent event);
+    bool publish(const CloudEvent &event);
+
+    /**
+     * @brief Publish an event with options
+     * 
+     * @param event The event to publish
+     * @param options Options such as the time-to-live
+     * @return true if the event was queued or false if it was not.
+     */
+    bool publish(const CloudEvent &event, const EventOptions &options);
+
+    /**
+     * @brief Publish an event and return a detailed status
+     * 
+     * @param event The event to publish
+     * @param options Options such as the time-to-live
+     * @return A PublishStatus value. The event was accepted if isSuccess() returns true for it.
+     * 
+     * This is the same as publish(), except you can tell whether queued events were discarded to
+     * make room for this event, and why an event was not queued.
+     */
+    PublishStatus publishWithStatus(const CloudEvent &event, const EventOptions &options = EventOptions());
+
+    /**
+     * @brief Publish an event only if there is room in the queue
+     * 
+     * @param event The event to publish
+     * @param options Options such as the time-to-live
+     * @return A PublishStatus value. PublishStatus::QUEUE_FULL if the queue is full.
+     * 
+     * Unlike publish(), this never discards queued events. If the queue is full, the event is
+     * refused, so the caller can retry later, reduce its data rate, or discard the event itself.
+     */
+    PublishStatus tryPublish(const CloudEvent &event, const EventOptions &options = EventOptions());
 
 	/**
 	 * @brief Overload for publishing an event
 	 *
-	 * @param eventName The name of the event (63 character maximum).
+	 * @param eventName The name of the event (64 character maximum, kMaxEventNameLen).
 	 *
 	 * @return true if the event was queued or false if it was not.
 	 *
@@ -135,7 +693,7 @@ public:
 	/**
 	 * @brief Overload for publishing an event
 	 *
-	 * @param eventName The name of the event (63 character maximum).
+	 * @param eventName The name of the event (64 character maximum, kMaxEventNameLen).
 	 *
 	 * @param data The UTF-8 text event data as a c-string.  It is copied by this method.
 	 *
@@ -149,7 +707,7 @@ public:
 	/**
 	 * @brief Overload for publishing an event from a Variant
 	 *
-	 * @param eventName The name of the event (63 character maximum).
+	 * @param eventName The name of the event (64 character maximum, kMaxEventNameLen).
 	 *
 	 * @param data Reference to a Variant object holding the data. It is copied by this method.
 	 *
@@ -167,7 +725,7 @@ public:
 	/**
 	 * @brief Overload for publishing an event with a Variant and ContentType
 	 *
-	 * @param eventName The name of the event (63 character maximum).
+	 * @param eventName The name of the event (64 character maximum, kMaxEventNameLen).
 	 *
 	 * @param data Reference to a Variant object holding the data. It is copied by this method.
      * 
@@ -187,6 +745,69 @@ public:
 	 */
     bool publish(const char *eventName, const Variant &data, ContentType type);
 
+	/**
+	 * @brief Overload for publishing an event with a Variant, ContentType, and options
+	 *
+	 * @param eventName The name of the event (64 character maximum, kMaxEventNameLen).
+	 *
+	 * @param data Reference to a Variant object holding the data. It is copied by this method.
+     * 
+     * @param type The ContentType of the data
+     * 
+     * @param options Options such as the time-to-live
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+    bool publish(const char *eventName, const Variant &data, ContentType type, const EventOptions &options);
+
+
+    /**
+     * @brief Register an event name so it's stored as a small ID instead of a string in each queued event
+     * 
+     * @param name The event name (64 character maximum, kMaxEventNameLen)
+     * @return A handle for the name. Use isValid() to check for errors.
+     * 
+     * The names are saved in the queue directory, so queued events can be sent after a reset. 
+     * Registering the same name again returns the same handle. Once registered, publishing with
+     * this name as a string also uses the ID. Must be called after setup(). Up to kMaxEventNames
+     * names can be registered; names are not removed until the queue directory is deleted.
+     */
+    EventNameHandle registerEventName(const char *name);
+
+    /**
+     * @brief Gets the handle for a registered event name
+     * 
+     * @param name The event name
+     * @return The handle, or an invalid handle if the name has not been registered
+     */
+    EventNameHandle findEventName(const char *name) const;
+
+    /**
+     * @brief Gets the event name for a handle
+     * 
+     * @return The event name, or nullptr if the handle is not valid
+     */
+    const char *getEventName(EventNameHandle handle) const;
+
+    /**
+     * @brief Publish an event using a registered event name
+     * 
+     * @param name Handle returned by registerEventName()
+     * @param data The UTF-8 text event data as a c-string. It is copied by this method.
+     * @return true if the event was queued or false if it was not.
+     */
+    bool publish(EventNameHandle name, const char *data);
+
+    /**
+     * @brief Publish an event using a registered event name with a Variant, ContentType, and options
+     * 
+     * @param name Handle returned by registerEventName()
+     * @param data Reference to a Variant object holding the data. It is copied by this method.
+     * @param type The ContentType of the data
+     * @param options Options such as the time-to-live
+     * @return true if the event was queued or false if it was not.
+     */
+    bool publish(EventNameHandle name, const Variant &data, ContentType type, const EventOptions &options);
 
     /**
      * @brief Empty the file based queue. Any queued events are discarded and the files deleted.
@@ -214,7 +835,8 @@ public:
     /**
      * @brief Determine if it's a good time to go to sleep
      * 
-     * If a publish is not in progress and the queue is empty, returns true. 
+     * If a publish is not in progress and the queue is empty, returns true. Also returns true
+     * if the queued events are being held (see withHold()).
      * 
      * If pausePublishing is true, then return true if either the current publish has
      * completed, or not cloud connected.
@@ -231,10 +853,181 @@ public:
      */
     size_t getNumEvents();
 
+    /**
+     * @brief Iterate the queued events, oldest first
+     * 
+     * For example:
+     * 
+     * for(const auto &info : PublishQueueExt::instance().events()) {
+     *     Log.info("fileNum=%d size=%u age=%ld", info.getFileNum(), info.getSize(), info.getAge());
+     * }
+     * 
+     * The queue is locked until the loop completes. Do not publish or remove events inside
+     * the loop; use removeIf() to remove events. Must be called after setup().
+     */
+    EventRange events() { return EventRange(*this); };
+
+    /**
+     * @brief Remove all queued events for which a predicate returns true
+     * 
+     * @param pred Function or lambda called for each queued event, oldest first. Return true to remove it.
+     * @return The number of events removed
+     * 
+     * The predicate has this prototype:
+     * 
+     * bool pred(const PublishQueueExtBase::EventInfo &info)
+     * 
+     * The event currently being sent is not passed to the predicate and is never removed.
+     * Events are removed in a single pass without reading their event data.
+     */
+    size_t removeIf(std::function<bool(const EventInfo &info)> pred);
+
+    /**
+     * @brief Gets the total size of the event data for all queued events in bytes
+     * 
+     * The sizes are kept in RAM once the events have been accessed, but after a reset
+     * the first call reads the trailer of each queued event.
+     */
+    size_t getQueueBytes();
+
     /**
      * @brief Check the queue limit, discarding events as necessary
+     * 
+     * @return The number of events discarded
+     */
+    size_t checkQueueLimits();
+
+    /**
+     * @brief Discard all queued events that have expired
+     * 
+     * @return The number of events discarded
+     * 
+     * Expired events are also discarded when they reach the front of the queue and when the
+     * queue is over its limit, so you normally don't need to call this.
      */
-    void checkQueueLimits();
+    size_t removeExpired();
+
+    /**
+     * @brief Discard all queued events whose CRC or trailer is not valid
+     * 
+     * @return The number of events discarded
+     * 
+     * This reads every queued event, so it may take a while with a large queue. setup() calls
+     * this if withFullRecoveryScan() is enabled; otherwise setup() only checks the newest event,
+     * which is the one that could have been partially written if the device reset during publish().
+     * Corrupted events are also discarded when they reach the front of the queue.
+     */
+    size_t removeCorrupted();
+
+    /**
+     * @brief Check every queued event in setup() instead of only the newest (default: false)
+     * 
+     * @param value true to check every queued event
+     */
+    PublishQueueExtBase &withFullRecoveryScan(bool value = true) { fullRecoveryScan = value; return *this; };
+
+    /**
+     * @brief Adds a random delay after connecting before publishing starts (default: 0)
+     * 
+     * @param maxRandomMs Maximum random delay in milliseconds, added to the wait after connecting
+     * 
+     * When many devices lose connectivity at the same time, such as during a cellular outage, they
+     * all reconnect at about the same time. A random delay spreads out the queued events they send.
+     */
+    PublishQueueExtBase &withReconnectDelay(unsigned long maxRandomMs) { reconnectRandomMs = maxRandomMs; return *this; };
+
+    /**
+     * @brief Sends more slowly for a period after connecting (default: 0, disabled)
+     * 
+     * @param rampMs Period after publishing starts in milliseconds over which the wait decreases, or 0 to disable
+     * @param initialWaitMs Wait between publishes in milliseconds at the start of the period
+     * 
+     * The wait between publishes decreases linearly from initialWaitMs to the normal wait over rampMs.
+     */
+    PublishQueueExtBase &withReconnectRampUp(unsigned long rampMs, unsigned long initialWaitMs) { rampUpMs = rampMs; rampInitialWaitMs = initialWaitMs; return *this; };
+
+    /**
+     * @brief Sends events queued after connecting ahead of older queued events (default: 0, disabled)
+     * 
+     * @param percent Percentage of publishes, 0 - 100, used for events queued after connecting while
+     * events queued before connecting are still being sent
+     * 
+     * Without this, new events are sent after all of the events that were queued while disconnected,
+     * which can take a long time. With this, some new events are sent before older events, so events
+     * are no longer sent strictly in order while catching up.
+     */
+    PublishQueueExtBase &withFreshEventShare(unsigned int percent) { freshSharePercent = (percent < 100) ? percent : 100; return *this; };
+
+    /**
+     * @brief Combines queued structured events into columnar blocks (default: 0, disabled)
+     * 
+     * @param maxRows Maximum number of events in a block, or 0 to disable batching
+     * @param maxBytes Maximum size of a block in bytes
+     * 
+     * When enabled, each event with ContentType::STRUCTURED data that PublishQueueExtBatch::isBatchable()
+     * accepts is encoded as a PublishQueueExtBatch block and sent as ContentType::BINARY. If the newest
+     * queued event is a block with the same event name and keys that is not being sent, the event is
+     * added to that block instead of being queued separately. Events with a time-to-live are not batched.
+     * 
+     * Blocks only grow while events are waiting in the queue, so this is most effective with withHold().
+     * Adding an event reads the queued block and writes a new block with one more row, so filling a
+     * block of maxRows rows writes about maxRows * maxRows / 2 rows to storage in total. Keep maxRows
+     * small, such as 10 to 20.
+     * 
+     * With withSequenceNumbers(), the sequence number of each event is stored in the block as a column
+     * named by withSequenceKey(). If the sequence key is empty, events are not batched.
+     * 
+     * A buffer of 2 * maxBytes is allocated here, not for each event. The block format is described
+     * in the README.
+     */
+    PublishQueueExtBase &withBatching(size_t maxRows, size_t maxBytes = 1024);
+
+    /**
+     * @brief Assigns a sequence number to each published event (default: false)
+     * 
+     * @param value true to assign sequence numbers
+     * 
+     * Sequence numbers increase by 1 for each event, including across resets, and are stored with
+     * the queued event so an event that is sent more than once (because the device reset or the
+     * publish was retried) always has the same number. There may be gaps, for example after a reset,
+     * so don't use them to detect lost events. Events are not always sent in sequence order, for
+     * example with withFreshEventShare() or after a failed publish, so see the README for how to
+     * discard duplicates.
+     * 
+     * To avoid a flash write for every event, blocks of kSequenceBlockSize numbers are reserved
+     * in storage; after a reset, numbering continues from the end of the last reserved block.
+     * This requires persistent storage. If the storage backend is not persistent (RAM), setup()
+     * logs an error and sequence numbers are not used.
+     * 
+     * The number is sent in structured event data; see withSequenceKey() and withSequenceNameSuffix().
+     * If the block can't be saved to storage, publish() fails with PublishStatus::STORAGE_ERROR
+     * instead of assigning numbers that could be assigned again after a reset.
+     */
+    PublishQueueExtBase &withSequenceNumbers(bool value = true) { sequenceNumbers = value; return *this; };
+
+    /**
+     * @brief Sets the key used to add the sequence number to structured event data (default: "seq")
+     * 
+     * @param key The key, or an empty string to not send sequence numbers
+     * 
+     * The sequence number is added when the event is sent. For events with ContentType::STRUCTURED
+     * data, it's added to the top-level map using this key. Other content types only get the number
+     * with withSequenceNameSuffix(). If the key is empty, the sequence number is only available from events().
+     */
+    PublishQueueExtBase &withSequenceKey(const char *key) { sequenceKey = key; return *this; };
+
+    /**
+     * @brief Adds the sequence number to the name of events that aren't STRUCTURED (default: false)
+     * 
+     * @param value true to add the suffix
+     * 
+     * The suffix is "/" followed by the number in decimal, for example "temp/1234". Webhooks and
+     * subscriptions match event names by prefix, so a webhook for "temp" still receives the event,
+     * but a subscription or integration that matches the full name does not. Event names can be at
+     * most kMaxEventNameLen - kMaxSequenceSuffixLen characters; longer names are refused with
+     * PublishStatus::INVALID_EVENT. Requires withSequenceNumbers() and a non-empty withSequenceKey().
+     */
+    PublishQueueExtBase &withSequenceNameSuffix(bool value = true) { sequenceNameSuffix = value; return *this; };
     
     /**
      * @brief Lock the queue protection mutex
@@ -242,27 +1035,52 @@ public:
      * This is done internally; you probably won't need to call this yourself.
      * It needs to be public for the WITH_LOCK() macro to work properly.
      */
-    void lock() { os_mutex_recursive_lock(mutex); };
+    void lock() {
+#if PUBLISHQUEUEEXT_LOCK_STATS
+        lockWithStats();
+#else
+        os_mutex_recursive_lock(mutex);
+#endif
+    };
 
     /**
      * @brief Attempt the queue protection mutex
+     * 
+     * @return true if the lock was acquired, false if another thread holds it
      */
-    bool tryLock() { return os_mutex_recursive_trylock(mutex); };
+    bool tryLock() {
+        if (os_mutex_recursive_trylock(mutex) != 0) {
+            return false;
+        }
+#if PUBLISHQUEUEEXT_LOCK_STATS
+        lockAcquired();
+#endif
+        return true;
+    };
 
     /**
      * @brief Unlock the queue protection mutex
      */
-    void unlock() { os_mutex_recursive_unlock(mutex); };
+    void unlock() {
+#if PUBLISHQUEUEEXT_LOCK_STATS
+        lockReleasing();
+#endif
+        os_mutex_recursive_unlock(mutex);
+    };
 
 
 protected:
     /**
      * @brief Constructor 
      * 
-     * This class is a singleton; you never create one of these directly. Use 
-     * PublishQueueExt::instance() to get the singleton instance.
+     * @param storage The storage backend to use
+     * @param metaBuf Buffer for JSON meta data and the trailer, reused for each event
+     * @param metaBufSize Size of metaBuf in bytes
+     * 
+     * You never create one of these directly. Use PublishQueueExt::instance() to get the
+     * singleton instance, or the instance() method of your own PublishQueueExtT.
      */
-    PublishQueueExt();
+    PublishQueueExtBase(PublishQueueExtStorage &storage, char *metaBuf, size_t metaBufSize);
 
     /**
      * @brief Destructor
@@ -270,17 +1088,261 @@ protected:
      * This class is never deleted; once the singleton is created it cannot
      * be destroyed.
      */
-    virtual ~PublishQueueExt();
+    virtual ~PublishQueueExtBase();
 
     /**
      * @brief This class is not copyable
      */
-    PublishQueueExt(const PublishQueueExt&) = delete;
+    PublishQueueExtBase(const PublishQueueExtBase&) = delete;
 
     /**
      * @brief This class is not copyable
      */
-    PublishQueueExt& operator=(const PublishQueueExt&) = delete;
+    PublishQueueExtBase& operator=(const PublishQueueExtBase&) = delete;
+
+    /**
+     * @brief Queue an event. All of the publish overloads call this.
+     *
+     * @param event The event to queue. Passed by reference to avoid copying the CloudEvent.
+     * @param options Options such as the time-to-live
+     * @param canDiscard true to discard queued events if the queue is full, false to refuse the event
+     * @return A PublishStatus value
+     */
+    PublishStatus publishInternal(const CloudEvent &event, const EventOptions &options, bool canDiscard = true);
+
+    /**
+     * @brief Save the event name dictionary to storage
+     */
+    bool saveEventNames();
+
+    /**
+     * @brief Load the event name dictionary from storage
+     */
+    void loadEventNames();
+
+    /**
+     * @brief Gets the next sequence number, reserving a new block in storage if necessary
+     * 
+     * @return The sequence number, or 0 if a new block could not be saved to storage
+     */
+    uint32_t nextSequence();
+
+    /**
+     * @brief Save the end of the reserved sequence number block to storage
+     */
+    bool saveSequence();
+
+    /**
+     * @brief Load the end of the reserved sequence number block from storage and continue from there
+     */
+    void loadSequence();
+
+    /**
+     * @brief Add the sequence number to the event data or event name before sending
+     * 
+     * @param event The event to modify
+     * @param sequence The sequence number, or 0 to do nothing
+     */
+    void attachSequence(CloudEvent &event, uint32_t sequence);
+
+    /**
+     * @brief Remove the sequence number suffix added to the event name by attachSequence()
+     * 
+     * @param event The event to modify
+     * @param sequence The sequence number that was attached, or 0 to do nothing
+     */
+    void detachSequence(CloudEvent &event, uint32_t sequence);
+
+    /**
+     * @brief Returns true if attachSequence() adds the sequence number to the name of this event
+     */
+    bool isSequenceInName(const CloudEvent &event) const { return sequenceNameSuffix && sequenceKey.length() != 0 && event.contentType() != ContentType::STRUCTURED; };
+
+    /**
+     * @brief Replace structured event data with a batch block, adding it to the newest queued block if possible
+     * 
+     * @param event The event to encode. On success, batchEvent is set to the event name with the block as its
+     * data and the content type BINARY.
+     * @param options The event options. If options.sequence is not 0, it is added to the row using sequenceKey.
+     * @param mergedFileNum Set to the file number of the queued block that the event was added to, which the
+     * caller removes after saving the new block, or 0 if a new block was started
+     * @param timestamp Set to the timestamp of the queued block if the event was added to it
+     * @return true if the event was encoded, false if it can't be batched
+     */
+    bool encodeBatch(const CloudEvent &event, const EventOptions &options, int &mergedFileNum, uint32_t &timestamp);
+
+    /**
+     * @brief Check the watermarks and call the watermark callback if crossed
+     */
+    void checkWatermarks();
+
+    /**
+     * @brief Update the peak statistics for one event
+     * 
+     * @param dataSize Number of bytes of event data, which are held in a CloudEvent
+     * @param tempRamSize Number of bytes of RAM temporarily used by the storage backend to save or load the data
+     */
+    void updateEventStats(size_t dataSize, size_t tempRamSize);
+
+    /**
+     * @brief Start the hold when the first event is queued and end it if a hold limit is reached
+     * 
+     * @param urgent true if an urgent event was just queued
+     */
+    void checkHold(bool urgent = false);
+
+    /**
+     * @brief Select the next event to send
+     * 
+     * @return The file number of the oldest event, or of the oldest event queued after connecting if
+     * withFreshEventShare() allows it, or 0 if the queue is empty
+     */
+    int selectNextEvent();
+
+    /**
+     * @brief Gets the wait between publishes from withReconnectRampUp() at the current time
+     * 
+     * @return Wait in milliseconds, or 0 if not ramping up
+     */
+    unsigned long getRampWait() const;
+
+    /**
+     * @brief Write an event to storage and add it to the queue
+     *
+     * @param fileNum The file number returned from reserve()
+     * @param event The event to save
+     * @param options Options such as the time-to-live
+     * @param timestamp Time.now() when the event was published, or 0 if not valid
+     * @return true if the event was saved and added to the queue
+     */
+    bool saveRecord(int fileNum, const CloudEvent &event, const EventOptions &options, uint32_t timestamp);
+
+    /**
+     * @brief Returns true if an event can be sent using direct publish right now
+     */
+    bool canPublishDirect(const CloudEvent &event);
+
+    /**
+     * @brief Implementation of lock() when PUBLISHQUEUEEXT_LOCK_STATS is 1, measures the wait time
+     */
+    void lockWithStats();
+
+    /**
+     * @brief Called after the mutex is acquired when PUBLISHQUEUEEXT_LOCK_STATS is 1
+     */
+    void lockAcquired();
+
+    /**
+     * @brief Called before the mutex is released when PUBLISHQUEUEEXT_LOCK_STATS is 1, measures the hold time
+     */
+    void lockReleasing();
+
+    /**
+     * @brief Send an event without writing it to storage first. Must be called with the lock held.
+     *
+     * @return PublishStatus::SENT, or PublishStatus::QUEUED if it failed immediately and was saved to the queue
+     */
+    PublishStatus publishDirect(const CloudEvent &event, const EventOptions &options);
+
+    /**
+     * @brief Save curEvent to the queue if it was sent by direct publish, and clear curFileNum
+     *
+     * @return true if the event was saved
+     */
+    bool saveCurEvent();
+
+    /**
+     * @brief Returns true if an event has expired. The entry must be loaded.
+     */
+    bool isExpired(const PublishQueueExtIndexEntry &entry) const;
+
+    /**
+     * @brief Parse the JSON meta data stored in a queue file without allocating memory
+     *
+     * @param json The null-terminated JSON object, as written by publishInternal()
+     * @param name Buffer to store the event name in
+     * @param nameSize Size of the name buffer in bytes
+     * @param contentType Filled in with the content-type, if present
+     * @return true if the meta data is valid and contains a name
+     */
+    static bool parseMeta(const char *json, char *name, size_t nameSize, int &contentType);
+
+    /**
+     * @brief Read and validate the trailers at the end of a queue file
+     * 
+     * @param fileNum The file number of the record
+     * @param trailer Filled in with the trailer
+     * @param ext Filled in with the trailer extension. Fields not present in the file are set to 0.
+     * @return true if the trailer is valid
+     */
+    bool readTrailer(int fileNum, QueueFileTrailer &trailer, QueueFileTrailerExt &ext);
+
+    /**
+     * @brief Check the CRC of a record
+     * 
+     * @param fileNum The file number of the record
+     * @param trailer The trailer from readTrailer()
+     * @param ext The trailer extension from readTrailer()
+     * @return true if the CRC matches, or the record is from a version without a CRC
+     * 
+     * metaBuf is used as the read buffer.
+     */
+    bool verifyRecord(int fileNum, const QueueFileTrailer &trailer, const QueueFileTrailerExt &ext);
+
+    /**
+     * @brief Update a CRC with a range of bytes from a record
+     * 
+     * @param fileNum The file number of the record
+     * @param offset Offset in the record to start at
+     * @param size Number of bytes
+     * @param crc CRC to update
+     * @return true if the bytes were read
+     * 
+     * metaBuf is used as the read buffer.
+     */
+    bool crcRecordRange(int fileNum, size_t offset, size_t size, uint32_t &crc);
+
+    /**
+     * @brief Read the trailer and check the CRC of a record, if not already done
+     * 
+     * @param entry The entry to check. kFlagVerified or kFlagInvalid is set.
+     * @return true if the record is valid
+     */
+    bool verifyIndexEntry(PublishQueueExtIndexEntry &entry);
+
+    /**
+     * @brief Fill in an index entry from the record trailer, if not already loaded
+     * 
+     * @param entry The entry to update
+     */
+    void loadIndexEntry(PublishQueueExtIndexEntry &entry);
+
+    /**
+     * @brief Gets information about a queued event, used by the events() iterator
+     * 
+     * @param index Index into the queue, 0 = oldest
+     */
+    EventInfo getEventInfo(size_t index);
+
+    /**
+     * @brief Read the event name from the meta data of a queued event
+     * 
+     * @param fileNum The file number of the record
+     * @param buf Buffer to store the name in
+     * @param bufSize Size of buf in bytes
+     * @return true if the name was read
+     */
+    bool readEventName(int fileNum, char *buf, size_t bufSize);
+
+    /**
+     * @brief Select an event to discard when the queue is over its limit and remove it from the queue
+     * 
+     * @return The file number removed from the queue, or 0 if none can be removed. The caller removes the data.
+     * 
+     * The event in curFileNum is never selected, as it is being sent. The default implementation
+     * removes the second oldest event. PublishQueueExtT overrides this using its EvictionPolicy.
+     */
+    virtual int selectEvictFromQueue();
 
     /**
      * @brief Delete the current event in curFileNum
@@ -311,23 +1373,73 @@ protected:
      */
     void statePublishWait();
 
-    /**
-     * @brief SequentialFileRK library object for maintaining the queue of files on the POSIX file system
-     */
-    SequentialFile fileQueue;
+    PublishQueueExtStorage *storage; //!< Storage backend in use
 
-    /**
-     * @brief File used for temporary data
-     */
-    String tempFileName = "temp.dat";
-    String tempFilePath; //!< Fill path name to tempFileName
+    PublishQueueExtTransportCloud cloudTransport; //!< Default transport
+    PublishQueueExtTransport *transport; //!< Transport used to send events
+    PublishQueueExtTransport *sendTransport; //!< Transport curEvent was sent with
 
     size_t fileQueueSize = 100; //!< size of the queue on the flash file system
 
     os_mutex_recursive_t mutex; //!< mutex for protecting the queue
 
+    char *metaBuf; //!< Buffer for JSON meta data and trailer, reused for each event
+    size_t metaBufSize; //!< Size of metaBuf in bytes
+    char nameBuf[kMaxEventNameLen + 1]; //!< Buffer for the event name when reading meta data
+
     CloudEvent curEvent; //!< Current event being published
     int curFileNum = 0; //!< Current file number being published
+    bool curEventDirect = false; //!< curEvent was sent by direct publish and is not in storage
+    bool curEventStreamed = false; //!< curEvent has no data; the transport reads it from storage using sendFromStorage()
+    size_t curEventStreamSize = 0; //!< Size of the event data in storage when curEventStreamed is true
+    EventOptions curEventOptions; //!< Options for curEvent, used when curEventDirect is true
+    uint32_t curEventTimestamp = 0; //!< Time curEvent was published, used when curEventDirect is true
+    bool directPublish = false; //!< Send events directly when the queue is idle
+
+    size_t highWatermarkCount = 0; //!< High watermark number of events, 0 = not used
+    size_t highWatermarkBytes = 0; //!< High watermark bytes of event data, 0 = not used
+    size_t lowWatermarkCount = 0; //!< Low watermark number of events
+    size_t lowWatermarkBytes = 0; //!< Low watermark bytes of event data
+    bool aboveHighWatermark = false; //!< Above the high watermark and not yet back to the low watermark
+    size_t lastWatermarkNumEvents = 0; //!< Number of events when the watermarks were last checked
+    std::function<void(bool aboveHigh)> watermarkCallback = 0; //!< Watermark callback function
+
+    bool fullRecoveryScan = false; //!< Check every queued event in setup()
+
+    unsigned long reconnectRandomMs = 0; //!< Maximum random delay after connecting
+    unsigned long rampUpMs = 0; //!< Period after publishing starts to ramp up the publish rate, 0 = disabled
+    unsigned long rampInitialWaitMs = 0; //!< Wait between publishes at the start of the ramp up
+    unsigned int freshSharePercent = 0; //!< Percentage of publishes for events queued after connecting
+    unsigned long connectedMs = 0; //!< millis() value when publishing starts after connecting
+    int backlogEndFileNum = 0; //!< Newest file number queued before connecting, 0 = not catching up
+    unsigned int freshCredit = 0; //!< Accumulates freshSharePercent for each publish while catching up
+
+    size_t batchMaxRows = 0; //!< Maximum events in a batch block, 0 = batching disabled
+    size_t batchMaxBytes = 1024; //!< Maximum size of a batch block in bytes
+    std::vector<uint8_t> batchBuf; //!< The queued block and the new block, batchMaxBytes each, used by encodeBatch()
+    CloudEvent batchEvent; //!< The block made by encodeBatch(), saved in place of the published event
+
+    bool sequenceNumbers = false; //!< Assign sequence numbers to events
+    String sequenceKey = "seq"; //!< Key for the sequence number in structured event data
+    bool sequenceNameSuffix = false; //!< Add the sequence number to the name of events that aren't STRUCTURED
+    uint32_t sequenceNext = 1; //!< Next sequence number to assign
+    uint32_t sequenceLimit = 0; //!< End of the block of sequence numbers reserved in storage
+
+    size_t ramBudget = 0; //!< Maximum bytes of event data to buffer in RAM, 0 = no limit
+    Stats stats; //!< Statistics returned by getStats()
+
+    LockStats lockStats; //!< Statistics returned by getLockStats(), only updated with the lock held
+    unsigned int lockDepth = 0; //!< Recursive lock depth, only updated with the lock held
+    uint32_t lockAcquiredUs = 0; //!< micros() value when the outermost lock was acquired
+
+    unsigned long holdMaxMs = 0; //!< Maximum time to hold events, 0 = do not hold
+    size_t holdCount = 0; //!< Number of events that ends the hold, 0 = not used
+    size_t holdBytes = 0; //!< Bytes of event data that ends the hold, 0 = not used
+    bool holdStarted = false; //!< There are queued events and holdStartMs is set
+    bool holdReleased = false; //!< The hold ended, send until the queue is empty
+    unsigned long holdStartMs = 0; //!< millis() value when the first held event was queued
+
+    std::vector<String> eventNames; //!< Registered event names, index is name ID - 1
     unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
     unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
     bool pausePublishing = false; //!< flag to pause publishing (used from automated test)
@@ -339,9 +1451,136 @@ protected:
 
     std::function<void(const CloudEvent &event)> publishCompleteUserCallback = 0; //!< User callback for publish complete
 
-    std::function<void(PublishQueueExt&)> stateHandler = 0; //!< state handler (stateConnectWait, stateWait, etc).
+    std::function<void(PublishQueueExtBase&)> stateHandler = 0; //!< state handler (stateConnectWait, stateWait, etc).
+    bool waitingForEvent = false; //!< stateHandler is stateWaitEvent. Set with stateHandler, as std::function::target() requires RTTI.
+};
+
+/**
+ * @brief Pacing policy with the default wait times
+ * 
+ * A pacing policy is a class with these constexpr members, in milliseconds. To change them,
+ * define your own class with the same members and use it with PublishQueueExtT.
+ * 
+ * The values are copied into PublishQueueExtBase when the queue is constructed, so the state
+ * machine is shared by all instantiations. The policy only names the initial wait times; it
+ * does not make the waits compile-time constants.
+ */
+struct PublishQueueExtPacingDefault {
+    static constexpr unsigned long kWaitAfterConnect = 500; //!< time to wait after Particle.connected() before publishing
+    static constexpr unsigned long kWaitBetweenPublish = 10; //!< how long to wait in milliseconds between publishes
+    static constexpr unsigned long kWaitAfterFailure = 30000; //!< how long to wait after failing to publish before trying again
+};
 
-    static PublishQueueExt *_instance; //!< singleton instance of this class
+/**
+ * @brief Eviction policy that discards the second oldest event when the queue is full (default)
+ * 
+ * The oldest event is not discarded because it may be in the process of being sent. With
+ * withFreshEventShare() the event being sent can be a newer one; if it is the second oldest, the
+ * third oldest is discarded instead.
+ * 
+ * An eviction policy is a class with a static selectEvict() method that removes one event from
+ * the queue and returns its file number, or 0 if no event can be discarded. It is passed the file
+ * number of the event being sent (0 if none), which must not be removed.
+ */
+struct PublishQueueExtEvictSecondOldest {
+    /**
+     * @brief Remove the event to discard from the queue
+     */
+    static int selectEvict(PublishQueueExtStorage &storage, int inFlightFileNum) { return storage.removeSecondFromQueue(inFlightFileNum); };
 };
 
+/**
+ * @brief Eviction policy that discards the newest event when the queue is full
+ * 
+ * This preserves the history in the queue at the expense of the most recent events. If the newest
+ * event is being sent, the one before it is discarded instead.
+ */
+struct PublishQueueExtEvictNewest {
+    /**
+     * @brief Remove the event to discard from the queue
+     */
+    static int selectEvict(PublishQueueExtStorage &storage, int inFlightFileNum) { return (storage.getQueueLen() >= 2) ? storage.removeLastFromQueue(inFlightFileNum) : 0; };
+};
+
+/**
+ * @brief Compile-time configurable publish queue
+ * 
+ * @tparam StoragePolicy Storage backend class, such as PublishQueueExtStoragePosix or PublishQueueExtStorageRam. 
+ * It is contained in this object, so it is not allocated separately. It is still contained in this
+ * object if withStorage() selects a different backend, so instantiate the template with the backend
+ * you use rather than replacing it (PublishQueueExtStoragePosix is about 1 Kbyte).
+ * 
+ * @tparam PacingPolicy Class with constexpr initial wait times, such as PublishQueueExtPacingDefault
+ * 
+ * @tparam EvictionPolicy Class with a static selectEvict() method, such as PublishQueueExtEvictSecondOldest
+ * 
+ * @tparam MetaBufSize Size of the buffer for JSON meta data and the trailers. It must hold the
+ * longest event name, JSON-escaped, plus about 50 bytes.
+ * 
+ * PublishQueueExt is the default instantiation. To use different policies, declare a type for
+ * your instantiation and use its instance() method, for example:
+ * 
+ * typedef PublishQueueExtT<PublishQueueExtStorageRam> RamPublishQueue;
+ * RamPublishQueue::instance().setup();
+ */
+template<class StoragePolicy, class PacingPolicy = PublishQueueExtPacingDefault, class EvictionPolicy = PublishQueueExtEvictSecondOldest, size_t MetaBufSize = 256>
+class PublishQueueExtT : public PublishQueueExtBase {
+public:
+    static constexpr size_t kMetaBufSize = MetaBufSize; //!< Size of the buffer for JSON meta data and the trailer
+
+    static_assert(MetaBufSize > sizeof(QueueFileTrailer) + sizeof(QueueFileTrailerExt) + 32, "MetaBufSize is too small");
+
+    /**
+     * @brief Gets the singleton instance of this class
+     * 
+     * You cannot construct a PublishQueueExt object as a global variable,
+     * stack variable, or with new. You can only request the singleton instance.
+     */
+    static PublishQueueExtT &instance() {
+        if (!_instance) {
+            _instance = new PublishQueueExtT();
+        }
+        return *_instance;
+    };
+
+    /**
+     * @brief Gets the storage backend object, with its StoragePolicy type
+     */
+    StoragePolicy &getStoragePolicy() { return storagePolicy; };
+
+protected:
+    /**
+     * @brief Constructor. Use instance() instead.
+     */
+    PublishQueueExtT() : PublishQueueExtBase(storagePolicy, metaBufArray, sizeof(metaBufArray)) {
+        waitAfterConnect = PacingPolicy::kWaitAfterConnect;
+        waitBetweenPublish = PacingPolicy::kWaitBetweenPublish;
+        waitAfterFailure = PacingPolicy::kWaitAfterFailure;
+    };
+
+    /**
+     * @brief Destructor. This class is never deleted.
+     */
+    virtual ~PublishQueueExtT() {};
+
+    /**
+     * @brief Select an event to discard using EvictionPolicy
+     */
+    virtual int selectEvictFromQueue() override { return EvictionPolicy::selectEvict(*storage, curFileNum); };
+
+    StoragePolicy storagePolicy; //!< Storage backend object
+    char metaBufArray[MetaBufSize]; //!< Buffer passed to PublishQueueExtBase as metaBuf
+
+    static PublishQueueExtT *_instance; //!< singleton instance of this class
+};
+
+template<class StoragePolicy, class PacingPolicy, class EvictionPolicy, size_t MetaBufSize>
+PublishQueueExtT<StoragePolicy, PacingPolicy, EvictionPolicy, MetaBufSize> *PublishQueueExtT<StoragePolicy, PacingPolicy, EvictionPolicy, MetaBufSize>::_instance;
+
+/**
+ * @brief The default publish queue: POSIX file system storage, default pacing, and discarding
+ * the second oldest event when the queue is full
+ */
+typedef PublishQueueExtT<PublishQueueExtStoragePosix> PublishQueueExt;
+
 #endif /* __PUBLISHQUEUEEXTRK_H */
@@ -0,0 +1,960 @@
+#include "PublishQueueExtStorage.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+static Logger _log("app.pubq");
+
+//
+// PublishQueueExtFileNumIndex
+//
+bool PublishQueueExtFileNumIndex::find(int fileNum, size_t &value) const {
+    if (count == 0) {
+        return false;
+    }
+    for(size_t ii = bucketFor(fileNum); buckets[ii].fileNum != 0; ii = (ii + 1) & (buckets.size() - 1)) {
+        if (buckets[ii].fileNum == fileNum) {
+            value = buckets[ii].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void PublishQueueExtFileNumIndex::insert(int fileNum, size_t value) {
+    // Keep the table at most half full so probe sequences stay short
+    if ((count + 1) * 2 > buckets.size()) {
+        grow();
+    }
+
+    size_t ii = bucketFor(fileNum);
+    while(buckets[ii].fileNum != 0 && buckets[ii].fileNum != fileNum) {
+        ii = (ii + 1) & (buckets.size() - 1);
+    }
+    if (buckets[ii].fileNum == 0) {
+        buckets[ii].fileNum = fileNum;
+        count++;
+    }
+    buckets[ii].value = value;
+}
+
+void PublishQueueExtFileNumIndex::erase(int fileNum) {
+    if (count == 0) {
+        return;
+    }
+    size_t mask = buckets.size() - 1;
+
+    size_t ii = bucketFor(fileNum);
+    while(buckets[ii].fileNum != fileNum) {
+        if (buckets[ii].fileNum == 0) {
+            return;
+        }
+        ii = (ii + 1) & mask;
+    }
+
+    // Move later entries in the same probe sequence back into the hole, so lookups do not
+    // stop early at an empty bucket
+    for(size_t jj = (ii + 1) & mask; buckets[jj].fileNum != 0; jj = (jj + 1) & mask) {
+        size_t home = bucketFor(buckets[jj].fileNum);
+        bool stays = (ii <= jj) ? (ii < home && home <= jj) : (ii < home || home <= jj);
+        if (!stays) {
+            buckets[ii] = buckets[jj];
+            ii = jj;
+        }
+    }
+    buckets[ii] = Bucket();
+    count--;
+}
+
+void PublishQueueExtFileNumIndex::clear() {
+    for(Bucket &bucket : buckets) {
+        bucket = Bucket();
+    }
+    count = 0;
+}
+
+void PublishQueueExtFileNumIndex::grow() {
+    std::vector<Bucket> oldBuckets(buckets.empty() ? 16 : buckets.size() * 2);
+    oldBuckets.swap(buckets);
+    count = 0;
+
+    for(const Bucket &bucket : oldBuckets) {
+        if (bucket.fileNum != 0) {
+            insert(bucket.fileNum, bucket.value);
+        }
+    }
+}
+
+//
+// PublishQueueExtStorage
+//
+PublishQueueExtStorage::PublishQueueExtStorage() {
+}
+
+PublishQueueExtStorage::~PublishQueueExtStorage() {
+}
+
+bool PublishQueueExtStorage::saveEventData(int fileNum, const CloudEvent &event) {
+    Buffer buf = event.dataBuffer();
+
+    return append(fileNum, buf.data(), buf.size());
+}
+
+bool PublishQueueExtStorage::loadEventData(int fileNum, size_t dataSize, CloudEvent &event) {
+    bool bResult = false;
+
+    char *buf = new char[dataSize];
+    if (buf) {
+        if (readRange(fileNum, 0, buf, dataSize) == (int)dataSize) {
+            event.data(buf, dataSize);
+            bResult = true;
+        }
+        delete[] buf;
+    }
+    return bResult;
+}
+
+bool PublishQueueExtStorage::saveAux(const char *name, const void *buf, size_t len) {
+    const char *dirPath = getDirPath();
+    if (!*dirPath) {
+        return false;
+    }
+
+    // Write to a temporary file and rename it so a reset while writing does not corrupt the blob
+    char path[128], tempPath[128];
+    snprintf(path, sizeof(path), "%s/%s.aux", dirPath, name);
+    snprintf(tempPath, sizeof(tempPath), "%s/%s.tmp", dirPath, name);
+
+    // The directory may not exist yet, or may have been removed by removeAllData()
+    mkdir(dirPath, 0777);
+
+    int fd = open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        _log.info("error opening %s", tempPath);
+        return false;
+    }
+    bool bResult = (write(fd, buf, len) == (int)len);
+    close(fd);
+
+    if (bResult) {
+        bResult = (rename(tempPath, path) == 0);
+    }
+    if (!bResult) {
+        _log.info("error saving %s", path);
+        unlink(tempPath);
+    }
+    return bResult;
+}
+
+int PublishQueueExtStorage::loadAux(const char *name, void *buf, size_t bufSize) {
+    const char *dirPath = getDirPath();
+    if (!*dirPath) {
+        return -1;
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s.aux", dirPath, name);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int count = read(fd, buf, bufSize);
+    close(fd);
+
+    return count;
+}
+
+void PublishQueueExtStorage::addToQueue(int fileNum) {
+    PublishQueueExtIndexEntry entry;
+    entry.fileNum = fileNum;
+    queue.push_back(entry);
+}
+
+void PublishQueueExtStorage::addToQueue(const PublishQueueExtIndexEntry &entry) {
+    queue.push_back(entry);
+}
+
+void PublishQueueExtStorage::insertInQueue(const PublishQueueExtIndexEntry &entry) {
+    // Normally the file number is the newest, so search from the back
+    size_t index = queue.size();
+    while(index > 0 && queue[index - 1].fileNum > entry.fileNum) {
+        index--;
+    }
+    queue.insert(index, entry);
+}
+
+PublishQueueExtIndexEntry *PublishQueueExtStorage::findQueueEntry(int fileNum) {
+    for(size_t ii = 0; ii < queue.size(); ii++) {
+        if (queue[ii].fileNum == fileNum) {
+            return &queue[ii];
+        }
+    }
+    return nullptr;
+}
+
+int PublishQueueExtStorage::removeSecondFromQueue(int keepFileNum) {
+    size_t index = 1;
+    if (index < queue.size() && keepFileNum != 0 && queue[index].fileNum == keepFileNum) {
+        index++;
+    }
+    if (index >= queue.size()) {
+        return 0;
+    }
+    int fileNum = queue[index].fileNum;
+    queue.erase(index);
+    return fileNum;
+}
+
+int PublishQueueExtStorage::removeLastFromQueue(int keepFileNum) {
+    if (queue.empty()) {
+        return 0;
+    }
+    size_t index = queue.size() - 1;
+    if (keepFileNum != 0 && queue[index].fileNum == keepFileNum) {
+        if (index == 0) {
+            return 0;
+        }
+        index--;
+    }
+    int fileNum = queue[index].fileNum;
+    queue.erase(index);
+    return fileNum;
+}
+
+bool PublishQueueExtStorage::removeFromQueue(int fileNum) {
+    for(size_t ii = 0; ii < queue.size(); ii++) {
+        if (queue[ii].fileNum == fileNum) {
+            queue.erase(ii);
+            return true;
+        }
+    }
+    return false;
+}
+
+void PublishQueueExtStorage::remove(int fileNum) {
+    removeFromQueue(fileNum);
+    removeData(fileNum);
+}
+
+void PublishQueueExtStorage::removeAll() {
+    queue.clear();
+    removeAllData();
+}
+
+size_t PublishQueueExtStorage::removeIf(std::function<bool(PublishQueueExtIndexEntry &entry)> pred) {
+    size_t keep = 0;
+
+    for(size_t ii = 0; ii < queue.size(); ii++) {
+        if (pred(queue[ii])) {
+            removeData(queue[ii].fileNum);
+        }
+        else {
+            if (keep != ii) {
+                queue[keep] = queue[ii];
+            }
+            keep++;
+        }
+    }
+    size_t numRemoved = queue.size() - keep;
+    queue.truncate(keep);
+
+    return numRemoved;
+}
+
+void PublishQueueExtStorage::enumerate(std::function<bool(int fileNum)> cb) const {
+    for(size_t ii = 0; ii < queue.size(); ii++) {
+        if (!cb(queue[ii].fileNum)) {
+            break;
+        }
+    }
+}
+
+//
+// PublishQueueExtStoragePosix
+//
+PublishQueueExtStoragePosix::PublishQueueExtStoragePosix() {
+    fileQueue.withDirPath("/usr/pubqueue2");
+    tempFilePath[0] = 0;
+}
+
+PublishQueueExtStoragePosix::~PublishQueueExtStoragePosix() {
+    closeCachedFile();
+}
+
+bool PublishQueueExtStoragePosix::setup() {
+    fileQueue
+        .withFilenameExtension("pq")
+        .scanDir();
+
+    snprintf(tempFilePath, sizeof(tempFilePath), "%s/%s", fileQueue.getDirPath(), tempFileName);
+
+    // Determine the SequentialFile naming scheme so paths can be generated without
+    // allocating a String for every file access. If the generated name does not match
+    // exactly, fall back to using SequentialFile.
+    const int testFileNum = 1234567;
+    String testPath = fileQueue.getPathForFileNum(testFileNum);
+    const char *lastSlash = strrchr(testPath.c_str(), '/');
+    const char *dot = strrchr(testPath.c_str(), '.');
+    nameLen = 0;
+    if (lastSlash && dot && dot > lastSlash) {
+        nameLen = (int)(dot - lastSlash - 1);
+        if (strcmp(getFlatPathForFileNum(testFileNum), testPath.c_str()) != 0) {
+            _log.info("using SequentialFile naming %s", testPath.c_str());
+            nameLen = 0;
+        }
+    }
+
+    // The queue order is kept by the base class, so move the scanned files from
+    // the SequentialFile queue. SequentialFile is still used for naming and numbering
+    // of files in the flat layout.
+    queue.clear();
+    int fileNum;
+    if (shardSize == 0) {
+        while((fileNum = fileQueue.getFileFromQueue(true)) != 0) {
+            addToQueue(fileNum);
+        }
+    }
+    else {
+        // Move files from the flat layout into shard directories. The rename does not
+        // copy the data, so this is fast even for a large queue.
+        lastFileNum = 0;
+        lastShardDir = -1;
+        char flatPath[kMaxPathLen];
+        while((fileNum = fileQueue.getFileFromQueue(true)) != 0) {
+            strcpy(flatPath, getFlatPathForFileNum(fileNum));
+            ensureShardDir(fileNum);
+            if (rename(flatPath, getPathForFileNum(fileNum)) != 0) {
+                _log.info("failed to migrate %s", flatPath);
+            }
+            if (fileNum > lastFileNum) {
+                lastFileNum = fileNum;
+            }
+        }
+
+        scanShards();
+    }
+
+    return true;
+}
+
+int PublishQueueExtStoragePosix::reserve() {
+    if (shardSize) {
+        // File numbers are assigned here instead of by SequentialFile, which only scans
+        // the top-level directory
+        return ++lastFileNum;
+    }
+    return fileQueue.reserveFile();
+}
+
+bool PublishQueueExtStoragePosix::append(int fileNum, const void *buf, size_t len) {
+    int fd = openFileNum(fileNum, true);
+    if (fd == -1) {
+        return false;
+    }
+
+    lseek(fd, 0, SEEK_END);
+    if (len && write(fd, buf, len) != (int)len) {
+        _log.info("failed to append %u bytes to fileNum %d", len, fileNum);
+        return false;
+    }
+    return true;
+}
+
+int PublishQueueExtStoragePosix::readRange(int fileNum, size_t offset, void *buf, size_t len) {
+    int fd = openFileNum(fileNum);
+    if (fd == -1) {
+        return -1;
+    }
+
+    lseek(fd, offset, SEEK_SET);
+    return read(fd, buf, len);
+}
+
+bool PublishQueueExtStoragePosix::getSize(int fileNum, size_t &size) {
+    int fd = openFileNum(fileNum);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat sb = {0};
+    fstat(fd, &sb);
+    size = (size_t)sb.st_size;
+    return true;
+}
+
+void PublishQueueExtStoragePosix::removeData(int fileNum) {
+    if (fileNum == cachedFileNum) {
+        closeCachedFile();
+    }
+    unlink(getPathForFileNum(fileNum));
+
+    if (shardSize && (fileNum % shardSize) == (shardSize - 1)) {
+        // Last file number in the shard. The directory is removed if empty; if not (events
+        // were removed out of order) it's removed by scanShards() at the next setup.
+        rmdir(getShardDirPath(fileNum / shardSize));
+        if (lastShardDir == fileNum / shardSize) {
+            lastShardDir = -1;
+        }
+    }
+}
+
+void PublishQueueExtStoragePosix::removeAllData() {
+    closeCachedFile();
+    fileQueue.removeAll(true);
+
+    if (shardSize) {
+        std::vector<int> shards;
+        readShardDirs(shards);
+        for(int shard : shards) {
+            char shardPath[kMaxPathLen];
+            strcpy(shardPath, getShardDirPath(shard));
+
+            DIR *dir = opendir(shardPath);
+            if (dir) {
+                struct dirent *ent;
+                while((ent = readdir(dir)) != nullptr) {
+                    // Skip names that don't fit, rather than removing a truncated path
+                    if (ent->d_name[0] != '.' && snprintf(pathBuf, sizeof(pathBuf), "%s/%s", shardPath, ent->d_name) < (int)sizeof(pathBuf)) {
+                        unlink(pathBuf);
+                    }
+                }
+                closedir(dir);
+            }
+            rmdir(shardPath);
+        }
+        lastShardDir = -1;
+    }
+}
+
+void PublishQueueExtStoragePosix::closeRecord(int fileNum) {
+    if (fileNum == cachedFileNum) {
+        closeCachedFile();
+    }
+}
+
+bool PublishQueueExtStoragePosix::saveEventData(int fileNum, const CloudEvent &event) {
+    // saveData() creates the file, so make sure we are not holding a stale descriptor
+    if (fileNum == cachedFileNum) {
+        closeCachedFile();
+    }
+    ensureShardDir(fileNum);
+
+    // saveData() does not modify the event but is not declared const
+    return const_cast<CloudEvent &>(event).saveData(getPathForFileNum(fileNum)) == SYSTEM_ERROR_NONE;
+}
+
+bool PublishQueueExtStoragePosix::loadEventData(int fileNum, size_t dataSize, CloudEvent &event) {
+    bool isValid = true;
+
+    int fd = openFileNum(fileNum);
+    if (fd == -1) {
+        return false;
+    }
+
+    // Copy event data to temporary file
+    int tempFd = open(tempFilePath, O_RDWR | O_CREAT | O_TRUNC);
+    if (tempFd != -1) {
+        lseek(fd, 0, SEEK_SET);
+
+        for(size_t offset = 0; offset < dataSize; offset += kCopyBufSize) {
+            size_t count = dataSize - offset;
+            if (count > kCopyBufSize) {
+                count = kCopyBufSize;
+            }
+            read(fd, copyBuf, count);
+            int err = write(tempFd, copyBuf, count);
+            if (err < 0) {
+                _log.info("failed to write copy");
+                isValid = false;
+                break;
+            }
+        }
+
+        close(tempFd);
+    }
+    else {
+        _log.info("failed to open temp file %s", tempFilePath);
+        isValid = false;
+    }
+
+    if (isValid) {
+        isValid = event.loadData(tempFilePath) == SYSTEM_ERROR_NONE;
+    }
+
+    return isValid;
+}
+
+int PublishQueueExtStoragePosix::openFileNum(int fileNum, bool create) {
+    if (cachedFd != -1 && cachedFileNum == fileNum) {
+        return cachedFd;
+    }
+    closeCachedFile();
+
+    if (create) {
+        ensureShardDir(fileNum);
+    }
+    const char *queueFilePath = getPathForFileNum(fileNum);
+
+    cachedFd = open(queueFilePath, create ? (O_RDWR | O_CREAT) : O_RDWR);
+    if (cachedFd == -1) {
+        _log.info("error opening %s", queueFilePath);
+        return -1;
+    }
+    cachedFileNum = fileNum;
+
+    return cachedFd;
+}
+
+const char *PublishQueueExtStoragePosix::getPathForFileNum(int fileNum) {
+    if (shardSize) {
+        snprintf(pathBuf, sizeof(pathBuf), "%s/%d/%0*d.pq", fileQueue.getDirPath(), fileNum / shardSize, (nameLen > 0) ? nameLen : 8, fileNum);
+        return pathBuf;
+    }
+    return getFlatPathForFileNum(fileNum);
+}
+
+const char *PublishQueueExtStoragePosix::getShardDirPath(int shard) {
+    snprintf(pathBuf, sizeof(pathBuf), "%s/%d", fileQueue.getDirPath(), shard);
+    return pathBuf;
+}
+
+void PublishQueueExtStoragePosix::ensureShardDir(int fileNum) {
+    if (shardSize == 0 || lastShardDir == fileNum / shardSize) {
+        return;
+    }
+    // Fails with EEXIST if the directory already exists, which is fine
+    mkdir(getShardDirPath(fileNum / shardSize), 0777);
+
+    // Only cache the newest shard; older shards are only written after a failed direct publish
+    if (fileNum / shardSize > lastShardDir) {
+        lastShardDir = fileNum / shardSize;
+    }
+}
+
+// Parse a string of decimal digits followed by suffix. Returns -1 if it does not match.
+static int parseNumberWithSuffix(const char *str, const char *suffix) {
+    const char *cp = str;
+    int value = 0;
+
+    while(*cp >= '0' && *cp <= '9') {
+        value = value * 10 + (*cp++ - '0');
+    }
+    if (cp == str || strcmp(cp, suffix) != 0) {
+        return -1;
+    }
+    return value;
+}
+
+void PublishQueueExtStoragePosix::readShardDirs(std::vector<int> &shards) {
+    DIR *dir = opendir(fileQueue.getDirPath());
+    if (dir) {
+        struct dirent *ent;
+        while((ent = readdir(dir)) != nullptr) {
+            int shard = parseNumberWithSuffix(ent->d_name, "");
+            if (shard >= 0) {
+                shards.push_back(shard);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(shards.begin(), shards.end());
+}
+
+void PublishQueueExtStoragePosix::scanShards() {
+    std::vector<int> shards;
+    readShardDirs(shards);
+
+    // Shards cover ascending, non-overlapping ranges of file numbers, so sorting the files
+    // within each shard is enough to add them to the queue in order
+    std::vector<int> fileNums;
+    for(int shard : shards) {
+        char shardPath[kMaxPathLen];
+        strcpy(shardPath, getShardDirPath(shard));
+
+        fileNums.clear();
+        DIR *dir = opendir(shardPath);
+        if (dir) {
+            struct dirent *ent;
+            while((ent = readdir(dir)) != nullptr) {
+                int fileNum = parseNumberWithSuffix(ent->d_name, ".pq");
+                if (fileNum > 0) {
+                    fileNums.push_back(fileNum);
+                }
+            }
+            closedir(dir);
+        }
+
+        if (fileNums.empty()) {
+            rmdir(shardPath);
+            continue;
+        }
+
+        std::sort(fileNums.begin(), fileNums.end());
+        for(int fileNum : fileNums) {
+            addToQueue(fileNum);
+        }
+        if (fileNums.back() > lastFileNum) {
+            lastFileNum = fileNums.back();
+        }
+    }
+    _log.trace("scanned %u shards, %d files", shards.size(), getQueueLen());
+}
+
+const char *PublishQueueExtStoragePosix::getFlatPathForFileNum(int fileNum) {
+    if (nameLen > 0) {
+        snprintf(pathBuf, sizeof(pathBuf), "%s/%0*d.pq", fileQueue.getDirPath(), nameLen, fileNum);
+    }
+    else {
+        String path = fileQueue.getPathForFileNum(fileNum);
+        strncpy(pathBuf, path.c_str(), sizeof(pathBuf) - 1);
+        pathBuf[sizeof(pathBuf) - 1] = 0;
+    }
+    return pathBuf;
+}
+
+void PublishQueueExtStoragePosix::closeCachedFile() {
+    if (cachedFd != -1) {
+        close(cachedFd);
+        cachedFd = -1;
+    }
+    cachedFileNum = 0;
+}
+
+//
+// PublishQueueExtStorageRam
+//
+PublishQueueExtStorageRam::PublishQueueExtStorageRam() {
+}
+
+PublishQueueExtStorageRam::~PublishQueueExtStorageRam() {
+}
+
+bool PublishQueueExtStorageRam::setup() {
+    return true;
+}
+
+int PublishQueueExtStorageRam::reserve() {
+    return ++lastFileNum;
+}
+
+bool PublishQueueExtStorageRam::append(int fileNum, const void *buf, size_t len) {
+    Record *rec = findRecord(fileNum);
+    if (!rec) {
+        // Reuse a free record, which retains the capacity of its data vector
+        size_t index;
+        if (!freeRecords.empty()) {
+            index = freeRecords.back();
+            freeRecords.pop_back();
+        }
+        else {
+            index = records.size();
+            records.resize(index + 1);
+        }
+        rec = &records[index];
+        rec->fileNum = fileNum;
+        rec->data.clear();
+        recordIndex.insert(fileNum, index);
+    }
+
+    const uint8_t *src = (const uint8_t *)buf;
+    rec->data.insert(rec->data.end(), src, src + len);
+    return true;
+}
+
+int PublishQueueExtStorageRam::readRange(int fileNum, size_t offset, void *buf, size_t len) {
+    Record *rec = findRecord(fileNum);
+    if (!rec) {
+        return -1;
+    }
+    if (offset >= rec->data.size()) {
+        return 0;
+    }
+    if (len > rec->data.size() - offset) {
+        len = rec->data.size() - offset;
+    }
+    memcpy(buf, &rec->data[offset], len);
+    return (int)len;
+}
+
+bool PublishQueueExtStorageRam::getSize(int fileNum, size_t &size) {
+    Record *rec = findRecord(fileNum);
+    if (!rec) {
+        return false;
+    }
+    size = rec->data.size();
+    return true;
+}
+
+void PublishQueueExtStorageRam::removeData(int fileNum) {
+    size_t index;
+    if (recordIndex.find(fileNum, index)) {
+        records[index].fileNum = 0;
+        records[index].data.clear();
+        freeRecords.push_back(index);
+        recordIndex.erase(fileNum);
+    }
+}
+
+void PublishQueueExtStorageRam::removeAllData() {
+    freeRecords.clear();
+    for(size_t ii = 0; ii < records.size(); ii++) {
+        records[ii].fileNum = 0;
+        records[ii].data.clear();
+        freeRecords.push_back(ii);
+    }
+    recordIndex.clear();
+}
+
+bool PublishQueueExtStorageRam::saveAux(const char *name, const void *buf, size_t len) {
+    AuxRecord *aux = nullptr;
+    for(AuxRecord &rec : auxRecords) {
+        if (rec.name == name) {
+            aux = &rec;
+            break;
+        }
+    }
+    if (!aux) {
+        auxRecords.resize(auxRecords.size() + 1);
+        aux = &auxRecords.back();
+        aux->name = name;
+    }
+    aux->data.assign((const uint8_t *)buf, (const uint8_t *)buf + len);
+
+    return true;
+}
+
+int PublishQueueExtStorageRam::loadAux(const char *name, void *buf, size_t bufSize) {
+    for(const AuxRecord &rec : auxRecords) {
+        if (rec.name == name) {
+            size_t count = (rec.data.size() < bufSize) ? rec.data.size() : bufSize;
+            memcpy(buf, rec.data.data(), count);
+            return (int)count;
+        }
+    }
+    return -1;
+}
+
+bool PublishQueueExtStorageRam::loadEventData(int fileNum, size_t dataSize, CloudEvent &event) {
+    Record *rec = findRecord(fileNum);
+    if (!rec || rec->data.size() < dataSize) {
+        return false;
+    }
+    event.data((const char *)rec->data.data(), dataSize);
+    return true;
+}
+
+PublishQueueExtStorageRam::Record *PublishQueueExtStorageRam::findRecord(int fileNum) {
+    size_t index;
+    if (!recordIndex.find(fileNum, index)) {
+        return nullptr;
+    }
+    return &records[index];
+}
+
+#if defined(__linux__)
+
+//
+// PublishQueueExtStorageMmap
+//
+PublishQueueExtStorageMmap::PublishQueueExtStorageMmap() {
+    dirPath = "/tmp/pubqueue2";
+}
+
+PublishQueueExtStorageMmap::~PublishQueueExtStorageMmap() {
+    unmap();
+}
+
+PublishQueueExtStorage &PublishQueueExtStorageMmap::withDirPath(const char *dirPath) {
+    this->dirPath = dirPath;
+    if (this->dirPath.length() > 1 && this->dirPath.endsWith("/")) {
+        this->dirPath = this->dirPath.substring(0, this->dirPath.length() - 1);
+    }
+    return *this;
+}
+
+bool PublishQueueExtStorageMmap::setup() {
+    unmap();
+
+    mkdir(dirPath.c_str(), 0777);
+
+    String path = dirPath + String("/") + fileName;
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        _log.error("error opening %s", path.c_str());
+        return false;
+    }
+
+    mapSize = sizeof(FileHeader) + numSlots * slotSize;
+
+    struct stat sb = {0};
+    fstat(fd, &sb);
+    if ((size_t)sb.st_size != mapSize && ftruncate(fd, mapSize) != 0) {
+        _log.error("error sizing %s to %u", path.c_str(), mapSize);
+        unmap();
+        return false;
+    }
+
+    void *addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        _log.error("error mapping %s", path.c_str());
+        mapAddr = nullptr;
+        unmap();
+        return false;
+    }
+    mapAddr = (uint8_t *)addr;
+
+    FileHeader *hdr = (FileHeader *)mapAddr;
+    if (hdr->magic != kFileHeaderMagic || hdr->slotSize != slotSize || hdr->numSlots != numSlots) {
+        _log.info("initializing %s numSlots=%u slotSize=%u", path.c_str(), numSlots, slotSize);
+        memset(mapAddr, 0, mapSize);
+        hdr->magic = kFileHeaderMagic;
+        hdr->slotSize = (uint32_t)slotSize;
+        hdr->numSlots = (uint32_t)numSlots;
+    }
+
+    slotIndex.clear();
+    freeSlots.clear();
+    lastFileNum = 0;
+
+    std::vector<int> fileNums;
+    for(size_t ii = numSlots; ii-- > 0; ) {
+        SlotHeader *slot = getSlot(ii);
+        if (slot->fileNum != 0) {
+            slotIndex.insert((int)slot->fileNum, ii);
+            fileNums.push_back((int)slot->fileNum);
+            if ((int)slot->fileNum > lastFileNum) {
+                lastFileNum = (int)slot->fileNum;
+            }
+        }
+        else {
+            freeSlots.push_back(ii);
+        }
+    }
+
+    // Slots are not stored in order, so sort by file number
+    std::sort(fileNums.begin(), fileNums.end());
+    queue.clear();
+    for(int fileNum : fileNums) {
+        addToQueue(fileNum);
+    }
+
+    return true;
+}
+
+int PublishQueueExtStorageMmap::reserve() {
+    if (!mapAddr) {
+        return 0;
+    }
+    if (freeSlots.empty()) {
+        _log.info("no free slots");
+        return 0;
+    }
+    size_t index = freeSlots.back();
+    freeSlots.pop_back();
+
+    SlotHeader *slot = getSlot(index);
+    slot->fileNum = (uint32_t) ++lastFileNum;
+    slot->size = 0;
+    slotIndex.insert(lastFileNum, index);
+    return lastFileNum;
+}
+
+bool PublishQueueExtStorageMmap::append(int fileNum, const void *buf, size_t len) {
+    SlotHeader *slot = findSlot(fileNum);
+    if (!slot) {
+        return false;
+    }
+    if (sizeof(SlotHeader) + slot->size + len > slotSize) {
+        _log.info("record too large for slot fileNum=%d size=%u", fileNum, slot->size + len);
+        return false;
+    }
+    memcpy((uint8_t *)slot + sizeof(SlotHeader) + slot->size, buf, len);
+    slot->size += (uint32_t)len;
+    return true;
+}
+
+int PublishQueueExtStorageMmap::readRange(int fileNum, size_t offset, void *buf, size_t len) {
+    SlotHeader *slot = findSlot(fileNum);
+    if (!slot) {
+        return -1;
+    }
+    if (offset >= slot->size) {
+        return 0;
+    }
+    if (len > slot->size - offset) {
+        len = slot->size - offset;
+    }
+    memcpy(buf, (uint8_t *)slot + sizeof(SlotHeader) + offset, len);
+    return (int)len;
+}
+
+bool PublishQueueExtStorageMmap::getSize(int fileNum, size_t &size) {
+    SlotHeader *slot = findSlot(fileNum);
+    if (!slot) {
+        return false;
+    }
+    size = slot->size;
+    return true;
+}
+
+void PublishQueueExtStorageMmap::removeData(int fileNum) {
+    size_t index;
+    if (mapAddr && slotIndex.find(fileNum, index)) {
+        SlotHeader *slot = getSlot(index);
+        slot->fileNum = 0;
+        slot->size = 0;
+        slotIndex.erase(fileNum);
+        freeSlots.push_back(index);
+    }
+}
+
+void PublishQueueExtStorageMmap::removeAllData() {
+    freeSlots.clear();
+    for(size_t ii = numSlots; mapAddr && ii-- > 0; ) {
+        SlotHeader *slot = getSlot(ii);
+        slot->fileNum = 0;
+        slot->size = 0;
+        freeSlots.push_back(ii);
+    }
+    slotIndex.clear();
+}
+
+bool PublishQueueExtStorageMmap::loadEventData(int fileNum, size_t dataSize, CloudEvent &event) {
+    SlotHeader *slot = findSlot(fileNum);
+    if (!slot || slot->size < dataSize) {
+        return false;
+    }
+    event.data((const char *)slot + sizeof(SlotHeader), dataSize);
+    return true;
+}
+
+PublishQueueExtStorageMmap::SlotHeader *PublishQueueExtStorageMmap::findSlot(int fileNum) const {
+    size_t index;
+    if (!mapAddr || !slotIndex.find(fileNum, index)) {
+        return nullptr;
+    }
+    return getSlot(index);
+}
+
+void PublishQueueExtStorageMmap::unmap() {
+    if (mapAddr) {
+        munmap(mapAddr, mapSize);
+        mapAddr = nullptr;
+    }
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,888 @@
+#ifndef __PUBLISHQUEUEEXTSTORAGE_H
+#define __PUBLISHQUEUEEXTSTORAGE_H
+
+// Github: https://github.com/rickkas7/PublishQueueExtRK
+// License: MIT
+
+#include "Particle.h"
+#include "SequentialFileRK.h" // https://github.com/rickkas7/SequentialFileRK
+
+#include <vector>
+
+/**
+ * @brief Circular buffer used for the queue order
+ *
+ * Unlike std::deque, this does not allocate or free memory while events flow through the
+ * queue. Storage only grows when the number of entries exceeds the previous maximum.
+ */
+template<class T>
+class PublishQueueExtRing {
+public:
+    /**
+     * @brief Number of entries in the buffer
+     */
+    size_t size() const { return count; };
+
+    /**
+     * @brief Returns true if there are no entries in the buffer
+     */
+    bool empty() const { return count == 0; };
+
+    /**
+     * @brief Gets an entry by index, 0 = front (oldest)
+     */
+    T &operator[](size_t index) { return buf[(head + index) % buf.size()]; };
+
+    /**
+     * @brief Gets an entry by index, 0 = front (oldest)
+     */
+    const T &operator[](size_t index) const { return buf[(head + index) % buf.size()]; };
+
+    /**
+     * @brief Gets the front (oldest) entry. Must not be called when empty.
+     */
+    T &front() { return buf[head]; };
+
+    /**
+     * @brief Gets the front (oldest) entry. Must not be called when empty.
+     */
+    const T &front() const { return buf[head]; };
+
+    /**
+     * @brief Gets the back (newest) entry. Must not be called when empty.
+     */
+    T &back() { return (*this)[count - 1]; };
+
+    /**
+     * @brief Add an entry to the back
+     */
+    void push_back(const T &value) {
+        if (count == buf.size()) {
+            grow();
+        }
+        buf[(head + count++) % buf.size()] = value;
+    };
+
+    /**
+     * @brief Remove the front entry
+     */
+    void pop_front() {
+        if (count) {
+            head = (head + 1) % buf.size();
+            count--;
+        }
+    };
+
+    /**
+     * @brief Insert an entry so it's at index, moving later entries back
+     */
+    void insert(size_t index, const T &value) {
+        push_back(value);
+        for(size_t ii = count - 1; ii > index; ii--) {
+            (*this)[ii] = (*this)[ii - 1];
+        }
+        (*this)[index] = value;
+    };
+
+    /**
+     * @brief Remove the entry at index, moving later entries forward
+     */
+    void erase(size_t index) {
+        if (index == 0) {
+            pop_front();
+            return;
+        }
+        for(size_t ii = index; ii + 1 < count; ii++) {
+            (*this)[ii] = (*this)[ii + 1];
+        }
+        count--;
+    };
+
+    /**
+     * @brief Remove entries from the back so there are newCount entries
+     */
+    void truncate(size_t newCount) {
+        if (newCount < count) {
+            count = newCount;
+        }
+    };
+
+    /**
+     * @brief Remove all entries. Does not free the storage.
+     */
+    void clear() { head = count = 0; };
+
+protected:
+    /**
+     * @brief Double the capacity, moving the entries so the front is at index 0
+     */
+    void grow() {
+        std::vector<T> newBuf(buf.empty() ? 16 : buf.size() * 2);
+        for(size_t ii = 0; ii < count; ii++) {
+            newBuf[ii] = (*this)[ii];
+        }
+        buf.swap(newBuf);
+        head = 0;
+    };
+
+    std::vector<T> buf; //!< Storage for entries
+    size_t head = 0; //!< Index into buf of the front entry
+    size_t count = 0; //!< Number of entries
+};
+
+/**
+ * @brief Hash table from file number to a record or slot index
+ *
+ * Used by the RAM and memory mapped backends so finding a record does not require a scan.
+ * File numbers are assigned sequentially, so the file number is used as the hash and the
+ * records in the queue normally occupy consecutive buckets. Like PublishQueueExtRing, storage
+ * only grows when the number of entries exceeds the previous maximum.
+ */
+class PublishQueueExtFileNumIndex {
+public:
+    /**
+     * @brief Find the value for a file number
+     *
+     * @param fileNum The file number (> 0)
+     * @param value Filled in with the value if found
+     * @return true if the file number is in the index
+     */
+    bool find(int fileNum, size_t &value) const;
+
+    /**
+     * @brief Add a file number to the index, or replace its value if already present
+     *
+     * @param fileNum The file number (> 0)
+     * @param value The value to store
+     */
+    void insert(int fileNum, size_t value);
+
+    /**
+     * @brief Remove a file number from the index, if present
+     */
+    void erase(int fileNum);
+
+    /**
+     * @brief Remove all entries. Does not free the storage.
+     */
+    void clear();
+
+    /**
+     * @brief Number of entries in the index
+     */
+    size_t size() const { return count; };
+
+protected:
+    /**
+     * @brief A bucket in the open addressing table
+     */
+    struct Bucket {
+        int fileNum = 0; //!< File number, or 0 if the bucket is empty
+        size_t value = 0; //!< Value for the file number
+    };
+
+    /**
+     * @brief Gets the home bucket for a file number. The number of buckets is a power of 2.
+     */
+    size_t bucketFor(int fileNum) const { return (size_t)fileNum & (buckets.size() - 1); };
+
+    /**
+     * @brief Double the number of buckets and rehash the entries
+     */
+    void grow();
+
+    std::vector<Bucket> buckets; //!< Buckets, linear probing
+    size_t count = 0; //!< Number of entries
+};
+
+/**
+ * @brief Entry in the queue index kept in RAM
+ *
+ * Only the file number is known when a record is found in storage at setup. The other
+ * fields are filled in from the record trailer the first time they're needed, and are
+ * set directly when an event is queued, so inspecting the queue does not require reading
+ * the event data.
+ */
+struct PublishQueueExtIndexEntry {
+    static const uint8_t kFlagLoaded = 0x01; //!< dataSize, timestamp, expires, contentType, nameId, and sequence are valid
+    static const uint8_t kFlagInvalid = 0x02; //!< The record trailer could not be read or is corrupted
+    static const uint8_t kFlagVerified = 0x04; //!< The record CRC has been checked
+
+    int fileNum = 0; //!< File number of the record
+    uint32_t dataSize = 0; //!< Size of the event data in bytes
+    uint32_t timestamp = 0; //!< Time.now() value when queued, or 0 if the time was not valid
+    uint32_t expires = 0; //!< Time.now() value after which the event is discarded, or 0 if it does not expire
+    uint16_t contentType = 0; //!< ContentType of the event data
+    uint16_t nameId = 0; //!< Registered event name ID, or 0 if the name is in the meta data
+    uint32_t sequence = 0; //!< Sequence number, or 0 if not used
+    uint8_t flags = 0; //!< kFlagLoaded, kFlagInvalid, kFlagVerified
+};
+
+/**
+ * @brief Abstract storage backend for the publish queue
+ *
+ * Each queued event is stored as a record identified by a positive integer file number.
+ * The record contains the event data, followed by the JSON meta data, followed by a
+ * PublishQueueExtBase::QueueFileTrailerExt, followed by a PublishQueueExtBase::QueueFileTrailer. The record layout is managed by PublishQueueExt;
+ * the backend only stores and retrieves bytes.
+ *
+ * The order of the queue is maintained by this base class in RAM; backends call
+ * addToQueue() from setup() for each record found in storage, in oldest to newest order.
+ *
+ * Backends provided:
+ * - PublishQueueExtStoragePosix: POSIX flash file system using SequentialFileRK (default)
+ * - PublishQueueExtStorageRam: RAM only, events are lost on reset
+ * - PublishQueueExtStorageMmap: memory mapped file, Linux host builds only
+ */
+class PublishQueueExtStorage {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueExtStorage();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueExtStorage();
+
+    /**
+     * @brief Sets the directory to use for storage, if the backend uses one
+     *
+     * @param dirPath the pathname, Unix-style with / as the directory separator.
+     */
+    virtual PublishQueueExtStorage &withDirPath(const char *dirPath) { return *this; };
+
+    /**
+     * @brief Gets the directory path, or an empty string if the backend does not use one
+     */
+    virtual const char *getDirPath() const { return ""; };
+
+    /**
+     * @brief Returns true if records and aux blobs are kept across a reset
+     *
+     * Sequence numbers require persistent storage, as the reserved block is stored as an aux blob.
+     */
+    virtual bool isPersistent() const { return true; };
+
+    /**
+     * @brief Initialize the backend and add existing records to the queue
+     *
+     * @return true on success or false if the storage could not be initialized
+     */
+    virtual bool setup() = 0;
+
+    /**
+     * @brief Reserve a new file number. The file number is larger than any previously used.
+     *
+     * @return A file number (> 0) or 0 on error
+     *
+     * The record is not added to the queue until addToQueue() is called.
+     */
+    virtual int reserve() = 0;
+
+    /**
+     * @brief Returns true if reserve() would fail because there is no room for another record
+     *
+     * Backends with a fixed number of records, such as the mmap backend, return true when all of
+     * them are in use, so publish() discards a queued event to make room before saving a new one.
+     * The default implementation returns false.
+     */
+    virtual bool isFull() const { return false; };
+
+    /**
+     * @brief Append bytes to the end of a record, creating it if necessary
+     *
+     * @param fileNum The file number returned from reserve()
+     * @param buf Pointer to the data to append
+     * @param len Number of bytes to append
+     * @return true on success or false on error
+     */
+    virtual bool append(int fileNum, const void *buf, size_t len) = 0;
+
+    /**
+     * @brief Read bytes from a record
+     *
+     * @param fileNum The file number of the record to read
+     * @param offset Offset from the beginning of the record
+     * @param buf Buffer to store the data in
+     * @param len Number of bytes to read
+     * @return Number of bytes read (can be less than len at the end of the record) or -1 on error
+     */
+    virtual int readRange(int fileNum, size_t offset, void *buf, size_t len) = 0;
+
+    /**
+     * @brief Gets the size of a record in bytes
+     *
+     * @param fileNum The file number of the record
+     * @param size Filled in with the size of the record in bytes
+     * @return true on success or false if the record does not exist
+     */
+    virtual bool getSize(int fileNum, size_t &size) = 0;
+
+    /**
+     * @brief Remove the stored data for a record. Does not affect the queue order.
+     *
+     * @param fileNum The file number of the record to remove
+     */
+    virtual void removeData(int fileNum) = 0;
+
+    /**
+     * @brief Remove the stored data for all records. Does not affect the queue order.
+     */
+    virtual void removeAllData() = 0;
+
+    /**
+     * @brief Finish accessing a record
+     *
+     * @param fileNum The file number of the record
+     *
+     * Called after writing a record and after reading a record. Backends that cache
+     * open files or buffer writes should close or flush here so the record is durable.
+     */
+    virtual void closeRecord(int fileNum) {};
+
+    /**
+     * @brief Save a small auxiliary blob of data, such as the event name dictionary
+     *
+     * @param name Name of the blob. This is a short identifier that is valid as a file name.
+     * @param buf Pointer to the data
+     * @param len Number of bytes of data
+     * @return true on success or false on error
+     *
+     * The blob replaces any previous blob with the same name. The default implementation
+     * saves it in the file name.aux in getDirPath(), and fails if the backend does not have
+     * a directory.
+     */
+    virtual bool saveAux(const char *name, const void *buf, size_t len);
+
+    /**
+     * @brief Load an auxiliary blob of data saved using saveAux()
+     *
+     * @param name Name of the blob
+     * @param buf Buffer to store the data in
+     * @param bufSize Size of buf in bytes
+     * @return Number of bytes read or -1 if the blob does not exist
+     */
+    virtual int loadAux(const char *name, void *buf, size_t bufSize);
+
+    /**
+     * @brief Store the data for an event at the beginning of a new record
+     *
+     * @param fileNum The file number returned from reserve()
+     * @param event The event to save the data from
+     * @return true on success or false on error
+     *
+     * The default implementation uses append() with the data from CloudEvent::dataBuffer(), which
+     * allocates a copy of the event data. Override this if the backend can save the data without a copy.
+     */
+    virtual bool saveEventData(int fileNum, const CloudEvent &event);
+
+    /**
+     * @brief Load the data for an event from the beginning of a record
+     *
+     * @param fileNum The file number of the record
+     * @param dataSize Number of bytes of event data at the beginning of the record
+     * @param event The event to load the data into
+     * @return true on success or false on error
+     *
+     * The default implementation uses readRange() into a temporary buffer.
+     */
+    virtual bool loadEventData(int fileNum, size_t dataSize, CloudEvent &event);
+
+    /**
+     * @brief Gets the number of bytes of RAM temporarily allocated by saveEventData() for one event
+     *
+     * @param dataSize Number of bytes of event data
+     *
+     * This does not include the data in the CloudEvent. The default saveEventData() copies the data
+     * using CloudEvent::dataBuffer().
+     */
+    virtual size_t getSaveRamSize(size_t dataSize) const { return dataSize; };
+
+    /**
+     * @brief Gets the number of bytes of RAM temporarily allocated by loadEventData() for one event
+     *
+     * @param dataSize Number of bytes of event data
+     *
+     * This does not include the data in the CloudEvent. The default loadEventData() reads the data
+     * into a buffer of dataSize bytes.
+     */
+    virtual size_t getLoadRamSize(size_t dataSize) const { return dataSize; };
+
+    /**
+     * @brief Add a record to the end of the queue
+     *
+     * @param fileNum The file number of the record
+     */
+    void addToQueue(int fileNum);
+
+    /**
+     * @brief Add a record to the end of the queue with its index information
+     *
+     * @param entry The index entry for the record
+     */
+    void addToQueue(const PublishQueueExtIndexEntry &entry);
+
+    /**
+     * @brief Add a record to the queue in file number order
+     *
+     * @param entry The index entry for the record
+     *
+     * This is the same as addToQueue() unless the file number is older than records already in
+     * the queue, which happens when a record is saved after its file number was reserved.
+     */
+    void insertInQueue(const PublishQueueExtIndexEntry &entry);
+
+    /**
+     * @brief Gets the number of records in the queue
+     */
+    int getQueueLen() const { return (int)queue.size(); };
+
+    /**
+     * @brief Gets the file number at the front of the queue (oldest), or 0 if the queue is empty
+     */
+    int getFirstInQueue() const { return queue.empty() ? 0 : queue.front().fileNum; };
+
+    /**
+     * @brief Gets the index entry for a record in the queue
+     *
+     * @param index 0 = front (oldest). Must be less than getQueueLen().
+     */
+    PublishQueueExtIndexEntry &getQueueEntry(size_t index) { return queue[index]; };
+
+    /**
+     * @brief Find the index entry for a record in the queue
+     *
+     * @param fileNum The file number of the record
+     * @return A pointer to the entry or nullptr if the record is not in the queue
+     */
+    PublishQueueExtIndexEntry *findQueueEntry(int fileNum);
+
+    /**
+     * @brief Remove the second record from the queue, leaving the data in place
+     *
+     * @param keepFileNum A record that must not be removed, such as the one being sent, or 0 for none.
+     * If it is the second record, the third record is removed instead.
+     *
+     * @return The file number that was removed from the queue or 0 if no record can be removed
+     *
+     * The first record is not removed because it may be in the process of being sent.
+     */
+    int removeSecondFromQueue(int keepFileNum = 0);
+
+    /**
+     * @brief Remove the last (newest) record from the queue, leaving the data in place
+     *
+     * @param keepFileNum A record that must not be removed, such as the one being sent, or 0 for none.
+     * If it is the last record, the record before it is removed instead.
+     *
+     * @return The file number that was removed from the queue or 0 if no record can be removed
+     */
+    int removeLastFromQueue(int keepFileNum = 0);
+
+    /**
+     * @brief Remove a record from the queue, leaving the data in place
+     *
+     * @param fileNum The file number of the record
+     * @return true if the record was in the queue
+     */
+    bool removeFromQueue(int fileNum);
+
+    /**
+     * @brief Remove a record from the queue and remove its data
+     *
+     * @param fileNum The file number of the record
+     */
+    void remove(int fileNum);
+
+    /**
+     * @brief Remove all records from the queue and remove their data
+     */
+    void removeAll();
+
+    /**
+     * @brief Remove records matching a predicate from the queue and remove their data
+     *
+     * @param pred Function called for each record in the queue, oldest first. Return true to remove it.
+     * @return The number of records removed
+     *
+     * This is done in a single pass; the order of the remaining records is preserved.
+     */
+    size_t removeIf(std::function<bool(PublishQueueExtIndexEntry &entry)> pred);
+
+    /**
+     * @brief Call a function for each record in the queue, oldest first
+     *
+     * @param cb Callback function. Return true to continue or false to stop enumerating.
+     *
+     * The callback must not modify the queue.
+     */
+    void enumerate(std::function<bool(int fileNum)> cb) const;
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueExtStorage(const PublishQueueExtStorage&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueExtStorage& operator=(const PublishQueueExtStorage&) = delete;
+
+    PublishQueueExtRing<PublishQueueExtIndexEntry> queue; //!< Index entries for the records in the queue, oldest first
+};
+
+/**
+ * @brief Storage backend using the POSIX flash file system with one file per event
+ *
+ * This is the default backend. File names and numbering are managed by SequentialFileRK.
+ */
+class PublishQueueExtStoragePosix : public PublishQueueExtStorage {
+public:
+    static const size_t kMaxPathLen = 128; //!< Maximum length of a path, including the null terminator
+    static const size_t kCopyBufSize = 512; //!< Size of the buffer used to copy event data to temp.dat
+
+    /**
+     * @brief Constructor
+     */
+    PublishQueueExtStoragePosix();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueExtStoragePosix();
+
+    virtual PublishQueueExtStorage &withDirPath(const char *dirPath) override { fileQueue.withDirPath(dirPath); return *this; };
+
+    /**
+     * @brief Store queue files in subdirectories of the queue directory (default: 0, flat)
+     *
+     * @param filesPerShard Number of file numbers in each subdirectory, or 0 to store all files in the queue directory
+     *
+     * With large queues (thousands of events), directory operations get slower as the number of files
+     * in a directory increases. Sharding stores file number n in the subdirectory n / filesPerShard,
+     * so each directory holds at most filesPerShard files. Files in the flat layout are moved into
+     * subdirectories by setup(). Must be called before setup().
+     *
+     * Once sharding has been enabled, do not disable it without first clearing the queue, as
+     * files in subdirectories are not found using the flat layout.
+     */
+    PublishQueueExtStoragePosix &withShardSize(int filesPerShard) { shardSize = (filesPerShard > 0) ? filesPerShard : 0; return *this; };
+
+    /**
+     * @brief Gets the shard size, or 0 if using the flat layout
+     */
+    int getShardSize() const { return shardSize; };
+
+    virtual const char *getDirPath() const override { return fileQueue.getDirPath(); };
+    virtual bool setup() override;
+    virtual int reserve() override;
+    virtual bool append(int fileNum, const void *buf, size_t len) override;
+    virtual int readRange(int fileNum, size_t offset, void *buf, size_t len) override;
+    virtual bool getSize(int fileNum, size_t &size) override;
+    virtual void removeData(int fileNum) override;
+    virtual void removeAllData() override;
+    virtual void closeRecord(int fileNum) override;
+
+    /**
+     * @brief Saves the event data using CloudEvent::saveData() directly to the queue file
+     */
+    virtual bool saveEventData(int fileNum, const CloudEvent &event) override;
+
+    /**
+     * @brief Copies the event data to temp.dat and loads it using CloudEvent::loadData()
+     */
+    virtual bool loadEventData(int fileNum, size_t dataSize, CloudEvent &event) override;
+
+    /**
+     * @brief No RAM is allocated per event; CloudEvent::saveData() writes the file directly
+     */
+    virtual size_t getSaveRamSize(size_t dataSize) const override { return 0; };
+
+    /**
+     * @brief No RAM is allocated per event; copyBuf is part of this object
+     */
+    virtual size_t getLoadRamSize(size_t dataSize) const override { return 0; };
+
+    /**
+     * @brief Gets the SequentialFile object used to manage the directory
+     */
+    SequentialFile &getSequentialFile() { return fileQueue; };
+
+    /**
+     * @brief Gets the path to a queue file
+     *
+     * @param fileNum The file number
+     * @return Pointer to the path. It is only valid until the next call to getPathForFileNum().
+     *
+     * Once setup() has determined the SequentialFile naming scheme, this does not allocate memory.
+     */
+    const char *getPathForFileNum(int fileNum);
+
+protected:
+    /**
+     * @brief Gets the path to a queue file in the flat layout, ignoring the shard size
+     *
+     * If setup() could not match the SequentialFile naming scheme (nameLen == 0), this uses
+     * SequentialFile::getPathForFileNum(), which allocates a String.
+     */
+    const char *getFlatPathForFileNum(int fileNum);
+
+    /**
+     * @brief Gets the path to a shard directory
+     *
+     * @param shard The shard number (fileNum / shardSize)
+     * @return Pointer to the path in pathBuf. It is only valid until the next call to a path function.
+     */
+    const char *getShardDirPath(int shard);
+
+    /**
+     * @brief Create the shard directory for a file number if necessary
+     */
+    void ensureShardDir(int fileNum);
+
+    /**
+     * @brief Gets the shard numbers of the shard directories, sorted
+     */
+    void readShardDirs(std::vector<int> &shards);
+
+    /**
+     * @brief Add the files in shard directories to the queue and remove empty shard directories
+     */
+    void scanShards();
+
+    /**
+     * @brief Get a file descriptor for a file number, opening it if necessary
+     *
+     * @param fileNum The file number to open
+     * @param create true to create the file if it does not exist
+     * @return A file descriptor or -1 on error. Do not close it; use closeCachedFile().
+     *
+     * The most recently used file is kept open because the dequeue path reads the
+     * trailer, meta data, and event data from the same file in succession.
+     */
+    int openFileNum(int fileNum, bool create = false);
+
+    /**
+     * @brief Close the cached file descriptor, if open
+     */
+    void closeCachedFile();
+
+    /**
+     * @brief SequentialFileRK library object for maintaining the queue of files on the POSIX file system
+     */
+    SequentialFile fileQueue;
+
+    /**
+     * @brief File used for temporary data
+     */
+    const char *tempFileName = "temp.dat";
+    char tempFilePath[kMaxPathLen]; //!< Full path name to tempFileName
+    char pathBuf[kMaxPathLen]; //!< Buffer returned by getPathForFileNum()
+    int nameLen = 0; //!< Digits in a queue file name, or 0 to use SequentialFile::getPathForFileNum()
+    uint8_t copyBuf[kCopyBufSize]; //!< Buffer used to copy event data to temp.dat
+
+    int cachedFd = -1; //!< File descriptor of the most recently used file, or -1
+    int cachedFileNum = 0; //!< File number for cachedFd
+
+    int shardSize = 0; //!< Number of file numbers per shard directory, 0 = flat layout
+    int lastFileNum = 0; //!< Last file number reserved, when using shards
+    int lastShardDir = -1; //!< Most recent shard directory known to exist, or -1
+};
+
+/**
+ * @brief Storage backend that keeps events in RAM
+ *
+ * Events are lost on reset or power loss. This is useful for volatile high-rate queues,
+ * devices without a file system budget, and for measuring queue overhead independent
+ * of flash performance.
+ */
+class PublishQueueExtStorageRam : public PublishQueueExtStorage {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueExtStorageRam();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueExtStorageRam();
+
+    virtual bool setup() override;
+    virtual int reserve() override;
+    virtual bool append(int fileNum, const void *buf, size_t len) override;
+    virtual int readRange(int fileNum, size_t offset, void *buf, size_t len) override;
+    virtual bool getSize(int fileNum, size_t &size) override;
+    virtual void removeData(int fileNum) override;
+    virtual void removeAllData() override;
+
+    /**
+     * @brief Loads the event data directly from RAM without an intermediate copy
+     */
+    virtual bool loadEventData(int fileNum, size_t dataSize, CloudEvent &event) override;
+
+    /**
+     * @brief No RAM is allocated per event; the data is loaded from the record
+     */
+    virtual size_t getLoadRamSize(size_t dataSize) const override { return 0; };
+
+    /**
+     * @brief Events and aux blobs are lost on reset
+     */
+    virtual bool isPersistent() const override { return false; };
+
+    /**
+     * @brief Saves the blob in RAM
+     */
+    virtual bool saveAux(const char *name, const void *buf, size_t len) override;
+
+    /**
+     * @brief Loads a blob saved in RAM
+     */
+    virtual int loadAux(const char *name, void *buf, size_t bufSize) override;
+
+protected:
+    /**
+     * @brief A stored event. Records are reused so the data vectors keep their capacity.
+     */
+    struct Record {
+        int fileNum = 0; //!< File number, or 0 if this record is free
+        std::vector<uint8_t> data; //!< Record data
+    };
+
+    /**
+     * @brief Find a record by file number using recordIndex
+     *
+     * @return A pointer to the record or nullptr if not found
+     */
+    Record *findRecord(int fileNum);
+
+    /**
+     * @brief An auxiliary blob saved using saveAux()
+     */
+    struct AuxRecord {
+        String name; //!< Name of the blob
+        std::vector<uint8_t> data; //!< Blob data
+    };
+
+    std::vector<Record> records; //!< Records, both in use and free
+    std::vector<size_t> freeRecords; //!< Indexes into records of the free records
+    PublishQueueExtFileNumIndex recordIndex; //!< Index into records, by file number
+    std::vector<AuxRecord> auxRecords; //!< Auxiliary blobs
+    int lastFileNum = 0; //!< Last file number returned by reserve()
+};
+
+#if defined(__linux__)
+
+/**
+ * @brief Storage backend using a memory mapped file, for Linux host builds
+ *
+ * The file is divided into fixed-size slots, one event per slot. Each slot begins with
+ * a SlotHeader. The file persists across runs, like the POSIX backend, but reads and writes
+ * are memory copies.
+ */
+class PublishQueueExtStorageMmap : public PublishQueueExtStorage {
+public:
+    /**
+     * @brief Header at the beginning of the mapped file
+     */
+    struct FileHeader { // 16 bytes
+        uint32_t magic; //!< kFileHeaderMagic
+        uint32_t slotSize; //!< size of each slot in bytes, including SlotHeader
+        uint32_t numSlots; //!< number of slots
+        uint32_t reserved; //!< not used, set to 0
+    };
+
+    /**
+     * @brief Header at the beginning of each slot
+     */
+    struct SlotHeader { // 8 bytes
+        uint32_t fileNum; //!< file number using this slot, or 0 if free
+        uint32_t size; //!< number of bytes of record data following this header
+    };
+
+    static const uint32_t kFileHeaderMagic = 0x2c8b91e4; //!< Magic bytes stored in the FileHeader structure
+
+    /**
+     * @brief Constructor
+     */
+    PublishQueueExtStorageMmap();
+
+    /**
+     * @brief Destructor. Unmaps and closes the file.
+     */
+    virtual ~PublishQueueExtStorageMmap();
+
+    /**
+     * @brief Sets the number and size of slots (default: 100 slots of 17408 bytes)
+     *
+     * @param numSlots Maximum number of events that can be stored
+     * @param slotSize Size of each slot in bytes. Must hold the largest event, meta data, and trailer.
+     *
+     * Must be called before setup(). If the existing file uses a different layout, it is reinitialized.
+     * When all of the slots are in use, publish() discards a queued event using the eviction policy
+     * before saving a new one, so the queue holds at most numSlots events even if the file queue
+     * size (withFileQueueSize()) is larger.
+     */
+    PublishQueueExtStorageMmap &withSlots(size_t numSlots, size_t slotSize) { this->numSlots = numSlots; this->slotSize = slotSize; return *this; };
+
+    virtual PublishQueueExtStorage &withDirPath(const char *dirPath) override;
+    virtual const char *getDirPath() const override { return dirPath.c_str(); };
+    virtual bool setup() override;
+    virtual int reserve() override;
+
+    /**
+     * @brief Returns true if all of the slots are in use
+     */
+    virtual bool isFull() const override { return freeSlots.empty(); };
+
+    virtual bool append(int fileNum, const void *buf, size_t len) override;
+    virtual int readRange(int fileNum, size_t offset, void *buf, size_t len) override;
+    virtual bool getSize(int fileNum, size_t &size) override;
+    virtual void removeData(int fileNum) override;
+    virtual void removeAllData() override;
+
+    /**
+     * @brief Loads the event data directly from the mapping without an intermediate copy
+     */
+    virtual bool loadEventData(int fileNum, size_t dataSize, CloudEvent &event) override;
+
+    /**
+     * @brief No RAM is allocated per event; the data is loaded from the mapping
+     */
+    virtual size_t getLoadRamSize(size_t dataSize) const override { return 0; };
+
+protected:
+    /**
+     * @brief Gets the slot header for a slot index
+     */
+    SlotHeader *getSlot(size_t index) const { return (SlotHeader *)(mapAddr + sizeof(FileHeader) + index * slotSize); };
+
+    /**
+     * @brief Gets the slot header for a file number or nullptr if not found
+     */
+    SlotHeader *findSlot(int fileNum) const;
+
+    /**
+     * @brief Unmap and close the file
+     */
+    void unmap();
+
+    String dirPath; //!< Directory containing the mapped file
+    String fileName = "queue.mmap"; //!< Name of the mapped file in dirPath
+    size_t numSlots = 100; //!< Number of slots
+    size_t slotSize = 17408; //!< Size of each slot in bytes, including the SlotHeader
+    int fd = -1; //!< File descriptor for the mapped file
+    uint8_t *mapAddr = nullptr; //!< Address of the mapping
+    size_t mapSize = 0; //!< Size of the mapping in bytes
+    PublishQueueExtFileNumIndex slotIndex; //!< Slot index, by file number
+    std::vector<size_t> freeSlots; //!< Indexes of the free slots, lowest index last
+    int lastFileNum = 0; //!< Last file number returned by reserve()
+};
+
+#endif /* __linux__ */
+
+#endif /* __PUBLISHQUEUEEXTSTORAGE_H */
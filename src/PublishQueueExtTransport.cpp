@@ -0,0 +1,124 @@
+#include "PublishQueueExtTransport.h"
+#include "PublishQueueExtStorage.h"
+
+#include <unistd.h>
+
+static Logger _log("app.pubq");
+
+//
+// PublishQueueExtTransportCloud
+//
+bool PublishQueueExtTransportCloud::connected() {
+    return Particle.connected();
+}
+
+bool PublishQueueExtTransportCloud::canSend(const CloudEvent &event) {
+    return CloudEvent::canPublish(event.size());
+}
+
+bool PublishQueueExtTransportCloud::send(CloudEvent &event) {
+    sendFailed = !Particle.publish(event);
+    return !sendFailed;
+}
+
+PublishQueueExtTransport::Status PublishQueueExtTransportCloud::poll(CloudEvent &event) {
+    if (sendFailed) {
+        return Status::INVALID;
+    }
+    if (event.isSending()) {
+        return Status::SENDING;
+    }
+    if (!event.isValid()) {
+        return Status::INVALID;
+    }
+    if (event.isSent()) {
+        return Status::SENT;
+    }
+    return Status::FAILED;
+}
+
+//
+// PublishQueueExtTransportFramed
+//
+bool PublishQueueExtTransportFramed::connected() {
+    return isConnected && (print || fd != -1);
+}
+
+bool PublishQueueExtTransportFramed::send(CloudEvent &event) {
+    Buffer data = event.dataBuffer();
+
+    return frameWritten(writeHeader(event, data.size()) && writeBytes(data.data(), data.size()));
+}
+
+bool PublishQueueExtTransportFramed::sendFromStorage(CloudEvent &event, PublishQueueExtStorage &storage, int fileNum, size_t dataSize) {
+    bool bResult = writeHeader(event, dataSize);
+
+    for(size_t offset = 0; bResult && offset < dataSize; ) {
+        size_t count = dataSize - offset;
+        if (count > sizeof(copyBuf)) {
+            count = sizeof(copyBuf);
+        }
+        if (storage.readRange(fileNum, offset, copyBuf, count) != (int)count) {
+            // Nothing can be written to finish the frame, so the receiver resynchronizes using the magic bytes
+            _log.error("failed to read event data %d", fileNum);
+            bResult = false;
+            break;
+        }
+        bResult = writeBytes(copyBuf, count);
+        offset += count;
+    }
+
+    return frameWritten(bResult);
+}
+
+bool PublishQueueExtTransportFramed::writeHeader(const CloudEvent &event, size_t dataSize) {
+    const char *name = event.name();
+    size_t nameLen = strlen(name);
+
+    lastStatus = Status::FAILED;
+    if (nameLen > 255) {
+        lastStatus = Status::INVALID;
+        return false;
+    }
+
+    FrameHeader header = {0};
+    header.magic = kFrameMagic;
+    header.nameLen = (uint8_t) nameLen;
+    header.contentType = (uint16_t) event.contentType();
+    header.dataSize = (uint32_t) dataSize;
+
+    return writeBytes(&header, sizeof(header)) && writeBytes(name, nameLen);
+}
+
+bool PublishQueueExtTransportFramed::frameWritten(bool bResult) {
+    if (bResult) {
+        lastStatus = Status::SENT;
+        frameCount++;
+    }
+    else
+    if (lastStatus != Status::INVALID) {
+        // A partial frame may have been written; the receiver resynchronizes using the magic bytes
+        _log.info("failed to write frame");
+    }
+    return bResult;
+}
+
+bool PublishQueueExtTransportFramed::writeBytes(const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *) buf;
+
+    while(len > 0) {
+        int count;
+        if (print) {
+            count = (int) print->write(p, len);
+        }
+        else {
+            count = (int) write(fd, p, len);
+        }
+        if (count <= 0) {
+            return false;
+        }
+        p += count;
+        len -= count;
+    }
+    return true;
+}
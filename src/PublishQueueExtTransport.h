@@ -0,0 +1,264 @@
+#ifndef __PUBLISHQUEUEEXTTRANSPORT_H
+#define __PUBLISHQUEUEEXTTRANSPORT_H
+
+// Github: https://github.com/rickkas7/PublishQueueExtRK
+// License: MIT
+
+#include "Particle.h"
+
+class PublishQueueExtStorage;
+
+/**
+ * @brief Abstract transport used to send events from the publish queue
+ *
+ * The state machine in PublishQueueExtBase calls connected() and canSend() to decide when
+ * to send, send() to start sending an event, then poll() until the send completes.
+ *
+ * Transports provided:
+ * - PublishQueueExtTransportCloud: Particle.publish() to the Particle cloud (default)
+ * - PublishQueueExtTransportFramed: framed events written to a Print object or file descriptor
+ */
+class PublishQueueExtTransport {
+public:
+    /**
+     * @brief Result of poll()
+     */
+    enum class Status {
+        SENDING, //!< Send is still in progress
+        SENT, //!< Event was sent successfully and can be removed from the queue
+        FAILED, //!< Send failed; the event stays in the queue and will be retried
+        INVALID //!< Event can never be sent and will be discarded
+    };
+
+    /**
+     * @brief Constructor
+     */
+    PublishQueueExtTransport() {};
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueExtTransport() {};
+
+    /**
+     * @brief Returns true if the transport is able to send events
+     */
+    virtual bool connected() = 0;
+
+    /**
+     * @brief Returns true if an event of this size can be sent now
+     *
+     * @param event The event to send. Only the size and content type should be needed.
+     *
+     * Return false if rate limited; the state machine will try again later.
+     */
+    virtual bool canSend(const CloudEvent &event) = 0;
+
+    /**
+     * @brief Start sending an event
+     *
+     * @param event The event to send. The object remains valid until poll() returns a value
+     * other than Status::SENDING.
+     * @return true if sending was started or false if it failed immediately
+     *
+     * If this returns false, the event is discarded unless poll() returns Status::FAILED.
+     */
+    virtual bool send(CloudEvent &event) = 0;
+
+    /**
+     * @brief Check whether sending an event has completed
+     *
+     * @param event The event that was passed to send()
+     * @return A Status value
+     */
+    virtual Status poll(CloudEvent &event) = 0;
+
+    /**
+     * @brief Returns true if sendFromStorage() is implemented (default: false)
+     */
+    virtual bool canSendFromStorage() const { return false; };
+
+    /**
+     * @brief Start sending a queued event, reading the data from storage instead of a CloudEvent
+     *
+     * @param event The event to send. It has the name and content type, but no data.
+     * @param storage The storage backend to read the data from using readRange()
+     * @param fileNum The file number of the record
+     * @param dataSize Number of bytes of event data at the beginning of the record
+     * @return true if sending was started or false if it failed immediately, as for send()
+     *
+     * Only called if canSendFromStorage() returns true. The data must be read before this returns;
+     * the record is closed afterwards. This lets a transport send an event of any size without
+     * loading the data into RAM. canSend() and poll() are called with the same event, without data.
+     */
+    virtual bool sendFromStorage(CloudEvent &event, PublishQueueExtStorage &storage, int fileNum, size_t dataSize) { return false; };
+
+    /**
+     * @brief Returns true if the transport is rate limited
+     *
+     * When true (the default), the state machine waits the pacing policy's wait between publish
+     * time between events. When false, the next event is sent on the next call to loop().
+     */
+    virtual bool isRateLimited() const { return true; };
+};
+
+/**
+ * @brief Transport that publishes events to the Particle cloud using Particle.publish() (default)
+ */
+class PublishQueueExtTransportCloud : public PublishQueueExtTransport {
+public:
+    /**
+     * @brief Returns Particle.connected()
+     */
+    virtual bool connected() override;
+
+    /**
+     * @brief Returns CloudEvent::canPublish() for the event size
+     */
+    virtual bool canSend(const CloudEvent &event) override;
+
+    /**
+     * @brief Calls Particle.publish()
+     */
+    virtual bool send(CloudEvent &event) override;
+
+    /**
+     * @brief Checks the CloudEvent status
+     */
+    virtual Status poll(CloudEvent &event) override;
+
+protected:
+    bool sendFailed = false; //!< Particle.publish() failed immediately; the event is discarded instead of retried
+};
+
+/**
+ * @brief Transport that writes framed events to a stream, such as a USB serial port, pipe, or file
+ *
+ * This is used to drain the queue over a faster local link, or for testing without a network.
+ * Each event is written as a frame, all integers little endian:
+ *
+ * | Offset | Size | Description |
+ * | :--- | :--- | :--- |
+ * | 0 | 4 | Magic bytes kFrameMagic (0x46515150, "PQQF") |
+ * | 4 | 1 | Length of the event name in bytes (nameLen) |
+ * | 5 | 1 | Reserved, 0 |
+ * | 6 | 2 | ContentType |
+ * | 8 | 4 | Size of the event data in bytes (dataSize) |
+ * | 12 | nameLen | Event name, not null terminated |
+ * | 12 + nameLen | dataSize | Event data |
+ *
+ * Queued events are streamed from storage using sendFromStorage(), so the event data is not loaded
+ * into RAM. Writes are synchronous; an event is sent when send() returns. There is no acknowledgement, so
+ * the receiver should use the sequence of frames and the magic bytes to detect lost data.
+ */
+class PublishQueueExtTransportFramed : public PublishQueueExtTransport {
+public:
+    static const uint32_t kFrameMagic = 0x46515150; //!< Magic bytes at the beginning of each frame
+    static const size_t kCopyBufSize = 512; //!< Size of the buffer used to copy queued event data to the stream
+
+    /**
+     * @brief Frame header, written before the event name and data
+     */
+    struct FrameHeader { // 12 bytes
+        uint32_t magic; //!< kFrameMagic
+        uint8_t nameLen; //!< Length of the event name in bytes
+        uint8_t reserved; //!< Reserved, 0
+        uint16_t contentType; //!< ContentType of the event data
+        uint32_t dataSize; //!< Size of the event data in bytes
+    };
+
+    /**
+     * @brief Write frames to a Print object, such as Serial or USBSerial1
+     *
+     * @param print The object to write to. It must remain valid while this transport is in use.
+     */
+    PublishQueueExtTransportFramed &withPrint(Print &print) { this->print = &print; fd = -1; return *this; };
+
+    /**
+     * @brief Write frames to an open file descriptor, such as a file or pipe
+     *
+     * @param fd The file descriptor. It is not closed by this class.
+     */
+    PublishQueueExtTransportFramed &withFd(int fd) { this->fd = fd; print = nullptr; return *this; };
+
+    /**
+     * @brief Sets whether the transport is connected (default: true)
+     *
+     * @param value false to stop sending, for example when the service tool is disconnected
+     */
+    PublishQueueExtTransportFramed &withConnected(bool value) { isConnected = value; return *this; };
+
+    /**
+     * @brief Gets the number of frames written
+     */
+    size_t getFrameCount() const { return frameCount; };
+
+    /**
+     * @brief Returns true if there is a Print or file descriptor and withConnected() is true
+     */
+    virtual bool connected() override;
+
+    /**
+     * @brief Always returns true; this transport is not rate limited
+     */
+    virtual bool canSend(const CloudEvent &event) override { return true; };
+
+    /**
+     * @brief Write a frame for the event
+     */
+    virtual bool send(CloudEvent &event) override;
+
+    /**
+     * @brief Returns true; queued events are streamed from storage
+     */
+    virtual bool canSendFromStorage() const override { return true; };
+
+    /**
+     * @brief Write a frame for a queued event, copying the data from storage kCopyBufSize bytes at a time
+     */
+    virtual bool sendFromStorage(CloudEvent &event, PublishQueueExtStorage &storage, int fileNum, size_t dataSize) override;
+
+    /**
+     * @brief Returns the result of the last send()
+     */
+    virtual Status poll(CloudEvent &event) override { return lastStatus; };
+
+    /**
+     * @brief Returns false; events are sent as fast as loop() is called
+     */
+    virtual bool isRateLimited() const override { return false; };
+
+protected:
+    /**
+     * @brief Write the frame header and event name
+     *
+     * @param event The event, for the name and content type
+     * @param dataSize Number of bytes of event data that will follow
+     * @return true if written. If false, lastStatus is set to Status::INVALID if the name is too long.
+     */
+    bool writeHeader(const CloudEvent &event, size_t dataSize);
+
+    /**
+     * @brief Sets lastStatus and the frame count after writing a frame
+     *
+     * @param bResult true if the whole frame was written
+     * @return bResult
+     */
+    bool frameWritten(bool bResult);
+
+    /**
+     * @brief Write bytes to the Print or file descriptor
+     *
+     * @return true if all bytes were written
+     */
+    bool writeBytes(const void *buf, size_t len);
+
+    Print *print = nullptr; //!< Print object to write to, or nullptr
+    int fd = -1; //!< File descriptor to write to, or -1
+    bool isConnected = true; //!< Value set using withConnected()
+    Status lastStatus = Status::FAILED; //!< Result of the last send()
+    size_t frameCount = 0; //!< Number of frames written
+    uint8_t copyBuf[kCopyBufSize]; //!< Buffer used by sendFromStorage()
+};
+
+#endif /* __PUBLISHQUEUEEXTTRANSPORT_H */